@@ -0,0 +1,156 @@
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <error.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* gnulib dependencies */
+#include "argp.h"
+#include "progname.h"
+#include "quote.h"
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/* bgrep-index: builds the n-gram index used by "bgrep --index" */
+
+enum { DEFAULT_BLOCK_SIZE = 1024 * 1024, DEFAULT_BUCKET_BITS = 16, MIN_BUCKET_BITS = 3, MAX_BUCKET_BITS = 24 };
+
+struct index_config {
+	uint64_t block_size;
+	unsigned bucket_bits;
+	const char *index_path;
+	char **paths;
+	int path_count;
+};
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state);
+
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = "<https://github.com/rsharo/bgrep/issues>";
+
+static const char doc[] = "Index every file under each PATH into INDEX, for use with 'bgrep --index=INDEX'"
+	"\v"
+	" Each 4-byte sequence in a file is hashed into one of 2^BITS buckets and\n"
+	" recorded per block of BYTES.  Smaller blocks and more buckets prune better,\n"
+	" especially on high-entropy data, at the cost of a bigger index: the index\n"
+	" takes about 2^BITS / (8 * BYTES) of the size of the data.\n"
+	"\n"
+	" Files that change after indexing are simply searched in full.";
+
+static const char args_doc[] = "INDEX PATH...";
+
+static struct argp_option const options[] = {
+	{ "block-size",  'b', "BYTES", 0, "record grams per block of BYTES (default 1M)", 1 },
+	{ "bucket-bits", 'k', "BITS", 0, "hash grams into 2^BITS buckets (default 16)", 1 },
+	{ 0, 0, 0, 0, 0, 0}
+};
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state) {
+	struct index_config *config = state->input;
+	strtol_error invalid = LONGINT_OK;
+	uintmax_t n;
+
+	switch (key) {
+			case 'b':
+				config->block_size = parse_integer(arg, &invalid);
+				if (invalid == LONGINT_OK && config->block_size == 0) {
+					invalid = LONGINT_INVALID;
+				}
+				break;
+			case 'k':
+				n = parse_integer(arg, &invalid);
+				if (invalid == LONGINT_OK && (n < MIN_BUCKET_BITS || n > MAX_BUCKET_BITS)) {
+					invalid = LONGINT_INVALID;
+				}
+				config->bucket_bits = n;
+				break;
+			case ARGP_KEY_ARGS:
+				config->index_path = state->argv[state->next];
+				config->paths = state->argv + state->next + 1;
+				config->path_count = state->argc - state->next - 1;
+				state->next = state->argc;
+				break;
+			case ARGP_KEY_END:
+				if (config->path_count < 1) {
+					argp_usage(state);
+				}
+				break;
+			default:
+				return ARGP_ERR_UNKNOWN;
+	}
+
+	if (invalid != LONGINT_OK) {
+		char flag[3] = { '-', key, 0 };
+		error(0, 0, "Invalid number for option %s: %s", quote_n(0, flag), quote_n(1, arg));
+		return invalid == LONGINT_OVERFLOW ? EOVERFLOW : EINVAL;
+	}
+	return 0;
+}
+
+
+static int index_tree(struct ngram_index_writer *writer, const char *path) {
+	struct stat s;
+	if (stat(path, &s)) {
+		error(0, errno, "%s", path);
+		return RESULT_ERROR;
+	}
+
+	if (S_ISREG(s.st_mode)) {
+		return ngram_index_add_file(writer, path);
+	} else if (!S_ISDIR(s.st_mode)) {
+		return RESULT_NO_MATCH;  /* devices, fifos and sockets are not indexed */
+	}
+
+	DIR *dir = opendir(path);
+	if (!dir) {
+		error(0, errno, "%s", path);
+		return RESULT_ERROR;
+	}
+
+	int result = RESULT_NO_MATCH;
+	struct dirent *d;
+	while ((d = readdir(dir))) {
+		if (!(strcmp(d->d_name, ".") && strcmp(d->d_name, "..")))
+			continue;
+		char newpath[strlen(path) + strlen(d->d_name) + 2];
+		strcpy(newpath, path);
+		strcat(newpath, "/");
+		strcat(newpath, d->d_name);
+		if (index_tree(writer, newpath) == RESULT_ERROR)
+			result = RESULT_ERROR;
+	}
+	closedir(dir);
+	return result;
+}
+
+
+int main(int argc, char **argv) {
+	struct index_config config = { DEFAULT_BLOCK_SIZE, DEFAULT_BUCKET_BITS, NULL, NULL, 0 };
+	set_program_name(*argv);
+	argp_parse(&argp, argc, argv, 0, 0, &config);
+
+	struct ngram_index_writer *writer = ngram_index_create(config.index_path, config.block_size, config.bucket_bits);
+	if (writer == NULL) {
+		return RESULT_ERROR;
+	}
+
+	int result = 0;
+	int i = 0;
+	for (; i < config.path_count; ++i) {
+		if (index_tree(writer, config.paths[i]) == RESULT_ERROR)
+			result = RESULT_ERROR;
+	}
+
+	if (ngram_index_commit(writer))
+		result = RESULT_ERROR;
+	return result;
+}
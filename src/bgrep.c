@@ -27,29 +27,30 @@
 
 #include "config.h"
 
-#include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <error.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 
 /* gnulib dependencies */
 #include "argp.h"
 #include "progname.h"
 #include "quote.h"
 #include "xstrtol.h"
-#include "xalloc.h"
 
 #include "bgrep.h"
 
 /* Config parameters */
 struct bgrep_config params = { 0 };
-enum { DUMP_PATTERN_KEY = 0x1000 };
-enum { INITIAL_BUFSIZE = 2048, MIN_REALLOC = 16 };
+enum { DUMP_PATTERN_KEY = 0x1000, UNORDERED_KEY, DAEMON_KEY, INDEX_KEY, CACHE_KEY, STATS_KEY, TEE_KEY,
+	CARVE_KEY, CARVE_BEFORE_KEY, CARVE_AFTER_KEY, CARVE_UNTIL_KEY, FOLLOW_KEY,
+	CHECKPOINT_KEY, RESUME_KEY, DIRECT_KEY, DROP_CACHE_KEY, IO_SIZE_KEY, PROGRESS_KEY,
+	PATTERN_FILE_KEY, MASK_FILE_KEY, CONCAT_KEY, DEDUP_KEY };
+
+/* The default --io-size with --direct or --drop-cache */
+enum { DIRECT_IO_SIZE = 1024 * 1024 };
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state);
 
@@ -65,6 +66,7 @@ static const char doc[] = "Search for a byte PATTERN in each FILE or standard in
 	"    wildcard bytes:                 '?\?'\n"
 	"    groupings:                      '(66 6f 6f)'\n"
 	"    repeated bytes/strings/groups:  '(666f6f)*3'\n"
+	"    variable gaps of MIN to MAX:    '?\?{0,4K}'\n"
 	"    escaped quotes in strings:      '\"\\\"quoted\\\"\"'\n"
 	"    any combinations thereof:       '((\"foo\"*3 ?\?)*1k ff \"bar\") * 2'\n"
 	"\n"
@@ -74,8 +76,9 @@ static const char doc[] = "Search for a byte PATTERN in each FILE or standard in
 	"    '\"foo\"00\"bar\"'          Matches \"foo\", a null character, then \"bar\"\n"
 	"    '\"foo\"??\"bar\"'          Matches \"foo\", then any byte, then \"bar\"\n"
 	"    '\"foo\"??*10\"bar\"'       Matches \"foo\", then exactly 10 bytes, then \"bar\"\n"
+	"    '\"foo\"??{0,10}\"bar\"'    Matches \"foo\", then 0 to 10 bytes, then \"bar\"\n"
 	"\n"
-	" BYTES and REPEAT may be followed by the following multiplicative suffixes:\n"
+	" BYTES, REPEAT, MIN and MAX may be followed by these multiplicative suffixes:\n"
 	"   c =1, w =2, b =512, kB =1000, K =1024, MB =1000*1000, M =1024*1024, xM =M\n"
 	"   GB =1000*1000*1000, G =1024*1024*1024, and so on for T, P, E, Z, Y.\n"
 	"\n"
@@ -84,7 +87,8 @@ static const char doc[] = "Search for a byte PATTERN in each FILE or standard in
 static const char args_doc[] =
 	"PATTERN [FILE...]\n"
 	"--hex-pattern=PATTERN [FILE...]\n"
-	"-x PATTERN [FILE...]";
+	"-x PATTERN [FILE...]\n"
+	"--pattern-file=FILE [FILE...]";
 
 static struct argp_option const options[] = {
 	{ "first-only",         'F', 0, 0, "stop searching after the first match in each file", 2 },
@@ -94,17 +98,60 @@ static struct argp_option const options[] = {
 	{ "files-with-matches", 'l', 0, 0, "print the names of files containing matches; implies 'first-only'; disables xxd output mode", 1 },
 	{ "quiet",              'q', 0, 0, "suppress all normal output; implies 'first-only'", 1},
 	{ "recursive",          'r', 0, 0, "descend recursively into directories", 2},
+	{ "follow",             FOLLOW_KEY, 0, 0, "at the end of FILE, wait for it to grow and keep searching; SIGINT or SIGTERM ends the search", 2},
+	{ "tee",                TEE_KEY, "FILE", OPTION_ARG_OPTIONAL, "copy the input to standard output unchanged, and report matches on standard error or in FILE", 2},
+	{ "decompress",         'z', 0, 0, "search the decompressed contents of gzip and zstd files, recognized by their contents; offsets are in the decompressed data", 2},
+	{ "jobs",               'j', "N", 0, "search up to N files in parallel; output keeps command-line order", 2},
+	{ "unordered",          UNORDERED_KEY, 0, 0, "with --jobs, print each file's results as soon as it finishes", 2},
+	{ "direct",             DIRECT_KEY, 0, 0, "read files and block devices with O_DIRECT, bypassing the page cache", 2},
+	{ "drop-cache",         DROP_CACHE_KEY, 0, 0, "read as usual, but drop what was read from the page cache", 2},
+	{ "io-size",            IO_SIZE_KEY, "BYTES", 0, "read BYTES at a time (default 64K, or 1M with --direct or --drop-cache)", 2},
+	{ "progress",           PROGRESS_KEY, 0, 0, "report bytes read, speed and time left on stderr", 2},
+	{ "concat",             CONCAT_KEY, 0, 0, "search the FILEs as one input, in order, so matches can span them; offsets count from the start of the first, and -b adds the FILE and offset within it", 2},
 	{ "skip",               's', "BYTES", 0, "skip or seek BYTES forward before searching", 4 },
 	{ "before-context",     'B', "BYTES", 0, "print BYTES of context before each match if possible (xxd output mode only)", 3 },
 	{ "after-context",      'A', "BYTES", 0, "print BYTES of context after each match if possible (xxd output mode only)", 3 },
 	{ "context",            'C', "BYTES", 0, "print BYTES of context before and after each match if possible (xxd output mode only)", 3 },
 	{ "hex-pattern",        'x', "PATTERN", OPTION_NO_USAGE, "use PATTERN for matching", 4 },
+	{ "pattern-file",       PATTERN_FILE_KEY, "FILE", 0, "match the raw bytes of FILE instead of a PATTERN; long patterns are found by block fingerprints", 4 },
+	{ "mask-file",          MASK_FILE_KEY, "FILE", 0, "with --pattern-file, mask the pattern with the bytes of FILE; zero bits match anything", 4 },
+	{ "index",              INDEX_KEY, "INDEX", 0, "only read the parts of indexed files that can match, using an index from bgrep-index", 4 },
+	{ "cache",              CACHE_KEY, "DIR", 0, "remember results in DIR and reuse them for files that have not changed", 4 },
+	{ "dedup-content",      DEDUP_KEY, 0, 0, "search identical files once, and print the results under each of their names", 4 },
+	{ "checkpoint",         CHECKPOINT_KEY, "FILE", 0, "record in FILE how far each file has been searched, every few seconds", 4 },
+	{ "resume",             RESUME_KEY, 0, 0, "with --checkpoint, carry on from where the recorded search stopped, printing only new results", 4 },
+	{ "stats",              STATS_KEY, "FORMAT", OPTION_ARG_OPTIONAL, "print search statistics on stderr when done; FORMAT is a comma-separated list of 'text' (default), 'json' and 'files' (per-file figures too)", 4 },
+	{ "carve",              CARVE_KEY, "DIR", 0, "write the region around each match to its own file in DIR, named FILE@OFFSET", 5 },
+	{ "carve-before",       CARVE_BEFORE_KEY, "BYTES", 0, "start carved regions BYTES before the match", 5 },
+	{ "carve-after",        CARVE_AFTER_KEY, "BYTES", 0, "end carved regions BYTES after the match; with --carve-until, look no further than that", 5 },
+	{ "carve-until",        CARVE_UNTIL_KEY, "PATTERN", 0, "end carved regions after the first PATTERN that follows the match", 5 },
+	{ "daemon",             DAEMON_KEY, "SOCKET", 0, "send the search to the bgrepd listening on SOCKET; search locally if it is not running", 4 },
 	{ "bgrep-dump-pattern", DUMP_PATTERN_KEY, 0, OPTION_HIDDEN, "dump PATTERN to stdout as raw bytes, then exit (diagnostic only)", 0 },
 	{ 0, 0, 0, 0, 0, 0}
 };
 
 static struct argp argp = { options, parse_opt, args_doc, doc };
-static const char const *STD_IN_FILENAME = "-";
+static const char *STD_IN_FILENAME = "-";
+
+
+/* Parses the argument of --stats into STATS_* flags.  Returns 0 if it is invalid. */
+static int parse_stats_format(const char *arg) {
+	int flags = STATS_ON;
+	while (arg != NULL && *arg) {
+		size_t len = strcspn(arg, ",");
+		if (len == 4 && STRPREFIX(arg, "text")) {
+			flags &= ~STATS_JSON;
+		} else if (len == 4 && STRPREFIX(arg, "json")) {
+			flags |= STATS_JSON;
+		} else if (len == 5 && STRPREFIX(arg, "files")) {
+			flags |= STATS_FILES;
+		} else {
+			return 0;
+		}
+		arg += len + (arg[len] == ',');
+	}
+	return flags;
+}
 
 
 /* Parse a single option. */
@@ -121,7 +168,7 @@ parse_opt (int key, char *arg, struct argp_state *state) {
 				config->bytes_before = parse_integer(arg, &invalid);
 				break;
 			case 'C':
-				config->bytes_before = params.bytes_after = parse_integer(arg, &invalid);
+				config->bytes_before = config->bytes_after = parse_integer(arg, &invalid);
 				break;
 			case 's':
 				config->skip_to = parse_integer(arg, &invalid);
@@ -149,28 +196,105 @@ parse_opt (int key, char *arg, struct argp_state *state) {
 			case 'r':
 				config->recurse = 1;
 				break;
+			case 'z':
+				config->decompress = 1;
+				break;
+			case FOLLOW_KEY:
+				config->follow = 1;
+				break;
+			case TEE_KEY:
+				config->tee = 1;
+				config->tee_report = arg;
+				break;
+			case 'j':
+				config->jobs = parse_integer(arg, &invalid);
+				if (invalid == LONGINT_OK && config->jobs < 1) {
+					invalid = LONGINT_INVALID;
+				}
+				break;
+			case UNORDERED_KEY:
+				config->unordered = 1;
+				break;
+			case DIRECT_KEY:
+				config->direct = 1;
+				break;
+			case DROP_CACHE_KEY:
+				config->drop_cache = 1;
+				break;
+			case IO_SIZE_KEY:
+				config->io_size = parse_integer(arg, &invalid);
+				if (invalid == LONGINT_OK && (config->io_size < 1 || config->io_size > SSIZE_MAX)) {
+					invalid = LONGINT_INVALID;
+				}
+				break;
+			case PROGRESS_KEY:
+				config->progress = 1;
+				break;
+			case CONCAT_KEY:
+				config->concat = 1;
+				break;
 			case 'x':
-				if (config->pattern != NULL) {
+				if (config->pattern_text != NULL || config->pattern_file != NULL) {
+					error(0, 0, "Cannot set the search pattern twice");
+					return EINVAL;
+				}
+				config->pattern_text = arg;
+				break;
+			case PATTERN_FILE_KEY:
+				if (config->pattern_text != NULL || config->pattern_file != NULL) {
 					error(0, 0, "Cannot set the search pattern twice");
 					return EINVAL;
 				}
-				config->pattern = byte_pattern_from_string(arg);
-				if (config->pattern == NULL) {
+				config->pattern_file = arg;
+				break;
+			case MASK_FILE_KEY:
+				config->mask_file = arg;
+				break;
+			case CARVE_KEY:
+				config->carve_dir = arg;
+				break;
+			case CARVE_BEFORE_KEY:
+				config->carve_before = parse_integer(arg, &invalid);
+				break;
+			case CARVE_AFTER_KEY:
+				config->carve_after = parse_integer(arg, &invalid);
+				break;
+			case CARVE_UNTIL_KEY:
+				config->carve_until_text = arg;
+				break;
+			case DAEMON_KEY:
+				config->daemon_socket = arg;
+				break;
+			case INDEX_KEY:
+				config->index_path = arg;
+				break;
+			case CACHE_KEY:
+				config->cache_dir = arg;
+				break;
+			case DEDUP_KEY:
+				config->dedup_content = 1;
+				break;
+			case CHECKPOINT_KEY:
+				config->checkpoint_path = arg;
+				break;
+			case RESUME_KEY:
+				config->resume = 1;
+				break;
+			case STATS_KEY:
+				config->stats = parse_stats_format(arg);
+				if (config->stats == 0) {
+					error(0, 0, "Invalid format for option %s: %s", quote_n(0, "--stats"), quote_n(1, arg));
 					return EINVAL;
 				}
 				break;
 			case DUMP_PATTERN_KEY:
-				if (config->pattern != NULL) {
-					fwrite(config->pattern->value, 1, config->pattern->len, stdout);
-					fwrite(config->pattern->mask, 1, config->pattern->len, stdout);
-				}
-				exit(0);
+				config->dump_pattern = 1;
+				break;
 			case ARGP_KEY_ARG:
-				if (config->pattern != NULL) {
+				if (config->pattern_text != NULL || config->pattern_file != NULL) {
 					return ARGP_ERR_UNKNOWN; // causes re-process as ARGP_KEY_ARGS
 				}
-				config->pattern = byte_pattern_from_string(arg);
-				return (config->pattern == NULL) ? EINVAL : 0;
+				config->pattern_text = arg;
 				break;
 			case ARGP_KEY_ARGS: {
 				int first_file = state->next;
@@ -181,7 +305,7 @@ parse_opt (int key, char *arg, struct argp_state *state) {
 			}
 
 			case ARGP_KEY_END:
-				if (config->pattern == NULL) {
+				if (config->pattern_text == NULL && config->pattern_file == NULL) {
 					argp_usage(state);
 				}
 				if (config->filename_count == 0) {
@@ -197,7 +321,12 @@ parse_opt (int key, char *arg, struct argp_state *state) {
 	}
 
 	if (invalid != LONGINT_OK) {
-		char flag[3] = { '-', key, 0 };
+		char flag[32] = { '-', key, 0 };
+		const struct argp_option *o = options;
+		for (; key > 0xff && o->name != NULL; ++o) {
+			if (o->key == key)
+				snprintf(flag, sizeof(flag), "--%s", o->name);
+		}
 		error(0, 0, "Invalid number for option %s: %s", quote_n(0, flag), quote_n(1, arg));
 		return invalid == LONGINT_OVERFLOW ? EOVERFLOW : EINVAL;
 	}
@@ -205,190 +334,218 @@ parse_opt (int key, char *arg, struct argp_state *state) {
 }
 
 
-off_t skip(int fd, off_t current, off_t n) {
-	off_t result = lseek(fd, n, SEEK_CUR);
-	if (result == (off_t)-1) {
-		if (n < 0)
-		{
-			error(0, errno, "cannot lseek backward");
-			return -1;
-		}
-		/* Skip forward the hard way. */
-		unsigned char buf[INITIAL_BUFSIZE];
-		result = current;
-		while (n > 0) {
-			ssize_t r = read(fd, buf, MIN(n, sizeof(buf)));
-			if (r < 1)
-			{
-				if (r != 0) error(0, 0, "read");
-				return result;
-			}
-			n -= r;
-			result += r;
-		}
+int main(int argc, char **argv) {
+	int result = RESULT_NO_MATCH;
+	uint64_t start_ns = stats_clock();
+	set_program_name(*argv);
+	params.dir_fd = AT_FDCWD;
+	argp_parse(&argp, argc, argv, 0, 0, &params);
+
+	if (params.pattern_text == NULL && params.pattern_file == NULL) {
+		result = RESULT_ERROR;
+		goto CLEANUP;
 	}
 
-	return result;
-}
+	if (params.mask_file != NULL && params.pattern_file == NULL) {
+		error(0, 0, "%s needs %s", quote_n(0, "--mask-file"), quote_n(1, "--pattern-file"));
+		result = RESULT_ERROR;
+		goto CLEANUP;
+	}
 
+	if (params.follow && (params.filename_count > 1 || params.recurse || params.jobs > 1 || params.decompress
+			|| params.tee || params.index_path != NULL || params.cache_dir != NULL)) {
+		error(0, 0, "%s follows a single FILE, and cannot be combined with -r, --jobs, --decompress, --tee, --index or --cache",
+				quote("--follow"));
+		result = RESULT_ERROR;
+		goto CLEANUP;
+	}
 
-int searchfile(const char *filename, int fd, const struct byte_pattern *pattern) {
-	int result = RESULT_NO_MATCH;
-	const size_t lenm1 = pattern->len - 1;
-	const size_t search_size = MAX(INITIAL_BUFSIZE, 2 * pattern->len);
-	unsigned char *buf = xmalloc(params.bytes_before + search_size);
-	const unsigned char *endp = buf + search_size - lenm1;
-	unsigned char *readp = buf;
-	off_t file_offset = 0;
-
-	begin_match(filename);
-
-	if (params.skip_to > 0) {
-		file_offset = skip(fd, file_offset, params.skip_to);
-		if (file_offset != params.skip_to)
-		{
-			error(0, 0, "Failed to skip ahead to offset 0x%jx", (intmax_t) file_offset);
-			result = RESULT_ERROR;
+	if (params.carve_dir != NULL && (params.tee || params.decompress)) {
+		error(0, 0, "%s cannot be combined with --tee or --decompress", quote("--carve"));
+		result = RESULT_ERROR;
+		goto CLEANUP;
+	}
+
+	if (params.tee && (params.jobs > 1 || params.decompress || params.index_path != NULL || params.cache_dir != NULL
+			|| params.checkpoint_path != NULL)) {
+		error(0, 0, "%s cannot be combined with --jobs, --decompress, --index, --cache or --checkpoint", quote("--tee"));
+		result = RESULT_ERROR;
+		goto CLEANUP;
+	}
+
+	if (params.concat && (params.recurse || params.jobs > 1 || params.decompress || params.tee || params.follow
+			|| params.index_path != NULL || params.cache_dir != NULL || params.checkpoint_path != NULL
+			|| params.carve_dir != NULL)) {
+		error(0, 0, "%s cannot be combined with -r, --jobs, --decompress, --tee, --follow, --index, --cache, --checkpoint or --carve",
+				quote("--concat"));
+		result = RESULT_ERROR;
+		goto CLEANUP;
+	}
+
+	if (params.dedup_content && (params.follow || params.tee || params.concat)) {
+		error(0, 0, "%s cannot be combined with --follow, --tee or --concat", quote("--dedup-content"));
+		result = RESULT_ERROR;
+		goto CLEANUP;
+	}
+
+	if (params.resume && params.checkpoint_path == NULL) {
+		error(0, 0, "%s needs %s", quote_n(0, "--resume"), quote_n(1, "--checkpoint"));
+		result = RESULT_ERROR;
+		goto CLEANUP;
+	}
+
+	if ((params.direct || params.drop_cache) && params.io_size == 0) {
+		params.io_size = DIRECT_IO_SIZE;
+	}
+
+	if (params.daemon_socket != NULL && !params.dump_pattern) {
+		result = daemon_search(&params);
+		if (result >= 0) {
 			goto CLEANUP;
 		}
+		result = RESULT_NO_MATCH;
+	}
+
+	if (params.pattern_file != NULL) {
+		params.pattern = byte_pattern_from_file(params.pattern_file, params.mask_file);
+	} else {
+		params.pattern = byte_pattern_from_string(params.pattern_text);
+	}
+	if (params.pattern == NULL) {
+		result = RESULT_ERROR;
+		goto CLEANUP;
 	}
 
-	ssize_t r;
+	if (params.dump_pattern) {
+		fwrite(params.pattern->value, 1, params.pattern->len, stdout);
+		fwrite(params.pattern->mask, 1, params.pattern->len, stdout);
+		goto CLEANUP;
+	}
 
-	/* Prime the buffer with len-1 bytes */
-	size_t primed = 0;
-	while (primed < lenm1) {
-		r = read(fd, readp+primed, (lenm1-primed));
-		if (r < 1)
-		{
-			if (r < 0) {
-				error(0, 0, "read");
-				result = RESULT_ERROR;
-			}
+	if (params.carve_until_text != NULL) {
+		params.carve_until = byte_pattern_from_string(params.carve_until_text);
+		if (params.carve_until == NULL) {
+			result = RESULT_ERROR;
 			goto CLEANUP;
 		}
-		primed += r;
 	}
 
-	/* Read a byte at a time, matching as we go. */
-	while (1) {
-		r = read(fd, readp+lenm1, 1);
-		if (r != 1) {
-			if (r < 0) {
-				error(0, 0, "read");
-				result = RESULT_ERROR;
-			}
-			break;
+	if (params.index_path != NULL) {
+		params.index = ngram_index_open(params.index_path);
+		if (params.index == NULL) {
+			result = RESULT_ERROR;
+			goto CLEANUP;
 		}
+	}
 
-		const unsigned char *match = byte_pattern_match(pattern, readp, pattern->len);
+	if (params.cache_dir != NULL) {
+		params.cache = result_cache_open(params.cache_dir, &params);
+		if (params.cache == NULL) {
+			result = RESULT_ERROR;
+			goto CLEANUP;
+		}
+	}
 
-		if (match != NULL) {
-			result = RESULT_MATCH;
-			size_t before = MIN(readp-buf, params.bytes_before);
-			print_before(readp-before, before, file_offset-before);
-			print_match(match, pattern->len, file_offset);
-			print_after_fd(fd, file_offset + pattern->len);
-			if (params.first_only)
-				break;
+	if (params.checkpoint_path != NULL) {
+		params.checkpoint = checkpoint_open(params.checkpoint_path, &params, params.resume);
+		if (params.checkpoint == NULL) {
+			result = RESULT_ERROR;
+			goto CLEANUP;
 		}
+	}
 
-		++readp;
-		++file_offset;
+	if (params.dedup_content) {
+		params.dedup = dedup_new();
+	}
 
-		/* Shift the buffer every time we run out of space */
-		if (readp >= endp) {
-			size_t before = MIN(readp-buf, params.bytes_before);
-			memmove(buf, readp-before, lenm1+before);
-			readp = buf+before;
+	if (params.concat) {
+		params.segments = concat_open(&params, params.filenames, params.filename_count);
+		if (params.segments == NULL) {
+			result = RESULT_ERROR;
+			goto CLEANUP;
 		}
 	}
 
-	flush_match();
-CLEANUP:
-	free(buf);
-	return result;
-}
-
+	if (params.carve_dir != NULL && carve_start(&params)) {
+		result = RESULT_ERROR;
+		goto CLEANUP;
+	}
 
-int recurse(const char *path, struct byte_pattern *pattern) {
-	if (!strcmp(path, STD_IN_FILENAME)) {
-		return searchfile("stdin", 0, pattern);
+	if (params.jobs > 1) {
+		jobs_start(&params);
 	}
 
-	int result = RESULT_NO_MATCH;
-	struct stat s;
-	if (stat(path, &s)) {
-		perror(path);
-		return RESULT_ERROR;
+	if (params.follow) {
+		follow_catch_signals();
 	}
 
-	if (!S_ISDIR(s.st_mode))
-	{
-		int fd = open(path, O_RDONLY | O_BINARY);
-		if (fd < 0) {
-			perror(path);
+	struct output_context out = { &params, stdout, stderr };
+	if (params.tee) {
+		/* Standard output carries the data */
+		out.out = (params.tee_report != NULL) ? fopen(params.tee_report, "w") : stderr;
+		if (out.out == NULL) {
+			error(0, errno, "%s", params.tee_report);
 			result = RESULT_ERROR;
-		} else {
-			result = searchfile(path, fd, pattern);
-			close(fd);
+			goto CLEANUP;
 		}
-		return result;
 	}
 
-	if (params.recurse == 0) {
-		error(0, 0, "%s: Is a directory", path);
-		return RESULT_ERROR;
+	if (params.progress) {
+		progress_start();
+	}
 
+	if (params.concat) {
+		result = search_concat(&out);
 	} else {
-		DIR *dir = opendir(path);
-		if (!dir)
-		{
-			error(0, errno, "%s", path);
-			return RESULT_ERROR;
-		}
-
-		struct dirent *d;
-		while ((d = readdir(dir)))
-		{
-			if (!(strcmp(d->d_name, ".") && strcmp(d->d_name, "..")))
-				continue;
-			char newpath[strlen(path) + strlen(d->d_name) + 1];
-			strcpy(newpath, path);
-			strcat(newpath, "/");
-			strcat(newpath, d->d_name);
-			int tmpresult = recurse(newpath, pattern);
-			if (result == RESULT_NO_MATCH || tmpresult == RESULT_ERROR)
+		int i = 0;
+		for (; i < params.filename_count; ++i) {
+			int tmpresult = recurse(&out, params.filenames[i]);
+			// emulating grep: 2 (error) is preserved. 0 (match) is preserved as long as no error occurs.
+			if (result == RESULT_NO_MATCH || tmpresult == RESULT_ERROR) {
 				result = tmpresult;
+			}
 		}
+	}
 
-		closedir(dir);
+	if (params.jobs > 1) {
+		int tmpresult = jobs_finish();
+		if (result == RESULT_NO_MATCH || tmpresult == RESULT_ERROR) {
+			result = tmpresult;
+		}
 	}
-	return result;
-}
 
+	if (params.carve_dir != NULL) {
+		int tmpresult = carve_finish();
+		if (result == RESULT_NO_MATCH || tmpresult == RESULT_ERROR) {
+			result = tmpresult;
+		}
+	}
 
-int main(int argc, char **argv) {
-	int result = RESULT_NO_MATCH;
-	set_program_name(*argv);
-	argp_parse(&argp, argc, argv, 0, 0, &params);
+	if (params.progress) {
+		progress_finish();
+	}
 
-	if (params.pattern == NULL) {
+	if (checkpoint_close(params.checkpoint)) {
 		result = RESULT_ERROR;
-		goto CLEANUP;
 	}
+	params.checkpoint = NULL;
 
-	int i = 0;
-	for (; i < params.filename_count; ++i) {
-		int tmpresult = recurse(params.filenames[i], params.pattern);
-		// emulating grep: 2 (error) is preserved. 0 (match) is preserved as long as no error occurs.
-		if (result == RESULT_NO_MATCH || tmpresult == RESULT_ERROR) {
-			result = tmpresult;
-		}
+	if (params.stats) {
+		fflush(out.out);
+		stats_report(&params, stats_clock() - start_ns);
+	}
+	if (params.tee_report != NULL && fclose(out.out)) {
+		error(0, errno, "%s", params.tee_report);
+		result = RESULT_ERROR;
 	}
 
 CLEANUP:
+	concat_close(params.segments);
+	dedup_free(params.dedup);
+	checkpoint_close(params.checkpoint);
+	result_cache_close(params.cache);
+	ngram_index_close(params.index);
+	byte_pattern_free(params.carve_until);
 	byte_pattern_free(params.pattern);
 	return result;
 }
-
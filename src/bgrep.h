@@ -3,13 +3,18 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 /* gnulib dependencies */
 #include "xstrtol.h"
 #include "minmax.h"
 
+#include "libbgrep.h"
+
 #ifndef STRPREFIX
 #  define STRPREFIX(a, b) (strncmp (a, b, strlen (b)) == 0)
 #endif /* STRPREFIX */
@@ -31,6 +36,9 @@ enum bgrep_print_modes {
 	QUIET = 4
 };
 
+/* --stats flags */
+enum { STATS_ON = 1, STATS_JSON = 2, STATS_FILES = 4 };
+
 /* Config parameters */
 struct bgrep_config {
 	uintmax_t bytes_before;
@@ -39,44 +47,281 @@ struct bgrep_config {
 	int first_only;
 	int print_filenames;
 	int recurse;
+	int jobs;
+	int unordered;
+	int dump_pattern;
+	int dir_fd;       /* relative FILEs are opened from here (AT_FDCWD normally) */
 	enum bgrep_print_modes print_mode;
+	const char *pattern_text;
+	const char *pattern_file;   /* --pattern-file: the pattern's raw bytes, instead of pattern_text */
+	const char *mask_file;
 	struct byte_pattern *pattern;
+	const char *daemon_socket;
+	const char *index_path;
+	struct ngram_index *index;
+	const char *cache_dir;
+	struct result_cache *cache;
+	int stats;        /* STATS_* flags, zero without --stats */
+	int decompress;
+	int tee;          /* --tee: copy the input to stdout; results go to tee_report (stderr if NULL) */
+	const char *tee_report;
+	const char *carve_dir;
+	uintmax_t carve_before;
+	uintmax_t carve_after;
+	const char *carve_until_text;
+	struct byte_pattern *carve_until;
+	int follow;
+	const char *checkpoint_path;
+	struct checkpoint *checkpoint;
+	int resume;
+	int direct;       /* --direct: read files and block devices with O_DIRECT */
+	int drop_cache;   /* --drop-cache: drop what was read from the page cache */
+	uintmax_t io_size;
+	int progress;
+	int concat;       /* --concat: search the FILEs as one input */
+	struct concat *segments;
+	int dedup_content;   /* --dedup-content: search each distinct content once */
+	struct dedup *dedup;
 	const char * const *filenames;
 	int filename_count;
 };
 
-struct byte_pattern {
-	unsigned char *value;
-	unsigned char *mask;
-	size_t capacity;
-	size_t len;
+/* Counters kept by --stats.  Times are wall-clock nanoseconds. */
+struct search_stats {
+	uintmax_t files_opened;
+	uintmax_t files_pruned;     /* answered by --index, --cache or --dedup-content without being scanned */
+	uintmax_t bytes_read;
+	uintmax_t bytes_skipped;
+	uintmax_t read_calls;
+	struct bgrep_counters matcher;
+	uintmax_t matches;
+	uint64_t io_ns;
+	uint64_t match_ns;
+	uint64_t output_ns;
+};
+
+/* Output state for a single search.  Each concurrent search gets its own, so nothing is shared. */
+enum { XXD_MAX_COUNT = 16 };
+struct output_context {
+	const struct bgrep_config *config;
+	FILE *out;
+	FILE *err;
+	const char *filename;
+	off_t last_offset;
+	unsigned long match_count;
+	unsigned int xxd_count;
+	char human_text[XXD_MAX_COUNT + 1];
+	struct search_stats stats;   /* this file's, with --stats */
+	struct checkpoint_entry *checkpoint;   /* with --checkpoint, this file's entry */
+	off_t resume_from;           /* with --resume, where the last search of this file got to */
+	uintmax_t resumed_matches;   /* and how many matches it had reported */
 };
 
 enum { MAX_REPEAT_GROUPS = 64 };
+/* The longest ??{MIN,MAX}: a stream keeps the longest match's worth of data */
+enum { MAX_GAP = 256 * 1024 * 1024 };
 enum { RESULT_MATCH = 0, RESULT_NO_MATCH = 1, RESULT_ERROR = 2};
 
 extern struct bgrep_config params;
 
-/* byte_pattern.c */
-void byte_pattern_init(struct byte_pattern *ptr);
-void byte_pattern_destroy(struct byte_pattern *ptr);
-void byte_pattern_free(struct byte_pattern *ptr);
-void byte_pattern_reserve(struct byte_pattern *ptr, size_t num_bytes);
-void byte_pattern_append(struct byte_pattern *ptr, unsigned char *value, unsigned char *mask, size_t len);
-void byte_pattern_append_char(struct byte_pattern *ptr, unsigned char value, unsigned char mask);
-void byte_pattern_repeat(struct byte_pattern *ptr, size_t num_bytes, size_t repeat);
-const unsigned char * byte_pattern_match(const struct byte_pattern *ptr, const unsigned char *data, size_t len);
-struct byte_pattern *byte_pattern_from_string(const char *pattern_str);
+/* A byte range [start, end) of a file */
+struct search_range {
+	off_t start;
+	off_t end;
+};
+
+/* The matches recorded for a file by --cache.  Beyond MAX_CACHED_OFFSETS, only the count is kept. */
+enum { MAX_CACHED_OFFSETS = 1 << 20 };
+struct cached_result {
+	uintmax_t match_count;
+	size_t offset_count;            /* 0 if only the count was kept */
+	const unsigned char *offsets;   /* read with cached_offset() */
+};
+
+/* search.c */
+off_t skip(struct output_context *out, int fd, off_t current, off_t n);
+int searchfile(struct output_context *out, const char *filename, int fd);
+int search_path(struct output_context *out, const char *path);
+int search_concat(struct output_context *out);
+int recurse(struct output_context *out, const char *path);
+
+/* slot_ring.c */
+struct slot_ring;
+struct slot_ring *ring_new(size_t slot_size);
+int ring_start(struct slot_ring *r, void (*produce)(void *arg), void *arg);
+unsigned char *ring_claim(struct slot_ring *r);
+void ring_publish(struct slot_ring *r, size_t len);
+ssize_t ring_read(int fd, void *buf, size_t len);
+size_t ring_slot_size(const struct slot_ring *r);
+const unsigned char *ring_next(struct slot_ring *r, size_t *len);
+void ring_release(struct slot_ring *r);
+int ring_stop(struct slot_ring *r);
+
+/* decompress.c */
+enum compression { COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_ZSTD };
+struct decoder;
+enum compression compression_type(const unsigned char *p, size_t len);
+struct decoder *decoder_start(struct output_context *out, int fd);
+struct slot_ring *decoder_ring(struct decoder *d);
+int decoder_finish(struct decoder *d, struct output_context *out);
+
+/* pipe_reader.c */
+struct pipe_reader;
+int pipe_reader_wanted(int fd);
+struct pipe_reader *pipe_reader_start(struct output_context *out, int fd, size_t read_size);
+struct slot_ring *pipe_reader_ring(struct pipe_reader *r);
+int pipe_reader_finish(struct pipe_reader *r, struct output_context *out);
+
+/* matcher.c */
+int byte_commonness(unsigned char c);
+
+/* fingerprint.c */
+struct fingerprint;
+struct fingerprint *fingerprint_new(const struct byte_pattern *pattern, size_t min_len);
+size_t fingerprint_block(const struct fingerprint *fp);
+uint64_t fingerprint_hash(const struct fingerprint *fp, const unsigned char *p);
+size_t fingerprint_lookup(const struct fingerprint *fp, uint64_t hash, size_t *offsets);
+void fingerprint_free(struct fingerprint *fp);
+
+/* count.c */
+enum { COUNT_MAX_LEN = 2 };
+int count_supported(const struct byte_pattern *pattern);
+uintmax_t count_matches(const struct byte_pattern *pattern, const unsigned char *data, size_t len);
+
+/* carve.c */
+int carve_start(const struct bgrep_config *config);
+void carve_submit(const char *filename, int fd, uintmax_t offset, size_t len);
+int carve_finish(void);
+
+/* checkpoint.c */
+struct checkpoint;
+struct checkpoint_entry;
+struct checkpoint *checkpoint_open(const char *path, const struct bgrep_config *config, int resume);
+int checkpoint_close(struct checkpoint *cp);
+struct checkpoint_entry *checkpoint_begin(struct checkpoint *cp, const char *path, const struct stat *s,
+		off_t *offset, uintmax_t *matches);
+void checkpoint_progress(struct checkpoint *cp, struct checkpoint_entry *entry, off_t offset, uintmax_t matches);
+void checkpoint_done(struct checkpoint *cp, struct checkpoint_entry *entry, uintmax_t matches);
+
+/* direct.c */
+struct direct_reader;
+off_t input_size(int fd);
+struct direct_reader *direct_open(const struct bgrep_config *config, int fd);
+void direct_close(struct direct_reader *r);
+ssize_t direct_read(struct direct_reader *r, int fd, const unsigned char **data, size_t len, off_t position);
+
+/* concat.c */
+struct concat;
+struct concat *concat_open(const struct bgrep_config *config, const char * const *names, int count);
+void concat_close(struct concat *c);
+int concat_count(const struct concat *c);
+off_t concat_size(const struct concat *c);
+const char *concat_segment(const struct concat *c, int i, int *fd, off_t *start, off_t *end);
+const char *concat_locate(const struct concat *c, off_t offset, off_t *local);
+
+/* dedup.c */
+struct dedup;
+struct content_hash;
+struct dedup *dedup_new(void);
+void dedup_free(struct dedup *d);
+int dedup_lookup(struct dedup *d, struct output_context *out, int fd, const struct stat *s, struct cached_result *result);
+void dedup_store(struct dedup *d, struct output_context *out, int fd, const struct stat *s,
+		struct content_hash *content, uintmax_t match_count, const uintmax_t *offsets, size_t offset_count);
+
+/* client.c */
+int daemon_search(const struct bgrep_config *config);
+
+/* wire.c */
+enum wire_frame_types {
+	WIRE_PATTERN = 'P',
+	WIRE_OPTION = 'C',
+	WIRE_DIRECTORY = 'D',
+	WIRE_FILENAME = 'F',
+	WIRE_END = 'E',
+	WIRE_STDOUT = '1',
+	WIRE_STDERR = '2',
+	WIRE_EXIT = 'X'
+};
+enum { WIRE_MAX_FRAME = 1 << 24 };
+int wire_write_frame(int fd, char type, const void *data, size_t len);
+char *wire_read_frame(int fd, char *type, size_t *len);
+FILE *wire_open_stream(int fd, char type);
+
+/* ngram_index.c */
+struct ngram_index;
+struct ngram_index_writer;
+struct ngram_index_writer *ngram_index_create(const char *path, uint64_t block_size, unsigned bucket_bits);
+int ngram_index_add_file(struct ngram_index_writer *writer, const char *path);
+int ngram_index_commit(struct ngram_index_writer *writer);
+void ngram_index_abort(struct ngram_index_writer *writer);
+struct ngram_index *ngram_index_open(const char *path);
+void ngram_index_close(struct ngram_index *index);
+int ngram_index_candidates(const struct ngram_index *index, const char *path, int fd,
+		const struct byte_pattern *pattern, off_t skip_to,
+		struct search_range **ranges, size_t *range_count);
+
+/* progress.c */
+void progress_start(void);
+void progress_begin(off_t size);
+void progress_add(uintmax_t n);
+void progress_finish(void);
+
+/* result_cache.c */
+static inline int64_t timespec_ns(struct timespec t) {
+	return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+struct result_cache;
+struct result_cache *result_cache_open(const char *dir, const struct bgrep_config *config);
+void result_cache_close(struct result_cache *cache);
+int result_cache_lookup(const struct result_cache *cache, const struct stat *s, struct cached_result *result);
+uint64_t cached_offset(const struct cached_result *result, size_t i);
+void result_cache_store(struct result_cache *cache, const struct stat *s,
+		uintmax_t match_count, const uintmax_t *offsets, size_t offset_count);
+
+/* stats.c */
+uint64_t stats_clock(void);
+void stats_begin_file(struct output_context *ctx);
+void stats_end_file(struct output_context *ctx, const char *filename);
+void stats_report(const struct bgrep_config *config, uint64_t wall_ns);
+
+/* follow.c */
+enum follow_event { FOLLOW_GROWN, FOLLOW_TRUNCATED, FOLLOW_STOP };
+struct follow;
+void follow_catch_signals(void);
+struct follow *follow_open(int fd);
+void follow_close(struct follow *f);
+enum follow_event follow_wait(struct follow *f, int fd, off_t position);
+
+/* hash.c */
+struct content_hash {
+	uint64_t h[2];
+	uint64_t len;
+	unsigned char pending[8];   /* the last len % 8 bytes */
+};
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+void content_hash_init(struct content_hash *c);
+void content_hash_update(struct content_hash *c, const void *data, size_t len);
+void content_hash_final(const struct content_hash *c, uint64_t digest[2]);
+uint64_t search_key(const struct bgrep_config *config);
+
+/* jobs.c */
+void jobs_start(const struct bgrep_config *config);
+void jobs_submit(const char *path);
+int jobs_finish(void);
 
 /* parse_integer.c */
 uintmax_t parse_integer(const char *str, strtol_error *invalid);
 
 /* print_output.c */
-void begin_match(const char *fname);
-void print_before(const char *buf, size_t len, off_t file_offset);
-void print_match(const char *match, size_t len, off_t file_offset);
-void print_after_fd(int fd, off_t file_offset);
-void flush_match();
+void begin_match(struct output_context *ctx, const char *fname);
+void print_before(struct output_context *ctx, const char *buf, size_t len, off_t file_offset);
+void print_after(struct output_context *ctx, const char *buf, size_t len, off_t file_offset);
+void print_match(struct output_context *ctx, const char *match, size_t len, off_t file_offset);
+void print_after_fd(struct output_context *ctx, int fd, off_t file_offset);
+void flush_match(struct output_context *ctx);
+void print_error(struct output_context *ctx, int errnum, const char *format, ...)
+	__attribute__ ((format (printf, 3, 4)));
 
 #endif /* BGREP_H */
 
@@ -0,0 +1,441 @@
+#include "config.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/* gnulib dependencies */
+#include "argp.h"
+#include "progname.h"
+#include "quote.h"
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * bgrepd: serves "bgrep --daemon" requests on a Unix socket.
+ *
+ * A fixed pool of threads accepts connections.  Each request carries the
+ * pattern text, the client's working directory, its output options and its
+ * FILE list; results stream back as they are produced.  Compiled patterns
+ * are cached by their text, so a recurring signature is parsed only once.
+ *
+ * Searches run with the server's permissions, so only its own user may
+ * send them: the socket is created with mode 0600, and each connection's
+ * peer is checked as well, for systems that ignore the mode of a socket.
+ */
+
+enum { DEFAULT_WORKERS = 4, DEFAULT_CACHE_SIZE = 256, LISTEN_BACKLOG = 64, OUTPUT_BUFSIZE = 64 * 1024 };
+/* Seconds a client has to send its whole request */
+enum { REQUEST_TIMEOUT = 10 };
+
+struct daemon_config {
+	const char *socket_path;
+	unsigned long workers;
+	unsigned long cache_size;
+};
+
+struct cache_entry {
+	struct cache_entry *next;
+	char *text;
+	struct byte_pattern *pattern;
+	unsigned long refs;
+	unsigned long last_used;
+};
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state);
+
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = "<https://github.com/rsharo/bgrep/issues>";
+
+static const char doc[] = "Serve bgrep searches on the Unix domain socket SOCKET"
+	"\v"
+	" Run 'bgrep --daemon=SOCKET ...' to send a search to this server.  Searches\n"
+	" run with the server's permissions, from the client's working directory;\n"
+	" only the user running the server may connect.";
+
+static const char args_doc[] = "SOCKET";
+
+static struct argp_option const options[] = {
+	{ "jobs",       'j', "N", 0, "serve up to N requests at once", 1 },
+	{ "cache-size", 'c', "N", 0, "keep up to N compiled patterns", 1 },
+	{ 0, 0, 0, 0, 0, 0}
+};
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+static struct daemon_config daemon_params = { NULL, DEFAULT_WORKERS, DEFAULT_CACHE_SIZE };
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *cache;
+static unsigned long cache_count;
+static unsigned long cache_clock;
+
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state) {
+	struct daemon_config *config = state->input;
+	strtol_error invalid = LONGINT_OK;
+
+	switch (key) {
+			case 'j':
+				config->workers = parse_integer(arg, &invalid);
+				if (invalid == LONGINT_OK && config->workers < 1) {
+					invalid = LONGINT_INVALID;
+				}
+				break;
+			case 'c':
+				config->cache_size = parse_integer(arg, &invalid);
+				break;
+			case ARGP_KEY_ARG:
+				if (config->socket_path != NULL) {
+					argp_usage(state);
+				}
+				config->socket_path = arg;
+				break;
+			case ARGP_KEY_END:
+				if (config->socket_path == NULL) {
+					argp_usage(state);
+				}
+				break;
+			default:
+				return ARGP_ERR_UNKNOWN;
+	}
+
+	if (invalid != LONGINT_OK) {
+		char flag[3] = { '-', key, 0 };
+		error(0, 0, "Invalid number for option %s: %s", quote_n(0, flag), quote_n(1, arg));
+		return invalid == LONGINT_OVERFLOW ? EOVERFLOW : EINVAL;
+	}
+	return 0;
+}
+
+
+/* Returns a cache entry holding the compiled pattern for text, or NULL after writing why it does not parse into why */
+static struct cache_entry *cache_acquire(const char *text, char *why, size_t why_size) {
+	struct cache_entry *entry;
+
+	pthread_mutex_lock(&cache_lock);
+	for (entry = cache; entry; entry = entry->next) {
+		if (!strcmp(entry->text, text))
+			break;
+	}
+	if (entry) {
+		++entry->refs;
+		entry->last_used = ++cache_clock;
+		pthread_mutex_unlock(&cache_lock);
+		return entry;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	/* Compile outside the lock; another thread may race us to it, which is harmless */
+	struct byte_pattern *pattern = byte_pattern_parse(text, why, why_size);
+	if (pattern == NULL)
+		return NULL;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->text = xstrdup(text);
+	entry->pattern = pattern;
+	entry->refs = 1;
+
+	pthread_mutex_lock(&cache_lock);
+	entry->last_used = ++cache_clock;
+	entry->next = cache;
+	cache = entry;
+	++cache_count;
+
+	/* Evict the least recently used idle entries */
+	while (cache_count > daemon_params.cache_size) {
+		struct cache_entry **victim = NULL, **p;
+		for (p = &cache; *p; p = &(*p)->next) {
+			if ((*p)->refs == 0 && (victim == NULL || (*p)->last_used < (*victim)->last_used))
+				victim = p;
+		}
+		if (victim == NULL)
+			break;
+
+		struct cache_entry *old = *victim;
+		*victim = old->next;
+		--cache_count;
+		byte_pattern_free(old->pattern);
+		free(old->text);
+		free(old);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return entry;
+}
+
+
+static void cache_release(struct cache_entry *entry) {
+	pthread_mutex_lock(&cache_lock);
+	--entry->refs;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+static int set_option(struct bgrep_config *config, const char *option) {
+	const char *value = strchr(option, '=');
+	strtol_error invalid = LONGINT_OK;
+
+	if (value == NULL)
+		return -1;
+	uintmax_t n = parse_integer(++value, &invalid);
+	if (invalid != LONGINT_OK)
+		return -1;
+
+	if (STRPREFIX(option, "print_mode=") && n <= QUIET)
+		config->print_mode = n;
+	else if (STRPREFIX(option, "first_only="))
+		config->first_only = (n != 0);
+	else if (STRPREFIX(option, "with_filename="))
+		config->print_filenames = (n != 0);
+	else if (STRPREFIX(option, "recurse="))
+		config->recurse = (n != 0);
+	else if (STRPREFIX(option, "before="))
+		config->bytes_before = n;
+	else if (STRPREFIX(option, "after="))
+		config->bytes_after = n;
+	else if (STRPREFIX(option, "skip="))
+		config->skip_to = n;
+	else if (STRPREFIX(option, "decompress="))
+		config->decompress = (n != 0);
+	else
+		return -1;
+	return 0;
+}
+
+
+static void reply_error(int fd, const char *message) {
+	char code = RESULT_ERROR;
+	char line[256];
+	int len = snprintf(line, sizeof(line), "%s: %s\n", program_name, message);
+
+	wire_write_frame(fd, WIRE_STDERR, line, MIN((size_t) len, sizeof(line) - 1));
+	wire_write_frame(fd, WIRE_EXIT, &code, 1);
+}
+
+
+/* Limits the next reads from fd to the time left until deadline.  Returns -1 once it has passed. */
+static int set_read_timeout(int fd, const struct timespec *deadline) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long left_us = (deadline->tv_sec - now.tv_sec) * 1000000LL + (deadline->tv_nsec - now.tv_nsec) / 1000;
+	if (left_us <= 0)
+		return -1;
+	struct timeval timeout = { left_us / 1000000, left_us % 1000000 };
+	return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+
+static void serve_request(int fd) {
+	struct bgrep_config config;
+	struct cache_entry *entry = NULL;
+	char *pattern_text = NULL, *directory = NULL;
+	char **filenames = NULL;
+	size_t filename_count = 0, filename_alloc = 0;
+	const char *problem = NULL;
+	char why[256];
+	int complete = 0;
+
+	memset(&config, 0, sizeof(config));
+	config.dir_fd = -1;
+
+	/* A client that sends nothing, or not all of it, must not hold a worker for good */
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += REQUEST_TIMEOUT;
+
+	char type;
+	size_t len;
+	char *payload;
+	while (!set_read_timeout(fd, &deadline) && (payload = wire_read_frame(fd, &type, &len)) != NULL) {
+		switch (type) {
+			case WIRE_PATTERN:
+				free(pattern_text);
+				pattern_text = payload;
+				break;
+			case WIRE_DIRECTORY:
+				free(directory);
+				directory = payload;
+				break;
+			case WIRE_FILENAME:
+				if (filename_count == filename_alloc) {
+					filenames = x2nrealloc(filenames, &filename_alloc, sizeof(*filenames));
+				}
+				filenames[filename_count++] = payload;
+				break;
+			case WIRE_OPTION:
+				if (set_option(&config, payload))
+					problem = "unsupported option in request";
+				free(payload);
+				break;
+			default:
+				free(payload);
+				break;
+		}
+		if (type == WIRE_END) {
+			complete = 1;
+			break;
+		}
+	}
+
+	if (!complete) {
+		goto CLEANUP;  /* client went away, or took too long */
+	} else if (problem != NULL) {
+		reply_error(fd, problem);
+		goto CLEANUP;
+	} else if (pattern_text == NULL || directory == NULL || filename_count == 0) {
+		reply_error(fd, "incomplete request");
+		goto CLEANUP;
+	}
+
+	entry = cache_acquire(pattern_text, why, sizeof(why));
+	if (entry == NULL) {
+		reply_error(fd, why);  /* what a local bgrep would print */
+		goto CLEANUP;
+	}
+	config.pattern = entry->pattern;
+
+	config.dir_fd = open(directory, O_RDONLY | O_DIRECTORY);
+	if (config.dir_fd < 0) {
+		reply_error(fd, "cannot open the client's working directory");
+		goto CLEANUP;
+	}
+
+	struct output_context out = { &config, wire_open_stream(fd, WIRE_STDOUT), wire_open_stream(fd, WIRE_STDERR) };
+	if (out.out == NULL || out.err == NULL) {
+		if (out.out) fclose(out.out);
+		if (out.err) fclose(out.err);
+		reply_error(fd, "out of memory");
+		goto CLEANUP;
+	}
+	setvbuf(out.out, NULL, _IOFBF, OUTPUT_BUFSIZE);
+
+	char result = RESULT_NO_MATCH;
+	size_t i = 0;
+	for (; i < filename_count; ++i) {
+		int tmpresult = recurse(&out, filenames[i]);
+		if (result == RESULT_NO_MATCH || tmpresult == RESULT_ERROR) {
+			result = tmpresult;
+		}
+	}
+	fclose(out.out);
+	fclose(out.err);
+	wire_write_frame(fd, WIRE_EXIT, &result, 1);
+
+CLEANUP:
+	if (entry != NULL)
+		cache_release(entry);
+	if (config.dir_fd >= 0)
+		close(config.dir_fd);
+	while (filename_count > 0)
+		free(filenames[--filename_count]);
+	free(filenames);
+	free(pattern_text);
+	free(directory);
+}
+
+
+/* Is the process at the other end of fd running as our user? */
+static int same_user(int fd) {
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.uid == geteuid();
+#else
+	uid_t uid;
+	gid_t gid;
+	return !getpeereid(fd, &uid, &gid) && uid == geteuid();
+#endif
+}
+
+
+static void *serve_loop(void *arg) {
+	int listen_fd = *(int *) arg;
+
+	for (;;) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				error(0, errno, "accept");
+			continue;
+		}
+		if (same_user(fd)) {
+			serve_request(fd);
+		} else {
+			reply_error(fd, "permission denied");
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+
+int main(int argc, char **argv) {
+	struct sockaddr_un addr;
+	set_program_name(*argv);
+	argp_parse(&argp, argc, argv, 0, 0, &daemon_params);
+
+	if (strlen(daemon_params.socket_path) >= sizeof(addr.sun_path)) {
+		error(RESULT_ERROR, 0, "socket path is too long: %s", quote(daemon_params.socket_path));
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, daemon_params.socket_path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		error(RESULT_ERROR, errno, "socket");
+	}
+
+	/* Replace a stale socket, but never one that somebody is still serving, nor anything else */
+	struct stat s;
+	if (lstat(daemon_params.socket_path, &s) == 0) {
+		if (!S_ISSOCK(s.st_mode)) {
+			error(RESULT_ERROR, 0, "%s exists and is not a socket", quote(daemon_params.socket_path));
+		}
+		if (connect(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+			error(RESULT_ERROR, 0, "another server is already listening on %s", quote(daemon_params.socket_path));
+		}
+		if (errno != ECONNREFUSED) {
+			error(RESULT_ERROR, errno, "cannot replace %s", quote(daemon_params.socket_path));
+		}
+		unlink(daemon_params.socket_path);
+	}
+	close(listen_fd);
+
+	/* Nobody else may connect, so the socket is created with mode 0600 */
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	mode_t old_mask = umask(0177);
+	int failed = listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(old_mask);
+	if (failed || listen(listen_fd, LISTEN_BACKLOG)) {
+		error(RESULT_ERROR, errno, "cannot listen on %s", quote(daemon_params.socket_path));
+	}
+
+	pthread_t *workers = xnmalloc(daemon_params.workers, sizeof(*workers));
+	unsigned long i = 0;
+	for (; i < daemon_params.workers; ++i) {
+		int err = pthread_create(&workers[i], NULL, serve_loop, &listen_fd);
+		if (err) {
+			error(RESULT_ERROR, err, "cannot start worker thread");
+		}
+	}
+
+	for (i = 0; i < daemon_params.workers; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+	return 0;
+}
@@ -1,7 +1,10 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <error.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -37,6 +40,8 @@ void byte_pattern_init(struct byte_pattern *ptr) {
 	ptr->mask = xmalloc(INITIAL_BUFSIZE);
 	ptr->capacity = INITIAL_BUFSIZE;
 	ptr->len = 0;
+	ptr->gaps = NULL;
+	ptr->gap_count = 0;
 }
 
 
@@ -45,6 +50,7 @@ void byte_pattern_destroy(struct byte_pattern *ptr) {
 	if (ptr != NULL) {
 		free(ptr->value);
 		free(ptr->mask);
+		free(ptr->gaps);
 		// The following would add safety but impact performance
 		//ptr->value = ptr->mask = NULL;
 		//ptr->capacity = ptr->len = 0;
@@ -111,6 +117,88 @@ void byte_pattern_repeat(struct byte_pattern *ptr, size_t num_bytes, size_t repe
 	free(mask);
 }
 
+/* Appends a gap of min to max arbitrary bytes */
+void byte_pattern_add_gap(struct byte_pattern *ptr, size_t min, size_t max) {
+	size_t i = 0;
+	for (; i < min; ++i)
+		byte_pattern_append_char(ptr, 0, 0);
+	if (max == min)
+		return;
+
+	/* Two variable gaps in a row are one */
+	struct byte_gap *last = (ptr->gap_count > 0) ? &ptr->gaps[ptr->gap_count - 1] : NULL;
+	if (last != NULL && last->at == ptr->len) {
+		last->max += max - min;
+		return;
+	}
+	ptr->gaps = xnrealloc(ptr->gaps, ptr->gap_count + 1, sizeof(*ptr->gaps));
+	ptr->gaps[ptr->gap_count].at = ptr->len;
+	ptr->gaps[ptr->gap_count].min = min;
+	ptr->gaps[ptr->gap_count].max = max;
+	++ptr->gap_count;
+}
+
+
+/* The length of the longest match: len, plus the most that variable gaps can add */
+size_t byte_pattern_max_len(const struct byte_pattern *ptr) {
+	size_t len = ptr->len;
+	size_t i = 0;
+	for (; i < ptr->gap_count; ++i)
+		len += ptr->gaps[i].max - ptr->gaps[i].min;
+	return len;
+}
+
+
+/* Reports why a pattern does not parse: in why, if the caller gave room for it, or else on stderr as error(3) would */
+static void parse_error(char *why, size_t why_size, const char *format, ...) {
+	va_list args;
+
+	va_start(args, format);
+	if (why != NULL) {
+		vsnprintf(why, why_size, format, args);
+	} else {
+		fflush(stdout);
+		fprintf(stderr, "%s: ", program_name);
+		vfprintf(stderr, format, args);
+		putc('\n', stderr);
+	}
+	va_end(args);
+}
+
+
+/* Parses the {MIN,MAX} after a ??, which h points at, into a gap.  Returns the end of it, or NULL after reporting why. */
+static const char *parse_gap(struct byte_pattern *pattern, const char *h, char *why, size_t why_size) {
+	const char *end = strchr(h, '}');
+	const char *comma = memchr(h, ',', end ? end - h : 0);
+	if (end == NULL || comma == NULL) {
+		parse_error(why, why_size, "expected %s after %s in pattern string", quote_n(0, "{MIN,MAX}"), quote_n(1, "?\?"));
+		return NULL;
+	}
+
+	char min_text[comma - h];
+	char max_text[end - comma];
+	strtol_error invalid_min = LONGINT_OK, invalid_max = LONGINT_OK;
+	memcpy(min_text, h + 1, comma - h - 1);
+	min_text[comma - h - 1] = '\0';
+	memcpy(max_text, comma + 1, end - comma - 1);
+	max_text[end - comma - 1] = '\0';
+	uintmax_t min = parse_integer(min_text, &invalid_min);
+	uintmax_t max = parse_integer(max_text, &invalid_max);
+	if (invalid_min != LONGINT_OK || invalid_max != LONGINT_OK) {
+		parse_error(why, why_size, "unable to parse gap %s", quote_mem(h, end - h + 1));
+		return NULL;
+	} else if (min > max) {
+		parse_error(why, why_size, "gap %s has MIN greater than MAX", quote_mem(h, end - h + 1));
+		return NULL;
+	} else if (max > MAX_GAP) {
+		parse_error(why, why_size, "gap %s is too long: the limit is %ju bytes", quote_mem(h, end - h + 1), (uintmax_t) MAX_GAP);
+		return NULL;
+	}
+	byte_pattern_add_gap(pattern, min, max);
+	return end + 1;
+}
+
+
 /* Returns a pointer to the first pattern match in the data, or NULL if none is found */
 const unsigned char * byte_pattern_match(const struct byte_pattern *ptr, const unsigned char *data, size_t len) {
 	const unsigned char * result = (ptr->len == 0) ? data : NULL;
@@ -130,10 +218,15 @@ const unsigned char * byte_pattern_match(const struct byte_pattern *ptr, const u
 	return result;
 }
 
-struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
+/*
+ * Parses pattern_str.  Returns NULL if it is not a valid pattern, after
+ * writing why into the why_size bytes at why, or to stderr if why is NULL.
+ */
+struct byte_pattern *byte_pattern_parse(const char *pattern_str, char *why, size_t why_size) {
 	struct byte_pattern *pattern = xmalloc(sizeof(struct byte_pattern));
 	byte_pattern_init(pattern);
 	size_t groupstack[MAX_REPEAT_GROUPS];
+	size_t gapstack[MAX_REPEAT_GROUPS];   /* gap_count when each group started */
 	int groupstack_top = 0;
 
 	const char *h = pattern_str;
@@ -147,11 +240,12 @@ struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
 				switch (token_type) {
 					case QUOTE_TOKEN:
 						if (groupstack_top >= MAX_REPEAT_GROUPS) {
-							error(0, 0,
+							parse_error(why, why_size,
 								"Too many groups (%d). Recompile with higher MAX_REPEAT_GROUPS",
 								groupstack_top);
 							goto CLEANUP;
 						}
+						gapstack[groupstack_top] = pattern->gap_count;
 						groupstack[groupstack_top++] = pattern->len;
 						parse_mode = MODE_TXT;
 						++h;
@@ -159,14 +253,18 @@ struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
 
 					case MULTIPLIER_TOKEN:
 						if (pattern-> len < 1) {
-							error(0, 0, "cannot repeat an empty pattern!");
+							parse_error(why, why_size, "cannot repeat an empty pattern!");
+							goto CLEANUP;
+						} else if (pattern->gap_count > 0 && pattern->gaps[pattern->gap_count - 1].at == pattern->len) {
+							parse_error(why, why_size, "cannot repeat a variable gap");
 							goto CLEANUP;
 						} else if (groupstack_top >= MAX_REPEAT_GROUPS) {
-							error(0, 0,
+							parse_error(why, why_size,
 								"Too many groups (%d). Recompile with higher MAX_REPEAT_GROUPS",
 								groupstack_top);
 							goto CLEANUP;
 						}
+						gapstack[groupstack_top] = pattern->gap_count;
 						groupstack[groupstack_top++] = pattern->len - 1;
 						parse_mode = MODE_MULTIPLY;
 						++h;
@@ -178,18 +276,19 @@ struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
 
 					case OPEN_GROUP_TOKEN:
 						if (groupstack_top >= MAX_REPEAT_GROUPS) {
-							error(0, 0,
+							parse_error(why, why_size,
 								"Too many groups (%d). Recompile with higher MAX_REPEAT_GROUPS",
 								groupstack_top);
 							goto CLEANUP;
 						}
+						gapstack[groupstack_top] = pattern->gap_count;
 						groupstack[groupstack_top++] = pattern->len;
 						++h;
 						continue;
 
 					case CLOSE_GROUP_TOKEN:
 						if (groupstack_top < 1) {
-							error(0, 0,
+							parse_error(why, why_size,
 								"unmatched ')' in pattern string");
 							goto CLEANUP;
 						}
@@ -198,7 +297,7 @@ struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
 						continue;
 
 					case ESC_TOKEN:
-						error(0, 0, "Unexpected escape character '\\' in hex string");
+						parse_error(why, why_size, "Unexpected escape character '\\' in hex string");
 						goto CLEANUP;
 
 					case OTHER_TOKEN:
@@ -255,7 +354,7 @@ struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
 
 				size_t mult_len = strcspn(h, END_MULTIPLIER_CHARS);
 				if (mult_len == 0) {
-					error(0, 0, "missing REPEAT value for multiplier");
+					parse_error(why, why_size, "missing REPEAT value for multiplier");
 					goto CLEANUP;
 				}
 				char multiplier[mult_len + 1];
@@ -266,13 +365,17 @@ struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
 				multiplier[mult_len] = 0;
 				numrepeat = parse_integer(multiplier, &invalid);
 				if (invalid != LONGINT_OK) {
-					error(0, 0, "unable to parse group multiplier %s", quote(multiplier));
+					parse_error(why, why_size, "unable to parse group multiplier %s", quote(multiplier));
 					goto CLEANUP;
 				} else if (numrepeat < 1) {
-					error(0, 0, "cannot repeat a group less than once!");
+					parse_error(why, why_size, "cannot repeat a group less than once!");
+					goto CLEANUP;
+				}
+				if (pattern->gap_count > gapstack[--groupstack_top]) {
+					parse_error(why, why_size, "cannot repeat a group with a variable gap in it");
 					goto CLEANUP;
 				}
-				byte_pattern_repeat(pattern, pattern->len - groupstack[--groupstack_top], numrepeat-1);
+				byte_pattern_repeat(pattern, pattern->len - groupstack[groupstack_top], numrepeat-1);
 				h += mult_len;
 				parse_mode = MODE_HEX;
 				continue;
@@ -280,7 +383,11 @@ struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
 		}
 
 		// Can only get here in hex mode (token_type=OTHER)
-		if (h[0] == '?' && h[1] == '?')	{
+		if (h[0] == '?' && h[1] == '?' && h[2] == '{') {
+			h = parse_gap(pattern, h + 2, why, why_size);
+			if (h == NULL)
+				goto CLEANUP;
+		} else if (h[0] == '?' && h[1] == '?')	{
 			byte_pattern_append_char(pattern, 0, 0);
 			h += 2;
 		} else {
@@ -289,7 +396,7 @@ struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
 
 			if ((v0 == -1) || (v1 == -1)) {
 				char hex[3] = {h[0],h[1], 0};
-				error(0, 0, "invalid 2-hex-digit byte value: %s", quote(hex));
+				parse_error(why, why_size, "invalid 2-hex-digit byte value: %s", quote(hex));
 				goto CLEANUP;
 			}
 			byte_pattern_append_char(pattern, (v0 << 4) | v1, 0xff);
@@ -300,37 +407,42 @@ struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
 	// We come out in MODE_HEX or MODE_WAITING_GROUP_MULT if the pattern is valid
 	switch (parse_mode) {
 		case MODE_TXT:
-			error(0, 0, "unmatched %s in pattern string", quote("\""));
+			parse_error(why, why_size, "unmatched %s in pattern string", quote("\""));
 			goto CLEANUP;
 		case MODE_TXT_ESC:
-			error(0, 0, "missing character after escape symbol '\\' in pattern string");
+			parse_error(why, why_size, "missing character after escape symbol '\\' in pattern string");
 			goto CLEANUP;
 		case MODE_MULTIPLY:
-			error(0, 0, "REPEAT value missing after repeat symbol %s in pattern string", quote("*"));
+			parse_error(why, why_size, "REPEAT value missing after repeat symbol %s in pattern string", quote("*"));
 			goto CLEANUP;
 		case MODE_WAITING_GROUP_MULT:
 			if (groupstack_top > 1) {
-				error(0, 0, "unmatched %s in pattern string", quote("("));
+				parse_error(why, why_size, "unmatched %s in pattern string", quote("("));
 				goto CLEANUP;
 			}
 			break;
 		case MODE_HEX:
 			if (groupstack_top > 0) {
-				error(0, 0, "unmatched %s in pattern string", quote("("));
+				parse_error(why, why_size, "unmatched %s in pattern string", quote("("));
 				goto CLEANUP;
 			}
 			break;
 		default:
-			error(0, 0, "unexpected pattern parse mode: %d", parse_mode);
+			parse_error(why, why_size, "unexpected pattern parse mode: %d", parse_mode);
 			goto CLEANUP;
 	}
 
 	if (!pattern->len) {
-		error(0, 0, "empty pattern string -- use %s to match all bytes", quote("?\?"));
+		parse_error(why, why_size, "empty pattern string -- use %s to match all bytes", quote("?\?"));
+		goto CLEANUP;
+	} else if (pattern->gap_count > 0 && (pattern->gaps[0].at == pattern->gaps[0].min
+			|| pattern->gaps[pattern->gap_count - 1].at == pattern->len)) {
+		/* Where would the match start or end? */
+		parse_error(why, why_size, "a variable gap cannot start or end a pattern");
 		goto CLEANUP;
 	} else if (*h) {
 		// should be unreachable, but just in case
-		error(0, 0, "trailing garbage in pattern string: %s", quote(h));
+		parse_error(why, why_size, "trailing garbage in pattern string: %s", quote(h));
 		goto CLEANUP;
 	}
 
@@ -341,6 +453,84 @@ CLEANUP:
 }
 
 
+struct byte_pattern *byte_pattern_from_string(const char *pattern_str) {
+	return byte_pattern_parse(pattern_str, NULL, 0);
+}
+
+
+/* Reads all of path into *data, growing it with xrealloc() to *capacity bytes.  Returns its length, or -1 after printing why. */
+static ssize_t read_whole_file(const char *path, unsigned char **data, size_t *capacity) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		error(0, errno, "%s", path);
+		return -1;
+	}
+
+	size_t len = 0;
+	*capacity = INITIAL_BUFSIZE;
+	*data = xrealloc(*data, *capacity);
+	size_t n;
+	while ((n = fread(*data + len, 1, *capacity - len, f)) > 0) {
+		len += n;
+		if (len == *capacity)
+			*data = x2nrealloc(*data, capacity, 1);
+	}
+	int failed = ferror(f);
+	if (fclose(f) || failed) {
+		error(0, errno, "%s", path);
+		return -1;
+	}
+	return len;
+}
+
+
+/*
+ * Makes a pattern of the raw bytes in path.  With mask_path, the bytes of
+ * that file, which must be as long, are the mask: zero bits match anything.
+ * Returns NULL after printing why on failure.
+ */
+struct byte_pattern *byte_pattern_from_file(const char *path, const char *mask_path) {
+	struct byte_pattern *pattern = xmalloc(sizeof(struct byte_pattern));
+	byte_pattern_init(pattern);
+
+	size_t capacity;
+	ssize_t len = read_whole_file(path, &pattern->value, &capacity);
+	if (len < 0)
+		goto CLEANUP;
+	if (len == 0) {
+		error(0, 0, "%s: empty pattern file", path);
+		goto CLEANUP;
+	}
+	pattern->len = len;
+
+	if (mask_path == NULL) {
+		/* Both buffers are capacity bytes long, as byte_pattern_reserve() keeps them */
+		pattern->mask = xrealloc(pattern->mask, capacity);
+		pattern->capacity = capacity;
+		memset(pattern->mask, 0xff, len);
+	} else {
+		size_t mask_capacity;
+		ssize_t mask_len = read_whole_file(mask_path, &pattern->mask, &mask_capacity);
+		if (mask_len < 0)
+			goto CLEANUP;
+		pattern->capacity = MIN(capacity, mask_capacity);
+		if (mask_len != len) {
+			error(0, 0, "%s is %jd bytes long, but %s is %jd", quote_n(0, mask_path), (intmax_t) mask_len,
+					quote_n(1, path), (intmax_t) len);
+			goto CLEANUP;
+		}
+		size_t i = 0;
+		for (; i < pattern->len; ++i)
+			pattern->value[i] &= pattern->mask[i];
+	}
+	return pattern;
+
+CLEANUP:
+	byte_pattern_free(pattern);
+	return NULL;
+}
+
+
 static enum token_types get_token_type(char c) {
 	switch (c) {
 		case '"':
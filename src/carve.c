@@ -0,0 +1,273 @@
+#include "config.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_SENDFILE
+#  include <sys/sendfile.h>
+#endif
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * --carve: write the region around each match to a file of its own.
+ *
+ * The search only queues each region, with a dup() of the file it is
+ * searching; a carver thread copies it with copy_file_range(), which can
+ * share the blocks on filesystems that support reflinks, or sendfile().
+ * Both copy inside the kernel.  With --carve-until, the carver also finds
+ * where each region ends, so the search never waits for it.
+ */
+
+enum { MAX_QUEUED = 256, UNTIL_BUFSIZE = 64 * 1024 };
+
+struct carve_job {
+	struct carve_job *next;
+	int fd;
+	char *target;
+	off_t start;
+	off_t end;      /* the end of the region; with --carve-until, where to stop looking for it (-1: nowhere) */
+	off_t from;     /* with --carve-until, where to start looking */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+
+static const struct bgrep_config *carve_config;
+static pthread_t carver;
+static struct carve_job *queue_head, *queue_tail;
+static unsigned queued;
+static int closing;
+static int carve_result = RESULT_NO_MATCH;
+
+static void *carver_main(void *arg);
+
+
+#if !defined HAVE_COPY_FILE_RANGE
+static ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags) {
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+#if !defined HAVE_SENDFILE
+static ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+
+/* Creates DIR if needed and starts the carver thread.  Returns -1 after printing why on failure. */
+int carve_start(const struct bgrep_config *config) {
+	if (mkdir(config->carve_dir, 0777) && errno != EEXIST) {
+		error(0, errno, "%s", config->carve_dir);
+		return -1;
+	}
+
+	carve_config = config;
+	int err = pthread_create(&carver, NULL, carver_main, NULL);
+	if (err) {
+		error(0, err, "cannot start carver thread");
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Queues the region around the len-byte match at offset in fd, which was opened as filename.  Blocks while the queue is full. */
+void carve_submit(const char *filename, int fd, uintmax_t offset, size_t len) {
+	const struct bgrep_config *config = carve_config;
+	struct carve_job *job = xzalloc(sizeof(*job));
+
+	job->fd = dup(fd);
+	if (job->fd < 0) {
+		error(0, errno, "%s", filename);
+		free(job);
+		pthread_mutex_lock(&lock);
+		carve_result = RESULT_ERROR;
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	job->start = offset - MIN(config->carve_before, offset);
+	job->end = (config->carve_after > 0 || config->carve_until == NULL) ? offset + len + config->carve_after : -1;
+	job->from = offset + len;
+
+	/* Name it after the file, with its directories flattened, and the match's offset */
+	job->target = xmalloc(strlen(config->carve_dir) + strlen(filename) + 20);
+	char *p = job->target + sprintf(job->target, "%s/", config->carve_dir);
+	for (; *filename; ++filename)
+		*p++ = (*filename == '/') ? '_' : *filename;
+	sprintf(p, "@%08jx", offset);
+
+	pthread_mutex_lock(&lock);
+	while (queued >= MAX_QUEUED)
+		pthread_cond_wait(&slot_free, &lock);
+	++queued;
+	if (queue_tail) {
+		queue_tail->next = job;
+	} else {
+		queue_head = job;
+	}
+	queue_tail = job;
+	pthread_cond_signal(&work_ready);
+	pthread_mutex_unlock(&lock);
+}
+
+
+/* Waits for every queued region to be written.  Returns RESULT_ERROR if any could not be. */
+int carve_finish(void) {
+	pthread_mutex_lock(&lock);
+	closing = 1;
+	pthread_cond_signal(&work_ready);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(carver, NULL);
+	return carve_result;
+}
+
+
+static int found_until(const struct bgrep_match *match, void *arg) {
+	uintmax_t *end = arg;
+	*end = match->offset + match->len;
+	return 1;
+}
+
+
+/* With --carve-until, finds the end of the first match of the end pattern after the match, reading no further than job->end */
+static off_t find_until(const struct carve_job *job) {
+	uintmax_t found = 0;
+	unsigned char *buf = xmalloc(UNTIL_BUFSIZE);
+	struct bgrep_stream *stream = bgrep_stream_new(carve_config->carve_until, 0, found_until, &found);
+	off_t position = job->from;
+
+	bgrep_stream_reset(stream, position);
+	while (job->end < 0 || position < job->end) {
+		size_t want = (job->end < 0) ? UNTIL_BUFSIZE : MIN(UNTIL_BUFSIZE, job->end - position);
+		ssize_t r = pread(job->fd, buf, want, position);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1 || bgrep_stream_feed(stream, buf, r))
+			break;
+		position += r;
+	}
+	if (!found)
+		bgrep_stream_finish(stream);
+	bgrep_stream_free(stream);
+	free(buf);
+
+	/* Without an end, carve up to where the search gave up */
+	return found ? (off_t) found : (job->end < 0 ? position : job->end);
+}
+
+
+/* Copies the bytes of in from start up to end, or to its end, to out */
+static int copy_region(int in, int out, off_t start, off_t end) {
+	off_t position = start;
+	int use_copy_file_range = 1;
+	int use_sendfile = 1;
+	unsigned char *buf = NULL;
+
+	while (position < end) {
+		size_t len = MIN(end - position, (off_t) 1 << 30);
+		ssize_t n;
+		if (use_copy_file_range) {
+			n = copy_file_range(in, &position, out, NULL, len, 0);
+			if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				use_copy_file_range = 0;
+				continue;
+			}
+		} else if (use_sendfile) {
+			n = sendfile(out, in, &position, len);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				use_sendfile = 0;
+				continue;
+			}
+		} else {
+			if (buf == NULL)
+				buf = xmalloc(UNTIL_BUFSIZE);
+			n = pread(in, buf, MIN(len, UNTIL_BUFSIZE), position);
+			if (n > 0) {
+				ssize_t w = write(out, buf, n);
+				if (w != n) {
+					n = -1;
+					if (w >= 0)
+						errno = ENOSPC;
+				} else {
+					position += n;
+				}
+			}
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 1) {
+			free(buf);
+			return (n < 0) ? -1 : 0;   /* 0 at the end of the file */
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+
+static void carve_one(const struct carve_job *job) {
+	off_t end = (carve_config->carve_until != NULL) ? find_until(job) : job->end;
+
+	int out = open(job->target, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	int failed = (out < 0) || copy_region(job->fd, out, job->start, end);
+	int err = errno;
+	if (out >= 0 && close(out) && !failed) {
+		failed = 1;
+		err = errno;
+	}
+	if (failed) {
+		error(0, err, "%s", job->target);
+		pthread_mutex_lock(&lock);
+		carve_result = RESULT_ERROR;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+
+static void *carver_main(void *arg) {
+	(void) arg;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (!queue_head && !closing) {
+			pthread_cond_wait(&work_ready, &lock);
+		}
+		struct carve_job *job = queue_head;
+		if (!job) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		queue_head = job->next;
+		if (!queue_head) {
+			queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&lock);
+
+		carve_one(job);
+
+		pthread_mutex_lock(&lock);
+		--queued;
+		pthread_cond_signal(&slot_free);
+		pthread_mutex_unlock(&lock);
+
+		close(job->fd);
+		free(job->target);
+		free(job);
+	}
+}
@@ -0,0 +1,384 @@
+#include "config.h"
+
+#include <errno.h>
+#include <error.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * --checkpoint=FILE: record how far each file has been searched, so that
+ * --resume can carry on after an interruption.
+ *
+ * Searches only update their entry in memory, under a lock taken once per
+ * read.  A writer thread saves a snapshot every CHECKPOINT_SECONDS, and
+ * once more at the end, by writing FILE.tmp and renaming it over FILE, so
+ * FILE always holds a complete checkpoint.
+ *
+ * An entry's offset is where its search can resume: every match that
+ * starts before it has been reported and counted, and none after it has.
+ * FILE is text, one line per file after a header naming the search:
+ *
+ *   bgrep-checkpoint 2 KEY
+ *   DONE OFFSET MATCHES DEV INO SIZE MTIME_NS CTIME_NS PATH
+ *
+ * PATH comes last, with '%', control characters and spaces %-escaped.  An
+ * entry is only resumed if the file's identity, size and times all match,
+ * so a file rewritten in place is searched again from the start.  A block
+ * device is known by its device number (as DEV, with INO and the times 0)
+ * and its size, since the times of its node say nothing of its contents.
+ */
+
+enum { CHECKPOINT_SECONDS = 5 };
+static const char HEADER[] = "bgrep-checkpoint 2";
+
+struct checkpoint_entry {
+	struct checkpoint_entry *next;
+	char *path;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	off_t offset;
+	uintmax_t matches;
+	int done;
+};
+
+struct checkpoint {
+	char *path;
+	char *tmp_path;
+	uint64_t key;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t writer;
+	int writer_started;
+	int closing;
+	int dirty;
+	int write_failed;
+	struct checkpoint_entry *entries;   /* newest first */
+	size_t slot_mask;
+	struct checkpoint_entry **slots;    /* the entries loaded by --resume, by path */
+};
+
+static void *writer_main(void *arg);
+
+
+static void print_path(FILE *f, const char *path) {
+	for (; *path; ++path) {
+		unsigned char c = *path;
+		if (c <= ' ' || c == '%' || c == 0x7f) {
+			fprintf(f, "%%%02x", c);
+		} else {
+			putc(c, f);
+		}
+	}
+}
+
+
+/* Undoes print_path() in place */
+static void unescape_path(char *path) {
+	char *out = path;
+	unsigned c;
+	for (; *path; ++path) {
+		if (*path == '%' && sscanf(path + 1, "%2x", &c) == 1) {
+			*out++ = c;
+			path += 2;
+		} else {
+			*out++ = *path;
+		}
+	}
+	*out = '\0';
+}
+
+
+static size_t slot_index(const char *path, size_t mask) {
+	return hash_bytes(path, strlen(path), 0) & mask;
+}
+
+
+/* Fills in the identity of the input s describes.  For a block device, s->st_size must be its size. */
+static void identify(struct checkpoint_entry *e, const struct stat *s) {
+	if (S_ISBLK(s->st_mode)) {
+		e->dev = s->st_rdev;
+		e->ino = 0;
+		e->mtime_ns = 0;
+		e->ctime_ns = 0;
+	} else {
+		e->dev = s->st_dev;
+		e->ino = s->st_ino;
+		e->mtime_ns = timespec_ns(s->st_mtim);
+		e->ctime_ns = timespec_ns(s->st_ctim);
+	}
+	e->size = s->st_size;
+}
+
+
+/* Reads the entries in cp->path.  A missing file is an empty checkpoint. */
+static int load_checkpoint(struct checkpoint *cp) {
+	FILE *f = fopen(cp->path, "r");
+	if (f == NULL)
+		return (errno == ENOENT) ? 0 : -1;
+
+	char *line = NULL;
+	size_t line_alloc = 0;
+	uint64_t key;
+	int result = 0;
+	if (getline(&line, &line_alloc, f) < 0 || sscanf(line, "bgrep-checkpoint 2 %" SCNx64, &key) != 1) {
+		error(0, 0, "%s: not a bgrep checkpoint", cp->path);
+		result = -2;
+	} else if (key != cp->key) {
+		error(0, 0, "%s: checkpoint is for a different pattern or options", cp->path);
+		result = -2;
+	}
+
+	size_t count = 0;
+	ssize_t len;
+	while (result == 0 && (len = getline(&line, &line_alloc, f)) > 0) {
+		struct checkpoint_entry e;
+		intmax_t offset;
+		int path_start = 0;
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (sscanf(line, "%d %jd %ju %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNd64 " %n",
+				&e.done, &offset, &e.matches, &e.dev, &e.ino, &e.size, &e.mtime_ns, &e.ctime_ns, &path_start) < 8
+				|| path_start == 0)
+			continue;   /* a checkpoint is only ever replaced whole, but be forgiving */
+
+		struct checkpoint_entry *entry = xmemdup(&e, sizeof(e));
+		entry->offset = offset;
+		entry->path = xstrdup(line + path_start);
+		unescape_path(entry->path);
+		entry->next = cp->entries;
+		cp->entries = entry;
+		++count;
+	}
+	free(line);
+	fclose(f);
+
+	size_t slot_count = 16;
+	while (slot_count < 2 * count)
+		slot_count *= 2;
+	cp->slot_mask = slot_count - 1;
+	cp->slots = xcalloc(slot_count, sizeof(*cp->slots));
+	struct checkpoint_entry *e = cp->entries;
+	for (; e != NULL; e = e->next) {
+		size_t i = slot_index(e->path, cp->slot_mask);
+		while (cp->slots[i] != NULL && strcmp(cp->slots[i]->path, e->path))
+			i = (i + 1) & cp->slot_mask;
+		if (cp->slots[i] == NULL)
+			cp->slots[i] = e;   /* the last line for a path wins */
+	}
+	return result;
+}
+
+
+/*
+ * Opens the checkpoint at path for config's search and starts saving it.
+ * With resume, the entries already in it are loaded.  Returns NULL after
+ * printing why on failure.
+ */
+struct checkpoint *checkpoint_open(const char *path, const struct bgrep_config *config, int resume) {
+	struct checkpoint *cp = xzalloc(sizeof(*cp));
+	cp->path = xstrdup(path);
+	cp->tmp_path = xmalloc(strlen(path) + 5);
+	sprintf(cp->tmp_path, "%s.tmp", path);
+	cp->key = search_key(config);
+	pthread_mutex_init(&cp->lock, NULL);
+	pthread_cond_init(&cp->wake, NULL);
+
+	if (resume) {
+		int loaded = load_checkpoint(cp);
+		if (loaded) {
+			if (loaded == -1)
+				error(0, errno, "%s", path);
+			checkpoint_close(cp);
+			return NULL;
+		}
+	}
+
+	cp->dirty = 1;
+	int err = pthread_create(&cp->writer, NULL, writer_main, cp);
+	if (err) {
+		error(0, err, "cannot start checkpoint thread");
+		checkpoint_close(cp);
+		return NULL;
+	}
+	cp->writer_started = 1;
+	return cp;
+}
+
+
+/*
+ * Finds or makes the entry for path, described by s; for a block device,
+ * s->st_size must be the device's size.  If the file was
+ * being searched when the checkpoint was saved, *offset and *matches say
+ * where to carry on; otherwise they are zero.  Returns NULL, with the
+ * entry's match count in *matches, if the file has already been searched.
+ */
+struct checkpoint_entry *checkpoint_begin(struct checkpoint *cp, const char *path, const struct stat *s,
+		off_t *offset, uintmax_t *matches) {
+	struct checkpoint_entry *entry = NULL;
+	struct checkpoint_entry id;
+	identify(&id, s);
+	*offset = 0;
+	*matches = 0;
+
+	pthread_mutex_lock(&cp->lock);
+	if (cp->slots != NULL) {
+		size_t i = slot_index(path, cp->slot_mask);
+		for (; cp->slots[i] != NULL; i = (i + 1) & cp->slot_mask) {
+			if (!strcmp(cp->slots[i]->path, path)) {
+				entry = cp->slots[i];
+				break;
+			}
+		}
+	}
+
+	if (entry != NULL && entry->dev == id.dev && entry->ino == id.ino && entry->size == id.size
+			&& entry->mtime_ns == id.mtime_ns && entry->ctime_ns == id.ctime_ns) {
+		*matches = entry->matches;
+		if (entry->done) {
+			pthread_mutex_unlock(&cp->lock);
+			return NULL;
+		}
+		*offset = entry->offset;
+	} else {
+		/* New, or changed since: start over */
+		if (entry == NULL) {
+			entry = xzalloc(sizeof(*entry));
+			entry->path = xstrdup(path);
+			entry->next = cp->entries;
+			cp->entries = entry;
+		}
+		identify(entry, s);
+		entry->offset = 0;
+		entry->matches = 0;
+		entry->done = 0;
+	}
+	cp->dirty = 1;
+	pthread_mutex_unlock(&cp->lock);
+	return entry;
+}
+
+
+/* Records that every match before offset, and no other, has been reported: matches in all */
+void checkpoint_progress(struct checkpoint *cp, struct checkpoint_entry *entry, off_t offset, uintmax_t matches) {
+	pthread_mutex_lock(&cp->lock);
+	if (offset > entry->offset) {
+		entry->offset = offset;
+		entry->matches = matches;
+		cp->dirty = 1;
+	}
+	pthread_mutex_unlock(&cp->lock);
+}
+
+
+/* Records that the whole file has been searched, finding matches in all */
+void checkpoint_done(struct checkpoint *cp, struct checkpoint_entry *entry, uintmax_t matches) {
+	pthread_mutex_lock(&cp->lock);
+	entry->matches = matches;
+	entry->done = 1;
+	cp->dirty = 1;
+	pthread_mutex_unlock(&cp->lock);
+}
+
+
+/* Writes the current state to the temporary file and renames it over the checkpoint.  Called with the lock held. */
+static void save(struct checkpoint *cp) {
+	char *text = NULL;
+	size_t text_len = 0;
+	FILE *mem = open_memstream(&text, &text_len);
+	if (mem == NULL)
+		return;
+	fprintf(mem, "%s %016" PRIx64 "\n", HEADER, cp->key);
+	struct checkpoint_entry *e = cp->entries;
+	for (; e != NULL; e = e->next) {
+		fprintf(mem, "%d %jd %ju %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64 " ",
+				e->done, (intmax_t) e->offset, e->matches, e->dev, e->ino, e->size, e->mtime_ns, e->ctime_ns);
+		print_path(mem, e->path);
+		putc('\n', mem);
+	}
+	fclose(mem);
+	cp->dirty = 0;
+
+	/* The slow part runs unlocked, so searches never wait for the disk */
+	pthread_mutex_unlock(&cp->lock);
+	FILE *f = fopen(cp->tmp_path, "w");
+	int failed = (f == NULL);
+	if (f != NULL) {
+		failed = fwrite(text, 1, text_len, f) != text_len || fflush(f) || fsync(fileno(f));
+		failed = fclose(f) || failed;
+	}
+	if (!failed)
+		failed = rename(cp->tmp_path, cp->path);
+	int err = errno;
+	free(text);
+	pthread_mutex_lock(&cp->lock);
+
+	if (failed && !cp->write_failed) {
+		error(0, err, "cannot update %s", cp->path);
+		cp->write_failed = 1;
+	}
+}
+
+
+static void *writer_main(void *arg) {
+	struct checkpoint *cp = arg;
+
+	pthread_mutex_lock(&cp->lock);
+	for (;;) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += CHECKPOINT_SECONDS;
+		while (!cp->closing && pthread_cond_timedwait(&cp->wake, &cp->lock, &deadline) != ETIMEDOUT)
+			continue;
+		if (cp->dirty)
+			save(cp);
+		if (cp->closing)
+			break;
+	}
+	pthread_mutex_unlock(&cp->lock);
+	return NULL;
+}
+
+
+/* Saves the checkpoint one last time and frees it.  Returns -1 if it could not be saved. */
+int checkpoint_close(struct checkpoint *cp) {
+	if (cp == NULL)
+		return 0;
+
+	if (cp->writer_started) {
+		pthread_mutex_lock(&cp->lock);
+		cp->closing = 1;
+		pthread_cond_signal(&cp->wake);
+		pthread_mutex_unlock(&cp->lock);
+		pthread_join(cp->writer, NULL);
+	}
+	int result = cp->write_failed ? -1 : 0;
+
+	while (cp->entries != NULL) {
+		struct checkpoint_entry *e = cp->entries;
+		cp->entries = e->next;
+		free(e->path);
+		free(e);
+	}
+	pthread_cond_destroy(&cp->wake);
+	pthread_mutex_destroy(&cp->lock);
+	free(cp->slots);
+	free(cp->tmp_path);
+	free(cp->path);
+	free(cp);
+	return result;
+}
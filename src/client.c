@@ -0,0 +1,129 @@
+#include "config.h"
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bgrep.h"
+
+/*
+ * bgrep --daemon: hand the parsed command line to a running bgrepd and relay
+ * its output.  Returns -1 (and prints nothing) if the search should run
+ * locally instead, e.g. because no daemon is listening.
+ */
+
+static int connect_daemon(const char *socket_path) {
+	struct sockaddr_un addr;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+static int send_option(int fd, const char *name, uintmax_t value) {
+	char option[64];
+	int len = snprintf(option, sizeof(option), "%s=%ju", name, value);
+	return wire_write_frame(fd, WIRE_OPTION, option, len);
+}
+
+
+static int send_request(int fd, const struct bgrep_config *config) {
+	char *cwd = getcwd(NULL, 0);
+	int failed = (cwd == NULL)
+		|| wire_write_frame(fd, WIRE_PATTERN, config->pattern_text, strlen(config->pattern_text))
+		|| wire_write_frame(fd, WIRE_DIRECTORY, cwd, strlen(cwd))
+		|| send_option(fd, "print_mode", config->print_mode)
+		|| send_option(fd, "first_only", config->first_only)
+		|| send_option(fd, "with_filename", config->print_filenames)
+		|| send_option(fd, "recurse", config->recurse)
+		|| send_option(fd, "before", config->bytes_before)
+		|| send_option(fd, "after", config->bytes_after)
+		|| send_option(fd, "skip", config->skip_to)
+		|| (config->decompress && send_option(fd, "decompress", 1));
+	free(cwd);
+
+	int i = 0;
+	for (; !failed && i < config->filename_count; ++i) {
+		const char *name = config->filenames[i];
+		failed = wire_write_frame(fd, WIRE_FILENAME, name, strlen(name));
+	}
+	return failed || wire_write_frame(fd, WIRE_END, NULL, 0);
+}
+
+
+int daemon_search(const struct bgrep_config *config) {
+	/* Options bgrepd does not implement */
+	if (config->pattern_file != NULL || config->index_path != NULL || config->cache_dir != NULL || config->stats || config->tee
+			|| config->carve_dir != NULL || config->follow || config->checkpoint_path != NULL
+			|| config->direct || config->drop_cache || config->io_size || config->progress || config->concat
+			|| config->dedup_content)
+		return -1;
+
+	int i = 0;
+	for (; i < config->filename_count; ++i) {
+		/* Standard input belongs to us, not the daemon */
+		if (!strcmp(config->filenames[i], "-"))
+			return -1;
+	}
+
+	int fd = connect_daemon(config->daemon_socket);
+	if (fd < 0)
+		return -1;
+
+	int result = -1;
+	if (send_request(fd, config)) {
+		close(fd);
+		return -1;
+	}
+
+	char type;
+	size_t len;
+	char *payload;
+	int received = 0;
+	while ((payload = wire_read_frame(fd, &type, &len)) != NULL) {
+		received = 1;
+		switch (type) {
+			case WIRE_STDOUT:
+				fwrite(payload, 1, len, stdout);
+				break;
+			case WIRE_STDERR:
+				fflush(stdout);
+				fwrite(payload, 1, len, stderr);
+				break;
+			case WIRE_EXIT:
+				result = (len == 1) ? payload[0] : RESULT_ERROR;
+				break;
+			default:
+				break;
+		}
+		free(payload);
+		if (type == WIRE_EXIT)
+			break;
+	}
+	close(fd);
+
+	if (result < 0 && received) {
+		/* Too late to fall back: some output has already been printed */
+		error(0, 0, "lost connection to bgrepd on %s", config->daemon_socket);
+		result = RESULT_ERROR;
+	}
+	return result;
+}
@@ -0,0 +1,119 @@
+#include "config.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* gnulib dependencies */
+#include "quote.h"
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * --concat: the FILEs, in order, as segments of one input.
+ *
+ * Each segment is opened once and its size taken then; segment i starts
+ * where the ones before it end.  search_concat() feeds them all to one
+ * stream, so matches can span segments and offsets are counted from the
+ * start of the first, and concat_locate() turns such an offset back into
+ * a segment and an offset within it.  Segments must have a size, so
+ * standard input and pipes cannot be one.
+ */
+
+struct concat {
+	int count;
+	const char * const *names;
+	int *fds;
+	off_t *starts;    /* count + 1 of them: the last is the total size */
+};
+
+
+/* Opens the count files named in names.  Returns NULL after printing why on failure. */
+struct concat *concat_open(const struct bgrep_config *config, const char * const *names, int count) {
+	struct concat *c = xzalloc(sizeof(*c));
+	c->names = names;
+	c->fds = xnmalloc(count, sizeof(*c->fds));
+	c->starts = xnmalloc(count + 1, sizeof(*c->starts));
+	c->starts[0] = 0;
+
+	for (; c->count < count; ++c->count) {
+		const char *name = names[c->count];
+		struct stat s;
+		if (strcmp(name, "-") && fstatat(config->dir_fd, name, &s, 0)) {
+			error(0, errno, "%s", name);
+			concat_close(c);
+			return NULL;
+		}
+		/* Checked before opening, as opening a FIFO waits for a writer */
+		if (!strcmp(name, "-") || !(S_ISREG(s.st_mode) || S_ISBLK(s.st_mode))) {
+			error(0, 0, "%s: %s needs files or block devices, whose size is known", name, quote("--concat"));
+			concat_close(c);
+			return NULL;
+		}
+		int fd = openat(config->dir_fd, name, O_RDONLY | O_BINARY);
+		off_t size = (fd < 0) ? -1 : input_size(fd);
+		if (size < 0) {
+			error(0, errno, "%s", name);
+			if (fd >= 0)
+				close(fd);
+			concat_close(c);
+			return NULL;
+		}
+		c->fds[c->count] = fd;
+		c->starts[c->count + 1] = c->starts[c->count] + size;
+	}
+	return c;
+}
+
+
+void concat_close(struct concat *c) {
+	if (c == NULL)
+		return;
+	int i = 0;
+	for (; i < c->count; ++i)
+		close(c->fds[i]);
+	free(c->starts);
+	free(c->fds);
+	free(c);
+}
+
+
+int concat_count(const struct concat *c) {
+	return c->count;
+}
+
+
+/* The size of the whole */
+off_t concat_size(const struct concat *c) {
+	return c->starts[c->count];
+}
+
+
+/* Describes segment i: its name and descriptor, and where it starts and ends in the whole */
+const char *concat_segment(const struct concat *c, int i, int *fd, off_t *start, off_t *end) {
+	*fd = c->fds[i];
+	*start = c->starts[i];
+	*end = c->starts[i + 1];
+	return c->names[i];
+}
+
+
+/* Returns the name of the segment that offset, in the whole, lies in, and stores the offset within it in *local */
+const char *concat_locate(const struct concat *c, off_t offset, off_t *local) {
+	/* The last segment that starts at or before offset; empty ones are passed over */
+	int lo = 0, hi = c->count - 1;
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (c->starts[mid] <= offset) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	*local = offset - c->starts[lo];
+	return c->names[lo];
+}
@@ -0,0 +1,74 @@
+#include "config.h"
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#include "bgrep.h"
+
+/*
+ * Counting without finding: -c, -l and -q with patterns of COUNT_MAX_LEN
+ * bytes or fewer, where a match every few bytes is normal (byte
+ * histograms, runs of fill) and reporting each one would cost far more
+ * than the comparison.
+ *
+ * Every start position is tried at once, VECTOR of them at a time: each
+ * byte of the pattern is masked and compared with the data shifted by its
+ * index, the results are ANDed, and the set bits of the byte mask are
+ * counted.  UNROLL vectors are compared before any are counted, so a
+ * block without a match, the usual case for rare bytes, costs one test.
+ * Matches may overlap, so 0000 is found twice in 00 00 00.  Without SSE2 a
+ * plain loop does the same one position at a time.
+ */
+
+enum { VECTOR = 16, UNROLL = 4 };
+
+
+/* Can count_matches() count pattern? */
+int count_supported(const struct byte_pattern *pattern) {
+	return pattern->len >= 1 && pattern->len <= COUNT_MAX_LEN && pattern->gap_count == 0;
+}
+
+
+/* Counts the matches of pattern that lie wholly within the len bytes at data */
+uintmax_t count_matches(const struct byte_pattern *pattern, const unsigned char *data, size_t len) {
+	const size_t plen = pattern->len;
+	if (len < plen)
+		return 0;
+
+	/* A one-byte pattern compares its second byte as "anything" */
+	const unsigned char value0 = pattern->value[0], mask0 = pattern->mask[0];
+	const unsigned char value1 = (plen > 1) ? pattern->value[1] : 0;
+	const unsigned char mask1 = (plen > 1) ? pattern->mask[1] : 0;
+	const size_t starts = len - plen + 1;
+	uintmax_t count = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i v0 = _mm_set1_epi8(value0), m0 = _mm_set1_epi8(mask0);
+	const __m128i v1 = _mm_set1_epi8(value1), m1 = _mm_set1_epi8(mask1);
+	for (; i + UNROLL * VECTOR <= starts; i += UNROLL * VECTOR) {
+		__m128i eq[UNROLL], any = _mm_setzero_si128();
+		int k = 0;
+		for (; k < UNROLL; ++k) {
+			const unsigned char *p = data + i + k * VECTOR;
+			eq[k] = _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i *) p), m0), v0);
+			if (plen > 1) {
+				__m128i second = _mm_loadu_si128((const __m128i *) (p + 1));
+				eq[k] = _mm_and_si128(eq[k], _mm_cmpeq_epi8(_mm_and_si128(second, m1), v1));
+			}
+			any = _mm_or_si128(any, eq[k]);
+		}
+		if (_mm_movemask_epi8(any) == 0)
+			continue;
+		for (k = 0; k < UNROLL; ++k)
+			count += __builtin_popcount(_mm_movemask_epi8(eq[k]));
+	}
+#endif
+
+	for (; i < starts; ++i) {
+		if ((data[i] & mask0) == value0 && (plen == 1 || (data[i + 1] & mask1) == value1))
+			++count;
+	}
+	return count;
+}
@@ -0,0 +1,268 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * bgrep -z: decompression on a decoder thread.
+ *
+ * The decoder reads the compressed file and is the producer of a
+ * slot_ring, whose slots the searching thread consumes in order, so
+ * decoding the next slot overlaps with searching the last one.  The format
+ * is recognized by its magic bytes; anything else is passed through
+ * unchanged.  Everything the thread allocates hangs off struct decoder and
+ * is freed after the ring is stopped.
+ */
+
+enum { SLOT_SIZE = 256 * 1024, INPUT_SIZE = 128 * 1024 };
+
+struct decoder {
+	int fd;
+	struct slot_ring *ring;
+
+	/* Owned by the decoder thread until the ring is stopped */
+	unsigned char *input;
+	const unsigned char *next_in;
+	size_t avail_in;
+	int error;                 /* errno for a read error */
+	const char *message;       /* otherwise, what was wrong with the data */
+	uintmax_t bytes_read;
+	uintmax_t read_calls;
+#ifdef HAVE_ZLIB
+	z_stream zlib;
+	int zlib_ready;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx *zstd;
+#endif
+};
+
+static const unsigned char GZIP_MAGIC[] = { 0x1f, 0x8b };
+static const unsigned char ZSTD_MAGIC[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+
+/* The format of data that starts with the len bytes at p */
+enum compression compression_type(const unsigned char *p, size_t len) {
+	if (len >= sizeof(GZIP_MAGIC) && !memcmp(p, GZIP_MAGIC, sizeof(GZIP_MAGIC)))
+		return COMPRESSION_GZIP;
+	if (len >= sizeof(ZSTD_MAGIC) && !memcmp(p, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)))
+		return COMPRESSION_ZSTD;
+	return COMPRESSION_NONE;
+}
+
+
+/* Makes at least want bytes of input available, unless the file ends first.  Returns -1 on a read error. */
+static int refill(struct decoder *d, size_t want) {
+	if (d->avail_in >= want)
+		return 0;
+	memmove(d->input, d->next_in, d->avail_in);
+	d->next_in = d->input;
+
+	while (d->avail_in < want) {
+		ssize_t r = ring_read(d->fd, d->input + d->avail_in, INPUT_SIZE - d->avail_in);
+		++d->read_calls;
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			d->error = errno;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		d->bytes_read += r;
+		d->avail_in += r;
+	}
+	return 0;
+}
+
+
+static void pass_through(struct decoder *d) {
+	unsigned char *slot;
+	while ((slot = ring_claim(d->ring)) != NULL) {
+		if (d->avail_in == 0 && (refill(d, 1) || d->avail_in == 0))
+			return;
+		size_t len = MIN(d->avail_in, SLOT_SIZE);
+		memcpy(slot, d->next_in, len);
+		d->next_in += len;
+		d->avail_in -= len;
+		ring_publish(d->ring, len);
+	}
+}
+
+
+#ifdef HAVE_ZLIB
+static void decode_gzip(struct decoder *d) {
+	z_stream *z = &d->zlib;
+	if (inflateInit2(z, 16 + MAX_WBITS) != Z_OK) {
+		d->message = "cannot start gzip decoder";
+		return;
+	}
+	d->zlib_ready = 1;
+
+	unsigned char *slot;
+	while ((slot = ring_claim(d->ring)) != NULL) {
+		if (d->avail_in == 0 && refill(d, 1))
+			return;
+		if (d->avail_in == 0) {
+			d->message = "unexpected end of gzip data";
+			return;
+		}
+
+		z->next_in = (unsigned char *) d->next_in;
+		z->avail_in = d->avail_in;
+		z->next_out = slot;
+		z->avail_out = SLOT_SIZE;
+		int ret = inflate(z, Z_NO_FLUSH);
+		d->next_in = z->next_in;
+		d->avail_in = z->avail_in;
+		ring_publish(d->ring, SLOT_SIZE - z->avail_out);
+
+		if (ret == Z_STREAM_END) {
+			/* Like gzip, decode concatenated members and ignore anything else that follows */
+			if (refill(d, sizeof(GZIP_MAGIC)) || compression_type(d->next_in, d->avail_in) != COMPRESSION_GZIP)
+				return;
+			inflateReset(z);
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			d->message = z->msg ? z->msg : "invalid gzip data";
+			return;
+		}
+	}
+}
+#endif
+
+
+#ifdef HAVE_ZSTD
+static void decode_zstd(struct decoder *d) {
+	d->zstd = ZSTD_createDCtx();
+	if (d->zstd == NULL) {
+		d->message = "cannot start zstd decoder";
+		return;
+	}
+
+	size_t pending = 1;   /* zero once a frame is complete */
+	unsigned char *slot;
+	while ((slot = ring_claim(d->ring)) != NULL) {
+		if (d->avail_in == 0 && refill(d, 1))
+			return;
+		if (d->avail_in == 0) {
+			if (pending != 0)
+				d->message = "unexpected end of zstd data";
+			return;
+		}
+
+		ZSTD_inBuffer in = { d->next_in, d->avail_in, 0 };
+		ZSTD_outBuffer out = { slot, SLOT_SIZE, 0 };
+		pending = ZSTD_decompressStream(d->zstd, &out, &in);
+		d->next_in += in.pos;
+		d->avail_in -= in.pos;
+		ring_publish(d->ring, out.pos);
+		if (ZSTD_isError(pending)) {
+			d->message = ZSTD_getErrorName(pending);
+			return;
+		}
+	}
+}
+#endif
+
+
+static void decode(void *arg) {
+	struct decoder *d = arg;
+
+	if (refill(d, sizeof(ZSTD_MAGIC)) == 0) {
+		switch (compression_type(d->next_in, d->avail_in)) {
+			case COMPRESSION_GZIP:
+#ifdef HAVE_ZLIB
+				decode_gzip(d);
+#else
+				d->message = "gzip support is not compiled in";
+#endif
+				break;
+			case COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+				decode_zstd(d);
+#else
+				d->message = "zstd support is not compiled in";
+#endif
+				break;
+			case COMPRESSION_NONE:
+			default:
+				pass_through(d);
+				break;
+		}
+	}
+}
+
+
+static void free_decoder(struct decoder *d) {
+#ifdef HAVE_ZLIB
+	if (d->zlib_ready)
+		inflateEnd(&d->zlib);
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeDCtx(d->zstd);
+#endif
+	free(d->input);
+	free(d);
+}
+
+
+/* Starts decoding fd from its current position.  Returns NULL after printing why on failure. */
+struct decoder *decoder_start(struct output_context *out, int fd) {
+	struct decoder *d = xzalloc(sizeof(*d));
+	d->fd = fd;
+	d->input = xmalloc(INPUT_SIZE);
+	d->next_in = d->input;
+	d->ring = ring_new(SLOT_SIZE);
+
+	int err = ring_start(d->ring, decode, d);
+	if (err) {
+		print_error(out, err, "cannot start decoder thread");
+		ring_stop(d->ring);
+		free_decoder(d);
+		return NULL;
+	}
+	return d;
+}
+
+
+/* The decoded data, for ring_next() and ring_release() */
+struct slot_ring *decoder_ring(struct decoder *d) {
+	return d->ring;
+}
+
+
+/*
+ * Stops the decoder and frees it, adding its reads to out's statistics.
+ * Errors are only reported if the search got as far as them.  Returns
+ * RESULT_ERROR after reporting one, RESULT_NO_MATCH otherwise.
+ */
+int decoder_finish(struct decoder *d, struct output_context *out) {
+	int drained = ring_stop(d->ring);
+
+	int result = RESULT_NO_MATCH;
+	if (drained && d->error) {
+		print_error(out, d->error, "%s", out->filename);
+		result = RESULT_ERROR;
+	} else if (drained && d->message) {
+		print_error(out, 0, "%s: %s", out->filename, d->message);
+		result = RESULT_ERROR;
+	}
+	out->stats.bytes_read += d->bytes_read;
+	out->stats.read_calls += d->read_calls;
+	free_decoder(d);
+	return result;
+}
@@ -0,0 +1,290 @@
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * --dedup-content: search each distinct content once per run.
+ *
+ * A searched file's results (its count, and the offsets of up to
+ * MAX_CACHED_OFFSETS matches, as --cache keeps them) are recorded with its
+ * size, a sample fingerprint and a 128-bit hash of its contents, which the
+ * search computes from the data it reads.  Another file of the same size
+ * is sampled: its first and last SAMPLE_BLOCK bytes and SAMPLES blocks
+ * spread evenly between them, hashed together.  Only if that matches is
+ * it read and hashed in full, and only if the full hash matches too are
+ * the recorded results replayed for it.  Files of SAMPLE_WHOLE bytes or
+ * fewer are sampled whole, which settles it at once.  Hard links to a
+ * searched file are known by their inode and never read.
+ *
+ * Groups are only added, and never change once added, so a group found
+ * under the lock can be used after it is released.  The hashes are not
+ * cryptographic: files crafted to collide would share results.
+ */
+
+enum { SAMPLE_BLOCK = 4096, SAMPLES = 8, SAMPLE_WHOLE = (SAMPLES + 2) * SAMPLE_BLOCK };
+enum { HASH_BUFSIZE = 1024 * 1024 };
+/* All groups together keep no more offsets than this; beyond it, only counts */
+enum { MAX_DEDUP_OFFSETS = 16 * 1024 * 1024 };
+
+struct dedup_group {
+	struct dedup_group *next;   /* in its bucket */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	uint64_t sample;
+	uint64_t content[2];
+	uintmax_t match_count;
+	size_t offset_count;
+	uint64_t *offsets;
+};
+
+struct dedup {
+	pthread_mutex_t lock;
+	size_t bucket_mask;
+	size_t group_count;
+	struct dedup_group **buckets;   /* by size */
+	size_t offsets_left;
+};
+
+
+static inline size_t bucket_index(off_t size, size_t mask) {
+	return hash_bytes(&size, sizeof(size), 0) & mask;
+}
+
+
+struct dedup *dedup_new(void) {
+	struct dedup *d = xzalloc(sizeof(*d));
+	pthread_mutex_init(&d->lock, NULL);
+	d->bucket_mask = 1023;
+	d->buckets = xcalloc(d->bucket_mask + 1, sizeof(*d->buckets));
+	d->offsets_left = MAX_DEDUP_OFFSETS;
+	return d;
+}
+
+
+void dedup_free(struct dedup *d) {
+	if (d == NULL)
+		return;
+	size_t i = 0;
+	for (; i <= d->bucket_mask; ++i) {
+		struct dedup_group *g = d->buckets[i];
+		while (g != NULL) {
+			struct dedup_group *next = g->next;
+			free(g->offsets);
+			free(g);
+			g = next;
+		}
+	}
+	pthread_mutex_destroy(&d->lock);
+	free(d->buckets);
+	free(d);
+}
+
+
+/* Hashes len bytes of fd from offset into c.  Returns -1 on a read error or if the file is shorter. */
+static int hash_range(struct output_context *out, int fd, off_t offset, off_t len, struct content_hash *c,
+		unsigned char *buf, size_t buf_size) {
+	while (len > 0) {
+		ssize_t r = pread(fd, buf, MIN((off_t) buf_size, len), offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1)
+			return -1;
+		++out->stats.read_calls;
+		out->stats.bytes_read += r;
+		content_hash_update(c, buf, r);
+		offset += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+/* The sample fingerprint of fd, which is size bytes long.  Returns -1 in *failed on a read error. */
+static uint64_t sample(struct output_context *out, int fd, off_t size, int *failed) {
+	unsigned char buf[SAMPLE_BLOCK];
+	struct content_hash c;
+	uint64_t digest[2];
+
+	content_hash_init(&c);
+	if (size <= SAMPLE_WHOLE) {
+		*failed = hash_range(out, fd, 0, size, &c, buf, sizeof(buf));
+	} else {
+		/* SAMPLES + 2 blocks at even steps, from the first to the last */
+		off_t step = (size - SAMPLE_BLOCK) / (SAMPLES + 1);
+		int i = 0;
+		*failed = 0;
+		for (; i < SAMPLES + 2 && !*failed; ++i) {
+			off_t at = (i == SAMPLES + 1) ? size - SAMPLE_BLOCK : i * step;
+			*failed = hash_range(out, fd, at, SAMPLE_BLOCK, &c, buf, sizeof(buf));
+		}
+	}
+	content_hash_final(&c, digest);
+	return digest[0];
+}
+
+
+/* Finds the group of content in the bucket for size: the first with the same identity, if not NULL, or else the same sample and hash */
+static const struct dedup_group *find_group(struct dedup *d, const struct stat *s, const uint64_t *sample_hash,
+		const uint64_t *content) {
+	const struct dedup_group *g = d->buckets[bucket_index(s->st_size, d->bucket_mask)];
+	for (; g != NULL; g = g->next) {
+		if (g->size != s->st_size)
+			continue;
+		if (sample_hash == NULL) {
+			if (g->dev == s->st_dev && g->ino == s->st_ino)
+				return g;
+		} else if (g->sample == *sample_hash && (content == NULL || !memcmp(g->content, content, sizeof(g->content)))) {
+			return g;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Looks for an earlier file with the same contents as fd, described by s.
+ * Returns 0 on a hit, with its results in *result; they stay valid until
+ * dedup_free().  Reads the file only as far as telling it apart takes.
+ */
+int dedup_lookup(struct dedup *d, struct output_context *out, int fd, const struct stat *s, struct cached_result *result) {
+	const struct dedup_group *g;
+	int failed;
+
+	pthread_mutex_lock(&d->lock);
+	g = find_group(d, s, NULL, NULL);
+	int sized = (g != NULL);
+	if (!sized) {
+		size_t i = bucket_index(s->st_size, d->bucket_mask);
+		for (g = d->buckets[i]; g != NULL && g->size != s->st_size; g = g->next)
+			continue;
+		sized = (g != NULL);
+		g = NULL;
+	}
+	pthread_mutex_unlock(&d->lock);
+	if (!sized)
+		return -1;
+
+	if (g == NULL) {
+		uint64_t sample_hash = sample(out, fd, s->st_size, &failed);
+		if (failed)
+			return -1;
+		pthread_mutex_lock(&d->lock);
+		g = find_group(d, s, &sample_hash, NULL);
+		pthread_mutex_unlock(&d->lock);
+
+		if (g != NULL && s->st_size > SAMPLE_WHOLE) {
+			struct content_hash c;
+			uint64_t content[2];
+			unsigned char *buf = xmalloc(HASH_BUFSIZE);
+			content_hash_init(&c);
+			failed = hash_range(out, fd, 0, s->st_size, &c, buf, HASH_BUFSIZE);
+			free(buf);
+			if (failed)
+				return -1;
+			content_hash_final(&c, content);
+			pthread_mutex_lock(&d->lock);
+			g = find_group(d, s, &sample_hash, content);
+			pthread_mutex_unlock(&d->lock);
+		}
+		if (g == NULL)
+			return -1;
+	}
+
+	result->match_count = g->match_count;
+	result->offset_count = g->offset_count;
+	result->offsets = (const unsigned char *) g->offsets;
+	return 0;
+}
+
+
+/* Doubles the buckets once there are more groups than them.  Called with the lock held. */
+static void grow(struct dedup *d) {
+	size_t mask = d->bucket_mask * 2 + 1;
+	struct dedup_group **buckets = xcalloc(mask + 1, sizeof(*buckets));
+	size_t i = 0;
+	for (; i <= d->bucket_mask; ++i) {
+		struct dedup_group *g = d->buckets[i];
+		while (g != NULL) {
+			struct dedup_group *next = g->next;
+			size_t j = bucket_index(g->size, mask);
+			g->next = buckets[j];
+			buckets[j] = g;
+			g = next;
+		}
+	}
+	free(d->buckets);
+	d->buckets = buckets;
+	d->bucket_mask = mask;
+}
+
+
+/*
+ * Records the results of searching fd, described by s.  content holds the
+ * hash of the data the search read from the start of the file, however far
+ * it got; the rest is read here.  Pass fewer offsets than match_count to
+ * keep only the count.
+ */
+void dedup_store(struct dedup *d, struct output_context *out, int fd, const struct stat *s,
+		struct content_hash *content, uintmax_t match_count, const uintmax_t *offsets, size_t offset_count) {
+	struct dedup_group *g = xzalloc(sizeof(*g));
+	int failed = 0;
+
+	if ((off_t) content->len < s->st_size) {
+		unsigned char *buf = xmalloc(HASH_BUFSIZE);
+		failed = hash_range(out, fd, content->len, s->st_size - content->len, content, buf, HASH_BUFSIZE);
+		free(buf);
+	}
+	if (failed || (off_t) content->len != s->st_size) {
+		free(g);
+		return;
+	}
+	content_hash_final(content, g->content);
+	/* A small file's sample is the whole of it */
+	if (s->st_size <= SAMPLE_WHOLE) {
+		g->sample = g->content[0];
+	} else {
+		g->sample = sample(out, fd, s->st_size, &failed);
+		if (failed) {
+			free(g);
+			return;
+		}
+	}
+	g->dev = s->st_dev;
+	g->ino = s->st_ino;
+	g->size = s->st_size;
+	g->match_count = match_count;
+
+	pthread_mutex_lock(&d->lock);
+	if (offset_count == match_count && offset_count <= MAX_CACHED_OFFSETS && offset_count <= d->offsets_left) {
+		d->offsets_left -= offset_count;
+		g->offset_count = offset_count;
+	}
+	pthread_mutex_unlock(&d->lock);
+	/* Filled in before the group is inserted, as lookups read it without the lock */
+	if (g->offset_count > 0) {
+		g->offsets = xnmalloc(g->offset_count, sizeof(*g->offsets));
+		size_t i = 0;
+		for (; i < g->offset_count; ++i)
+			g->offsets[i] = offsets[i];
+	}
+
+	pthread_mutex_lock(&d->lock);
+	if (++d->group_count > d->bucket_mask)
+		grow(d);
+	size_t i = bucket_index(g->size, d->bucket_mask);
+	g->next = d->buckets[i];
+	d->buckets[i] = g;
+	pthread_mutex_unlock(&d->lock);
+}
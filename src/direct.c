@@ -0,0 +1,153 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_LINUX_FS_H
+#  include <linux/fs.h>
+#endif
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * --direct and --drop-cache: read devices and files without filling the
+ * page cache.
+ *
+ * --direct reopens the input with O_DIRECT and reads whole aligned blocks
+ * of --io-size bytes into an aligned buffer, handing the search the part
+ * it asked for, so unaligned starts (--skip, --index ranges) still work.
+ * Where the filesystem refuses O_DIRECT, and with --drop-cache, the input
+ * is read as usual and each block is dropped from the cache with
+ * posix_fadvise(POSIX_FADV_DONTNEED) once searched.  Everything else
+ * (context, carving) keeps using the ordinary descriptor.
+ */
+
+enum { MIN_ALIGNMENT = 4096 };
+
+struct direct_reader {
+	int fd;            /* the O_DIRECT descriptor, or the input's own with posix_fadvise() */
+	int own_fd;
+	size_t alignment;
+	size_t size;       /* of a read, a multiple of alignment */
+	unsigned char *buf;
+};
+
+
+/* The size of the file or block device open as fd, or -1 if it has none */
+off_t input_size(int fd) {
+	struct stat s;
+	if (fstat(fd, &s))
+		return -1;
+	if (S_ISREG(s.st_mode))
+		return s.st_size;
+#if defined HAVE_LINUX_FS_H && defined BLKGETSIZE64
+	uint64_t size;
+	if (S_ISBLK(s.st_mode) && !ioctl(fd, BLKGETSIZE64, &size))
+		return size;
+#endif
+	return -1;
+}
+
+
+/*
+ * Prepares to read fd, a file or block device, as config's --direct or
+ * --drop-cache asks.  Returns NULL for other inputs, which are read as
+ * usual.
+ */
+struct direct_reader *direct_open(const struct bgrep_config *config, int fd) {
+	struct stat s;
+	if (fstat(fd, &s) || !(S_ISREG(s.st_mode) || S_ISBLK(s.st_mode)))
+		return NULL;
+
+	struct direct_reader *r = xzalloc(sizeof(*r));
+	r->fd = fd;
+	r->alignment = MIN_ALIGNMENT;
+#if defined HAVE_LINUX_FS_H && defined BLKSSZGET
+	int sector_size;
+	if (S_ISBLK(s.st_mode) && !ioctl(fd, BLKSSZGET, &sector_size) && (size_t) sector_size > r->alignment)
+		r->alignment = sector_size;
+#endif
+	r->size = (config->io_size + r->alignment - 1) / r->alignment * r->alignment;
+
+#ifdef O_DIRECT
+	if (config->direct) {
+		/* Reopening gives a descriptor of its own, so the flag does not affect other reads */
+		char path[32];
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+		int direct_fd = open(path, O_RDONLY | O_DIRECT | O_BINARY);
+		if (direct_fd >= 0) {
+			r->fd = direct_fd;
+			r->own_fd = 1;
+		}
+	}
+#endif
+	/* One extra block lets an unaligned start still read a full size */
+	if (posix_memalign((void **) &r->buf, r->alignment, r->size + r->alignment))
+		xalloc_die();
+	return r;
+}
+
+
+void direct_close(struct direct_reader *r) {
+	if (r == NULL)
+		return;
+	if (r->own_fd)
+		close(r->fd);
+	free(r->buf);
+	free(r);
+}
+
+
+/* Stops reading with O_DIRECT, after the filesystem refused it */
+static void fall_back(struct direct_reader *r, int fd) {
+	close(r->fd);
+	r->fd = fd;
+	r->own_fd = 0;
+}
+
+
+/*
+ * Reads up to len bytes at position from fd, the descriptor r was opened
+ * for.  Points *data at them and returns how many there are: 0 at the
+ * end, -1 on an error.
+ */
+ssize_t direct_read(struct direct_reader *r, int fd, const unsigned char **data, size_t len, off_t position) {
+	off_t start = position;
+	size_t want = MIN(len, r->size);
+	if (r->own_fd) {
+		start = position / r->alignment * r->alignment;
+		want = (position - start + want + r->alignment - 1) / r->alignment * r->alignment;
+	}
+
+	ssize_t n;
+	do {
+		n = pread(r->fd, r->buf, want, start);
+		if (n < 0 && errno == EINVAL && r->own_fd) {
+			fall_back(r, fd);
+			start = position;
+			want = MIN(len, r->size);
+			errno = EINTR;
+		}
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+
+#ifdef POSIX_FADV_DONTNEED
+	if (!r->own_fd && n > 0)
+		posix_fadvise(r->fd, start, n, POSIX_FADV_DONTNEED);
+#endif
+
+	*data = r->buf + (position - start);
+	if (n <= position - start)
+		return 0;
+	return MIN((size_t) (n - (position - start)), len);
+}
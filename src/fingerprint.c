@@ -0,0 +1,146 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * Block fingerprints for long literal patterns.
+ *
+ * The input is cut into blocks of fp->block bytes, counted from where the
+ * stream started.  A pattern at least 2 * block - 1 bytes long always
+ * covers a whole block of the input, and the first one it covers starts
+ * j < block bytes into the pattern.  So the table holds the hash of the
+ * pattern's block-sized window at each such j, and each block of the
+ * input is hashed once, a word at a time, and looked up: a hit at j makes
+ * the input offset j bytes before the block a candidate, which the stream
+ * then verifies.
+ *
+ * Input blocks never overlap, so unlike Rabin-Karp nothing needs to roll;
+ * only the table's windows do, and they are few.  If two windows are the
+ * same (zero padding, say), every block of such bytes would make several
+ * candidates that all live as long as the pattern is, so such patterns are
+ * left to the ordinary matcher, whose memchr() anchor copes with them.
+ */
+
+enum { MAX_BLOCK = 1024, WORD = sizeof(uint64_t), LANES = 4 };
+static const uint64_t MULTIPLIER = 0x9e3779b97f4a7c15ULL;
+
+struct fingerprint_slot {
+	uint64_t hash;
+	size_t offset;    /* j, plus one: zero marks an empty slot */
+};
+
+struct fingerprint {
+	size_t block;
+	size_t slot_mask;
+	struct fingerprint_slot *slots;
+};
+
+
+static inline uint64_t mix(uint64_t h, const unsigned char *p) {
+	uint64_t word;
+	memcpy(&word, p, WORD);
+	h = (h ^ word) * MULTIPLIER;
+	return h ^ (h >> 29);
+}
+
+
+/* Hashes the block at p, block bytes long, in LANES independent chains so the multiplies overlap */
+uint64_t fingerprint_hash(const struct fingerprint *fp, const unsigned char *p) {
+	uint64_t h0 = 0, h1 = 1, h2 = 2, h3 = 3;
+	const unsigned char *end = p + fp->block;
+	for (; p < end; p += LANES * WORD) {
+		h0 = mix(h0, p);
+		h1 = mix(h1, p + WORD);
+		h2 = mix(h2, p + 2 * WORD);
+		h3 = mix(h3, p + 3 * WORD);
+	}
+	return ((h0 * MULTIPLIER ^ h1) * MULTIPLIER ^ h2) * MULTIPLIER ^ h3;
+}
+
+
+static size_t slot_index(uint64_t hash, size_t mask) {
+	return (hash ^ (hash >> 29)) & mask;
+}
+
+
+/*
+ * Builds the table for pattern, if it is a literal long enough to be worth
+ * it: min_len bytes or more.  Returns NULL otherwise.
+ */
+struct fingerprint *fingerprint_new(const struct byte_pattern *pattern, size_t min_len) {
+	if (pattern->len < min_len || pattern->len < 2 * LANES * WORD || pattern->gap_count > 0)
+		return NULL;
+	size_t i = 0;
+	for (; i < pattern->len; ++i) {
+		if (pattern->mask[i] != 0xff)
+			return NULL;
+	}
+
+	struct fingerprint *fp = xmalloc(sizeof(*fp));
+	fp->block = MIN(MAX_BLOCK, (pattern->len + 1) / 2) / (LANES * WORD) * (LANES * WORD);
+	size_t slot_count = 16;
+	while (slot_count < 2 * fp->block)
+		slot_count *= 2;
+	fp->slot_mask = slot_count - 1;
+	fp->slots = xcalloc(slot_count, sizeof(*fp->slots));
+
+	size_t j = 0;
+	for (; j < fp->block; ++j) {
+		const unsigned char *window = pattern->value + j;
+		uint64_t h = fingerprint_hash(fp, window);
+		size_t s = slot_index(h, fp->slot_mask);
+		for (; fp->slots[s].offset != 0; s = (s + 1) & fp->slot_mask) {
+			if (fp->slots[s].hash == h && !memcmp(pattern->value + fp->slots[s].offset - 1, window, fp->block)) {
+				fingerprint_free(fp);
+				return NULL;
+			}
+		}
+		fp->slots[s].hash = h;
+		fp->slots[s].offset = j + 1;
+	}
+	return fp;
+}
+
+
+size_t fingerprint_block(const struct fingerprint *fp) {
+	return fp->block;
+}
+
+
+static int compare_descending(const void *a, const void *b) {
+	size_t x = *(const size_t *) a, y = *(const size_t *) b;
+	return (x < y) - (x > y);
+}
+
+
+/*
+ * Stores in offsets the j of every window whose hash is hash, largest
+ * first, and returns how many there are: at most one, unless hashes
+ * collide.  offsets must have room for fingerprint_block() of them.
+ */
+size_t fingerprint_lookup(const struct fingerprint *fp, uint64_t hash, size_t *offsets) {
+	size_t count = 0;
+	size_t s = slot_index(hash, fp->slot_mask);
+	for (; fp->slots[s].offset != 0; s = (s + 1) & fp->slot_mask) {
+		if (fp->slots[s].hash == hash)
+			offsets[count++] = fp->slots[s].offset - 1;
+	}
+
+	/* Windows with equal hashes were inserted in order, but probing may wrap around the table */
+	qsort(offsets, count, sizeof(*offsets), compare_descending);
+	return count;
+}
+
+
+void fingerprint_free(struct fingerprint *fp) {
+	if (fp != NULL) {
+		free(fp->slots);
+		free(fp);
+	}
+}
@@ -0,0 +1,110 @@
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#  include <sys/inotify.h>
+#endif
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * --follow: keep searching a regular file as it grows.
+ *
+ * At the end of the file, follow_wait() sleeps until the file changes.
+ * inotify wakes it as soon as the file is written; without inotify, or on
+ * filesystems that never report changes (NFS), it checks the size every
+ * FOLLOW_POLL_MS.  The search's stream is never reset while following, so
+ * a match that straddles an append is found exactly once.
+ *
+ * SIGINT and SIGTERM end the search normally, so counts and --stats are
+ * still printed.  A second signal kills bgrep as usual.
+ */
+
+enum { FOLLOW_POLL_MS = 250, INOTIFY_RECHECK_MS = 1000 };
+
+struct follow {
+	int inotify_fd;   /* -1 to poll */
+};
+
+static volatile sig_atomic_t stop_requested;
+
+
+static void request_stop(int signum) {
+	(void) signum;
+	stop_requested = 1;
+}
+
+
+/* Makes SIGINT and SIGTERM end a --follow search instead of killing it */
+void follow_catch_signals(void) {
+	struct sigaction action = { 0 };
+	action.sa_handler = request_stop;
+	action.sa_flags = SA_RESETHAND;   /* no SA_RESTART: waits must see the signal */
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+}
+
+
+/* Prepares to follow fd.  Returns NULL if fd is not a regular file: other inputs end for good at EOF. */
+struct follow *follow_open(int fd) {
+	struct stat s;
+	if (fstat(fd, &s) || !S_ISREG(s.st_mode))
+		return NULL;
+
+	struct follow *f = xmalloc(sizeof(*f));
+	f->inotify_fd = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	f->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (f->inotify_fd >= 0 && inotify_add_watch(f->inotify_fd, path, IN_MODIFY | IN_ATTRIB) < 0) {
+		close(f->inotify_fd);
+		f->inotify_fd = -1;
+	}
+#endif
+	return f;
+}
+
+
+void follow_close(struct follow *f) {
+	if (f == NULL)
+		return;
+	if (f->inotify_fd >= 0)
+		close(f->inotify_fd);
+	free(f);
+}
+
+
+/* Waits until the file open as fd is no longer position bytes long, or the search should stop */
+enum follow_event follow_wait(struct follow *f, int fd, off_t position) {
+	for (;;) {
+		struct stat s;
+		if (stop_requested || fstat(fd, &s))
+			return FOLLOW_STOP;
+		if (s.st_size > position)
+			return FOLLOW_GROWN;
+		if (s.st_size < position)
+			return FOLLOW_TRUNCATED;
+
+		struct pollfd p = { f->inotify_fd, POLLIN, 0 };
+		if (f->inotify_fd < 0) {
+			poll(NULL, 0, FOLLOW_POLL_MS);
+		} else if (poll(&p, 1, INOTIFY_RECHECK_MS) > 0) {
+			/* Only the file's size matters, not what the events say */
+			char events[4096];
+			while (read(f->inotify_fd, events, sizeof(events)) > 0)
+				continue;
+		}
+	}
+}
@@ -0,0 +1,97 @@
+#include "config.h"
+
+#include <string.h>
+
+#include "bgrep.h"
+
+/*
+ * A fast non-cryptographic 64-bit hash, for cache keys and checksums, and
+ * a 128-bit one of a whole stream, for telling identical files apart.
+ * Results depend on the host's byte order, so never share them between
+ * machines.
+ */
+
+static inline uint64_t mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+
+/* Hashes len bytes of data.  Pass a previous result as seed to hash several pieces as one. */
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+	const unsigned char *p = data;
+	uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+	uint64_t word;
+
+	for (; len >= sizeof(word); p += sizeof(word), len -= sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		h = (h ^ mix(word)) * 0x9e3779b97f4a7c15ULL;
+	}
+	if (len > 0) {
+		word = 0;
+		memcpy(&word, p, len);
+		h = (h ^ mix(word ^ len)) * 0x9e3779b97f4a7c15ULL;
+	}
+	return mix(h);
+}
+
+
+/* Adds the 8 bytes at p to c, in two chains that mix differently */
+static inline void add_word(struct content_hash *c, const unsigned char *p) {
+	uint64_t word;
+	memcpy(&word, p, sizeof(word));
+	c->h[0] = (c->h[0] ^ mix(word)) * 0x9e3779b97f4a7c15ULL;
+	c->h[1] = ((c->h[1] + word) << 31 | (c->h[1] + word) >> 33) * 0xc2b2ae3d27d4eb4fULL;
+}
+
+
+void content_hash_init(struct content_hash *c) {
+	memset(c, 0, sizeof(*c));
+	c->h[1] = 0x62677265702d6433ULL;
+}
+
+
+/* Hashes len more bytes.  The result is the same however the data is split. */
+void content_hash_update(struct content_hash *c, const void *data, size_t len) {
+	const unsigned char *p = data;
+	size_t have = c->len % sizeof(c->pending);
+	c->len += len;
+
+	if (have > 0) {
+		size_t take = MIN(sizeof(c->pending) - have, len);
+		memcpy(c->pending + have, p, take);
+		p += take;
+		len -= take;
+		if (have + take < sizeof(c->pending))
+			return;
+		add_word(c, c->pending);
+	}
+	for (; len >= sizeof(c->pending); p += sizeof(c->pending), len -= sizeof(c->pending))
+		add_word(c, p);
+	memcpy(c->pending, p, len);
+}
+
+
+/* Stores the 128-bit hash of everything added to c in digest */
+void content_hash_final(const struct content_hash *c, uint64_t digest[2]) {
+	uint64_t word = 0;
+	memcpy(&word, c->pending, c->len % sizeof(c->pending));
+	digest[0] = mix(c->h[0] ^ mix(word ^ c->len));
+	digest[1] = mix(c->h[1] ^ word ^ (c->len * 0x9e3779b97f4a7c15ULL));
+}
+
+
+/* Identifies config's pattern and the options that change which matches it finds */
+uint64_t search_key(const struct bgrep_config *config) {
+	static const uint64_t OPTIONS_SEED = 0x62677265702d6331ULL;
+	const struct byte_pattern *pattern = config->pattern;
+	uint64_t options[3] = { config->skip_to, config->first_only != 0, config->decompress != 0 };
+	uint64_t key = hash_bytes(pattern->value, pattern->len, OPTIONS_SEED);
+	key = hash_bytes(pattern->mask, pattern->len, key);
+	key = hash_bytes(pattern->gaps, pattern->gap_count * sizeof(*pattern->gaps), key);
+	return hash_bytes(options, sizeof(options), key);
+}
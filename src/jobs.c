@@ -0,0 +1,241 @@
+#include "config.h"
+
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * Worker pool for --jobs.
+ *
+ * Every file becomes a job with a sequence number.  A worker searches it with a
+ * private output_context whose stream is an in-memory buffer, so concurrent
+ * searches never share print_output state.  Finished buffers are merged onto
+ * stdout in sequence order (command-line/traversal order), or as soon as they
+ * complete with --unordered.
+ *
+ * One thread at a time writes, and it does so without the lock, so a slow
+ * reader of stdout holds up only the writer while the other workers keep
+ * searching.  Finished output parked behind a slow earlier file is bounded
+ * by MAX_PARKED_BYTES: beyond it, workers start no new job except the one
+ * the output is waiting for.  Each file's own output is still buffered whole.
+ */
+
+enum { JOBS_PER_WORKER = 4 };
+enum { MAX_PARKED_BYTES = 64 * 1024 * 1024 };
+
+struct job {
+	struct job *next;
+	unsigned long seq;
+	char *path;
+	char *output;
+	size_t output_len;
+	int result;
+	struct checkpoint_entry *checkpoint;   /* with --checkpoint, marked done once the output is written */
+	uintmax_t match_count;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+
+static const struct bgrep_config *job_config;
+static pthread_t *workers;
+static int worker_count;
+
+static struct job *pending_head, *pending_tail;
+static struct job *done_list;
+static size_t parked_bytes;    /* the output of the jobs in done_list, and of those being written */
+static int emitting;           /* a worker is writing finished jobs */
+static unsigned long next_seq;
+static unsigned long next_emit;
+static unsigned long in_flight;
+static int closing;
+static int combined_result = RESULT_NO_MATCH;
+
+static void *worker_main(void *arg);
+static void emit_ready(void);
+
+
+void jobs_start(const struct bgrep_config *config) {
+	job_config = config;
+	worker_count = config->jobs;
+	workers = xnmalloc(worker_count, sizeof(*workers));
+
+	int i = 0;
+	for (; i < worker_count; ++i) {
+		int err = pthread_create(&workers[i], NULL, worker_main, NULL);
+		if (err) {
+			error(RESULT_ERROR, err, "cannot start worker thread");
+		}
+	}
+}
+
+
+/* Queues path for searching.  Blocks while too many results are waiting to be merged. */
+void jobs_submit(const char *path) {
+	struct job *job = xzalloc(sizeof(*job));
+	job->path = xstrdup(path);
+
+	pthread_mutex_lock(&lock);
+	while (in_flight >= (unsigned long) worker_count * JOBS_PER_WORKER) {
+		pthread_cond_wait(&slot_free, &lock);
+	}
+	job->seq = next_seq++;
+	++in_flight;
+	if (pending_tail) {
+		pending_tail->next = job;
+	} else {
+		pending_head = job;
+	}
+	pending_tail = job;
+	pthread_cond_signal(&work_ready);
+	pthread_mutex_unlock(&lock);
+}
+
+
+/* Waits for all queued jobs, emits any remaining output and returns the combined result. */
+int jobs_finish(void) {
+	pthread_mutex_lock(&lock);
+	closing = 1;
+	pthread_cond_broadcast(&work_ready);
+	pthread_mutex_unlock(&lock);
+
+	int i = 0;
+	for (; i < worker_count; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+	workers = NULL;
+
+	return combined_result;
+}
+
+
+/* Can a worker start the next pending job?  Called with the lock held. */
+static int may_start(void) {
+	return pending_head != NULL && (parked_bytes <= MAX_PARKED_BYTES || pending_head->seq == next_emit);
+}
+
+
+static void *worker_main(void *arg) {
+	(void) arg;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (!may_start() && !(closing && !pending_head)) {
+			pthread_cond_wait(&work_ready, &lock);
+		}
+		struct job *job = pending_head;
+		if (!job) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		pending_head = job->next;
+		if (!pending_head) {
+			pending_tail = NULL;
+		}
+		pthread_mutex_unlock(&lock);
+
+		struct output_context out;
+		out.config = job_config;
+		out.err = stderr;
+		out.out = open_memstream(&job->output, &job->output_len);
+		if (out.out == NULL) {
+			error(RESULT_ERROR, errno, "cannot allocate output buffer");
+		}
+		job->result = search_path(&out, job->path);
+		fclose(out.out);
+		if (job->result != RESULT_ERROR) {
+			job->checkpoint = out.checkpoint;
+			job->match_count = out.match_count;
+		}
+
+		pthread_mutex_lock(&lock);
+		if (combined_result == RESULT_NO_MATCH || job->result == RESULT_ERROR) {
+			combined_result = job->result;
+		}
+		job->next = done_list;
+		done_list = job;
+		parked_bytes += job->output_len;
+		/* Whoever is writing already will pick it up */
+		if (!emitting) {
+			emit_ready();
+		}
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+
+/* Takes the jobs that can be written now off done_list, in the order to write them.  Called with the lock held. */
+static struct job *take_ready(void) {
+	struct job *ready = NULL, **tail = &ready;
+	if (job_config->unordered) {
+		/* In the order they finished */
+		while (done_list) {
+			struct job *job = done_list;
+			done_list = job->next;
+			job->next = ready;
+			ready = job;
+		}
+		return ready;
+	}
+
+	struct job **p = &done_list;
+	while (*p) {
+		if ((*p)->seq == next_emit) {
+			struct job *job = *p;
+			*p = job->next;
+			job->next = NULL;
+			*tail = job;
+			tail = &job->next;
+			++next_emit;
+			p = &done_list;
+		} else {
+			p = &(*p)->next;
+		}
+	}
+	return ready;
+}
+
+
+/*
+ * Writes finished jobs to stdout and frees them, until none is ready.
+ * Called with the lock held; it is dropped while writing.
+ */
+static void emit_ready(void) {
+	struct job *ready;
+	emitting = 1;
+	while ((ready = take_ready()) != NULL) {
+		pthread_mutex_unlock(&lock);
+		struct job *job = ready;
+		for (; job != NULL; job = job->next) {
+			fwrite(job->output, 1, job->output_len, stdout);
+			if (job->checkpoint != NULL) {
+				fflush(stdout);
+				checkpoint_done(job_config->checkpoint, job->checkpoint, job->match_count);
+			}
+		}
+		pthread_mutex_lock(&lock);
+
+		while (ready != NULL) {
+			job = ready;
+			ready = job->next;
+			parked_bytes -= job->output_len;
+			--in_flight;
+			free(job->output);
+			free(job->path);
+			free(job);
+		}
+		pthread_cond_broadcast(&slot_free);
+		pthread_cond_broadcast(&work_ready);
+	}
+	emitting = 0;
+}
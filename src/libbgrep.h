@@ -0,0 +1,103 @@
+#ifndef LIBBGREP_H
+#define LIBBGREP_H
+
+/*
+ * libbgrep: reentrant byte pattern search.
+ *
+ * Nothing in here touches global state.  Patterns are parsed once with
+ * byte_pattern_from_string() and may then be shared read-only between any
+ * number of matchers and streams, in any number of threads.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A variable gap, ??{min,max}.  Its first min bytes are wildcards in value
+ * and mask like any other; up to max - min more may come before byte at.
+ */
+struct byte_gap {
+	size_t at;
+	size_t min;
+	size_t max;
+};
+
+/* value and mask hold the pattern with every gap at its shortest: len is the shortest match */
+struct byte_pattern {
+	unsigned char *value;
+	unsigned char *mask;
+	size_t capacity;
+	size_t len;
+	struct byte_gap *gaps;   /* in order of at */
+	size_t gap_count;
+};
+
+/* byte_pattern.c */
+void byte_pattern_init(struct byte_pattern *ptr);
+void byte_pattern_destroy(struct byte_pattern *ptr);
+void byte_pattern_free(struct byte_pattern *ptr);
+void byte_pattern_reserve(struct byte_pattern *ptr, size_t num_bytes);
+void byte_pattern_append(struct byte_pattern *ptr, unsigned char *value, unsigned char *mask, size_t len);
+void byte_pattern_append_char(struct byte_pattern *ptr, unsigned char value, unsigned char mask);
+void byte_pattern_repeat(struct byte_pattern *ptr, size_t num_bytes, size_t repeat);
+void byte_pattern_add_gap(struct byte_pattern *ptr, size_t min, size_t max);
+size_t byte_pattern_max_len(const struct byte_pattern *ptr);
+const unsigned char * byte_pattern_match(const struct byte_pattern *ptr, const unsigned char *data, size_t len);
+struct byte_pattern *byte_pattern_from_string(const char *pattern_str);
+struct byte_pattern *byte_pattern_parse(const char *pattern_str, char *why, size_t why_size);
+struct byte_pattern *byte_pattern_from_file(const char *path, const char *mask_path);
+
+/* matcher.c */
+
+/* Work done by a matcher, for statistics */
+struct bgrep_counters {
+	uintmax_t candidates;      /* positions the prefilter could not rule out */
+	uintmax_t verifications;   /* full comparisons against the pattern */
+};
+
+/* A pattern prepared for searching: byte_pattern_match() plus a memchr() prefilter */
+struct bgrep_matcher {
+	const struct byte_pattern *pattern;
+	size_t anchor;    /* index of the fixed byte the prefilter looks for */
+	int has_anchor;   /* zero if the pattern has no fully-specified byte */
+	size_t reach;     /* how much further into a match variable gaps can push the anchor */
+	size_t max_len;   /* of a match: pattern->len, plus what variable gaps can add */
+	struct bgrep_counters *counters;   /* if not NULL, work is added up here */
+};
+
+void bgrep_matcher_init(struct bgrep_matcher *matcher, const struct byte_pattern *pattern);
+const unsigned char *bgrep_matcher_find(const struct bgrep_matcher *matcher, const unsigned char *data, size_t len);
+const unsigned char *bgrep_matcher_find_in(const struct bgrep_matcher *matcher, const unsigned char *data,
+		size_t starts, size_t len, size_t *match_len);
+
+/* stream.c */
+
+/* One match, as seen by a bgrep_match_fn.  Pointers are only valid during the callback. */
+struct bgrep_match {
+	uintmax_t offset;                /* absolute offset of the first matching byte */
+	const unsigned char *data;       /* the matching bytes */
+	size_t len;
+	const unsigned char *before;     /* up to 'history' bytes immediately preceding the match */
+	size_t before_len;
+};
+
+/* Called for every match, in offset order.  Return nonzero to stop the search. */
+typedef int (*bgrep_match_fn)(const struct bgrep_match *match, void *arg);
+
+struct bgrep_stream;
+
+struct bgrep_stream *bgrep_stream_new(const struct byte_pattern *pattern, size_t history,
+		bgrep_match_fn on_match, void *arg);
+void bgrep_stream_reset(struct bgrep_stream *stream, uintmax_t offset);
+int bgrep_stream_feed(struct bgrep_stream *stream, const void *data, size_t len);
+int bgrep_stream_finish(struct bgrep_stream *stream);
+uintmax_t bgrep_stream_offset(const struct bgrep_stream *stream);
+const struct bgrep_counters *bgrep_stream_counters(const struct bgrep_stream *stream);
+void bgrep_stream_count_only(struct bgrep_stream *stream, int stop_at_first);
+uintmax_t bgrep_stream_matches(const struct bgrep_stream *stream);
+void bgrep_stream_free(struct bgrep_stream *stream);
+
+int bgrep_search_buffer(const struct byte_pattern *pattern, const void *data, size_t len,
+		bgrep_match_fn on_match, void *arg);
+
+#endif /* LIBBGREP_H */
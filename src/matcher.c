@@ -0,0 +1,275 @@
+#include "config.h"
+
+#include <string.h>
+
+#include "bgrep.h"
+
+/*
+ * Rough commonness of each byte value in binary data: zero and 0xff fill,
+ * then printable ASCII, then everything else.  Lower is rarer.
+ */
+int byte_commonness(unsigned char c) {
+	if (c == 0x00 || c == 0xff)
+		return 3;
+	if (c == ' ' || c == '\n' || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+		return 2;
+	if (c >= 0x20 && c < 0x7f)
+		return 1;
+	return 0;
+}
+
+
+/* Prepares pattern for bgrep_matcher_find().  The pattern must outlive the matcher. */
+void bgrep_matcher_init(struct bgrep_matcher *matcher, const struct byte_pattern *pattern) {
+	matcher->pattern = pattern;
+	matcher->anchor = 0;
+	matcher->has_anchor = 0;
+	matcher->reach = 0;
+	matcher->max_len = byte_pattern_max_len(pattern);
+	matcher->counters = NULL;
+
+	size_t i = 0;
+	for (; i < pattern->len; ++i) {
+		if (pattern->mask[i] != 0xff)
+			continue;
+		if (!matcher->has_anchor ||
+				byte_commonness(pattern->value[i]) < byte_commonness(pattern->value[matcher->anchor])) {
+			matcher->anchor = i;
+			matcher->has_anchor = 1;
+		}
+	}
+
+	/* Of equally rare bytes the first is kept, which the fewest variable gaps come before */
+	for (i = 0; i < pattern->gap_count && pattern->gaps[i].at <= matcher->anchor; ++i)
+		matcher->reach += pattern->gaps[i].max - pattern->gaps[i].min;
+}
+
+
+/*
+ * What is known about the places after a variable gap where the rest of
+ * the pattern matches: in [from, to) it matches first at found (NULL if
+ * nowhere).  Each start tried asks about almost the same places as the
+ * last, so this keeps the work per gap linear, whatever its length.  Places
+ * are picked out by the first fixed byte after the gap, probe bytes on.
+ */
+struct gap_probe {
+	size_t probe;
+	int fixed;    /* zero if every byte up to the next gap is masked: each place is tried */
+	const unsigned char *from;
+	const unsigned char *to;
+	const unsigned char *found;
+	const unsigned char *found_end;   /* where the match through found ends */
+};
+
+static const unsigned char *match_rest(const struct byte_pattern *pattern, struct gap_probe *probes, size_t gap,
+		size_t i, const unsigned char *p, const unsigned char *end);
+
+
+/* Returns the first place in [p, last] where the pattern after gap matches, with the end of the match in *match_end */
+static const unsigned char *next_match(const struct byte_pattern *pattern, struct gap_probe *probes, size_t gap,
+		const unsigned char *p, const unsigned char *last, const unsigned char *end, const unsigned char **match_end) {
+	struct gap_probe *g = &probes[gap];
+	const size_t at = pattern->gaps[gap].at;
+	const unsigned char *q = p;
+
+	if (g->from != NULL && p >= g->from && p <= g->to) {
+		if (g->found != NULL && g->found >= p) {
+			*match_end = g->found_end;
+			return (g->found <= last) ? g->found : NULL;
+		}
+		if (g->found == NULL) {
+			/* Nowhere before g->to */
+			if (g->to > last)
+				return NULL;
+			q = g->to;
+		} else {
+			g->from = p;
+		}
+	} else {
+		g->from = p;
+	}
+
+	for (; q <= last; ++q) {
+		if (g->fixed) {
+			const unsigned char *from = q + g->probe;
+			const unsigned char *to = MIN(last + g->probe + 1, end);
+			const unsigned char *hit = (from < to) ? memchr(from, pattern->value[at + g->probe], to - from) : NULL;
+			if (hit == NULL)
+				break;
+			q = hit - g->probe;
+		}
+		const unsigned char *found_end = match_rest(pattern, probes, gap + 1, at, q, end);
+		if (found_end != NULL) {
+			g->to = q + 1;
+			g->found = q;
+			g->found_end = *match_end = found_end;
+			return q;
+		}
+	}
+	g->to = last + 1;
+	g->found = NULL;
+	return NULL;
+}
+
+
+/*
+ * Matches the rest of pattern, from byte i, at p: gap is the first variable
+ * gap still ahead, and i the start of the fixed bytes before it.  Each gap
+ * is as short as the rest of the match allows, taking them from the left.
+ * Returns the end of the match, or NULL.
+ */
+static const unsigned char *match_rest(const struct byte_pattern *pattern, struct gap_probe *probes, size_t gap,
+		size_t i, const unsigned char *p, const unsigned char *end) {
+	const size_t fixed_end = (gap < pattern->gap_count) ? pattern->gaps[gap].at : pattern->len;
+	if ((size_t) (end - p) < fixed_end - i)
+		return NULL;
+	for (; i < fixed_end; ++i, ++p) {
+		if ((*p & pattern->mask[i]) != pattern->value[i])
+			return NULL;
+	}
+	if (gap == pattern->gap_count)
+		return p;
+	if (p == end)
+		return NULL;   /* a gap is always followed by at least a byte */
+
+	const size_t extra = pattern->gaps[gap].max - pattern->gaps[gap].min;
+	const unsigned char *match_end;
+	if (next_match(pattern, probes, gap, p, p + MIN(extra, (size_t) (end - p) - 1), end, &match_end) == NULL)
+		return NULL;
+	return match_end;
+}
+
+
+/*
+ * bgrep_matcher_find_in() for patterns with variable gaps.  A match that
+ * starts at p has the anchor between p + anchor and reach bytes further,
+ * so each anchor found is only tried against the starts it could belong
+ * to, and nothing before the first of them is looked at again.
+ */
+static const unsigned char *find_gaps(const struct bgrep_matcher *matcher, const unsigned char *data,
+		size_t starts, size_t len, size_t *match_len) {
+	const struct byte_pattern *pattern = matcher->pattern;
+	const unsigned char *end = data + len;
+	const unsigned char *hit = NULL;
+	const unsigned char *found = NULL;
+	uintmax_t tried = 0;
+	size_t p = 0;
+
+	struct gap_probe probes[pattern->gap_count];
+	size_t gap = 0;
+	for (; gap < pattern->gap_count; ++gap) {
+		const size_t at = pattern->gaps[gap].at;
+		const size_t fixed_end = (gap + 1 < pattern->gap_count) ? pattern->gaps[gap + 1].at : pattern->len;
+		struct gap_probe *g = &probes[gap];
+		for (g->probe = 0; at + g->probe < fixed_end && pattern->mask[at + g->probe] != 0xff; ++g->probe)
+			continue;
+		g->fixed = (at + g->probe < fixed_end);
+		g->from = g->to = g->found = g->found_end = NULL;
+	}
+
+	while (p < starts) {
+		if (matcher->has_anchor) {
+			const size_t from = p + matcher->anchor;
+			if (hit == NULL || hit < data + from) {
+				size_t to = MIN(len, starts + matcher->anchor + matcher->reach);
+				if (from >= to)
+					break;
+				hit = memchr(data + from, pattern->value[matcher->anchor], to - from);
+				if (hit == NULL)
+					break;
+			}
+			/* The earliest start this anchor can belong to */
+			size_t shortest = hit - data - matcher->anchor;
+			p = MAX(p, shortest - MIN(shortest, matcher->reach));
+			if (p >= starts)
+				break;
+		}
+
+		++tried;
+		const unsigned char *match_end = match_rest(pattern, probes, 0, 0, data + p, end);
+		if (match_end != NULL) {
+			found = data + p;
+			*match_len = match_end - found;
+			break;
+		}
+		++p;
+	}
+
+	if (matcher->counters != NULL) {
+		matcher->counters->candidates += tried;
+		matcher->counters->verifications += tried;
+	}
+	return found;
+}
+
+
+/* Returns a pointer to the first complete match in data, or NULL if none is found */
+const unsigned char *bgrep_matcher_find(const struct bgrep_matcher *matcher, const unsigned char *data, size_t len) {
+	const struct byte_pattern *pattern = matcher->pattern;
+
+	if (pattern->gap_count > 0) {
+		size_t match_len;
+		return find_gaps(matcher, data, (len < pattern->len) ? 0 : len - pattern->len + 1, len, &match_len);
+	} else if (!matcher->has_anchor) {
+		const unsigned char *match = byte_pattern_match(pattern, data, len);
+		if (matcher->counters != NULL && len >= pattern->len) {
+			/* No prefilter: every position up to the match is compared */
+			uintmax_t tried = match ? (uintmax_t) (match - data) + 1 : len - pattern->len + 1;
+			matcher->counters->candidates += tried;
+			matcher->counters->verifications += tried;
+		}
+		return match;
+	} else if (len < pattern->len) {
+		return NULL;
+	}
+
+	const unsigned char anchor_value = pattern->value[matcher->anchor];
+	const unsigned char *p = data + matcher->anchor;
+	const unsigned char *lastp = data + len - pattern->len + matcher->anchor;
+	const unsigned char *found = NULL;
+	uintmax_t hits = 0;
+
+	while (p <= lastp) {
+		const unsigned char *hit = memchr(p, anchor_value, lastp - p + 1);
+		if (hit == NULL)
+			break;
+
+		++hits;
+		const unsigned char *candidate = hit - matcher->anchor;
+		size_t i = 0;
+		for (; i < pattern->len; ++i) {
+			if ((candidate[i] & pattern->mask[i]) != pattern->value[i])
+				break;
+		}
+		if (i == pattern->len) {
+			found = candidate;
+			break;
+		}
+		p = hit + 1;
+	}
+
+	if (matcher->counters != NULL) {
+		/* Every anchor hit is verified in full */
+		matcher->counters->candidates += hits;
+		matcher->counters->verifications += hits;
+	}
+	return found;
+}
+
+
+/*
+ * Returns a pointer to the first match that starts in the first starts
+ * bytes of data, looking no further than len bytes, and stores its length
+ * in *match_len: only variable gaps make it differ from the pattern's.
+ */
+const unsigned char *bgrep_matcher_find_in(const struct bgrep_matcher *matcher, const unsigned char *data,
+		size_t starts, size_t len, size_t *match_len) {
+	const struct byte_pattern *pattern = matcher->pattern;
+	if (pattern->gap_count > 0)
+		return find_gaps(matcher, data, starts, len, match_len);
+
+	*match_len = pattern->len;
+	if (starts == 0)
+		return NULL;
+	return bgrep_matcher_find(matcher, data, MIN(len, starts - 1 + pattern->len));
+}
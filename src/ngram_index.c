@@ -0,0 +1,528 @@
+#include "config.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * On-disk n-gram index, built by bgrep-index and read by bgrep --index.
+ *
+ * Every 4-byte gram of a file is hashed into one of 2^bucket_bits buckets and
+ * recorded against the block its first byte falls in.  Each file stores a
+ * bitmap of the buckets it uses anywhere, then its blocks in stripes of
+ * STRIPE_BLOCKS.  Within a stripe the bits are sliced by bucket: one row of
+ * STRIPE_BLOCKS bits per bucket, i.e. a posting list of the blocks holding a
+ * gram from that bucket.  A query reads only the rows for its own grams.
+ * The last stripe of a file is only as wide as the blocks it has left.
+ *
+ * The index is in host byte order.  Files whose size or mtime changed since
+ * indexing are searched in full.
+ *
+ *   header:  magic[8] byte_order:u32 gram_len:u32 bucket_bits:u32 stripe_blocks:u32
+ *            block_size:u64 file_count:u64
+ *   file:    path_len:u32 path[path_len] size:u64 mtime_sec:i64 mtime_nsec:i64 block_count:u64
+ *            file_bitmap[buckets/8]
+ *            stripe[ceil(block_count/stripe_blocks)] = row[buckets][stripe_row_bytes]
+ */
+
+enum { GRAM_LEN = 4, STRIPE_BLOCKS = 4096, STRIPE_BYTES = STRIPE_BLOCKS / 8, MAX_QUERY_GRAMS = 64 };
+enum { BUILD_BUFSIZE = 1024 * 1024 };
+static const char INDEX_MAGIC[8] = { 'B', 'G', 'R', 'P', 'N', 'G', 'R', '1' };
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct index_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t gram_len;
+	uint32_t bucket_bits;
+	uint32_t stripe_blocks;
+	uint64_t block_size;
+	uint64_t file_count;
+};
+
+struct file_header {
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t block_count;
+};
+
+struct ngram_index_entry {
+	char *path;
+	struct file_header file;
+	off_t bitmap_offset;
+};
+
+struct ngram_index {
+	int fd;
+	struct index_header header;
+	size_t bitmap_bytes;
+	size_t count;
+	struct ngram_index_entry *entries;
+};
+
+struct ngram_index_writer {
+	char *path;
+	char *tmp_path;
+	int fd;
+	struct index_header header;
+	size_t bitmap_bytes;
+	unsigned char *matrix;
+	unsigned char *file_bitmap;
+};
+
+struct query_gram {
+	size_t offset;           /* position of the gram in the pattern */
+	uint32_t bucket;
+	uint64_t cached_stripe[2];
+	unsigned char *cached_row[2];
+};
+
+
+static inline uint32_t gram_bucket(uint32_t gram, unsigned bucket_bits) {
+	return (uint32_t) (gram * 2654435761u) >> (32 - bucket_bits);
+}
+
+
+/* Width of the rows in one stripe of a file */
+static inline size_t stripe_row_bytes(uint64_t block_count, uint64_t stripe) {
+	return (MIN(block_count - stripe * STRIPE_BLOCKS, STRIPE_BLOCKS) + 7) / 8;
+}
+
+
+/* Size of all the stripes of a file */
+static inline off_t stripes_size(uint64_t block_count, size_t row_count) {
+	uint64_t full = block_count / STRIPE_BLOCKS;
+	off_t size = (off_t) full * row_count * STRIPE_BYTES;
+	if (block_count % STRIPE_BLOCKS)
+		size += (off_t) row_count * stripe_row_bytes(block_count, full);
+	return size;
+}
+
+
+static int write_all(int fd, const void *data, size_t len) {
+	const char *p = data;
+	while (len > 0) {
+		ssize_t w = write(fd, p, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+
+static int pread_all(int fd, void *data, size_t len, off_t offset) {
+	char *p = data;
+	while (len > 0) {
+		ssize_t r = pread(fd, p, len, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1)
+			return -1;
+		p += r;
+		len -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+
+/* Writes out the stripe in the writer's matrix, narrowed to the blocks it covers, and clears it */
+static int write_stripe(struct ngram_index_writer *writer, uint64_t block_count, uint64_t stripe) {
+	const size_t row_count = writer->bitmap_bytes * 8;
+	size_t row_bytes = stripe_row_bytes(block_count, stripe);
+	size_t row = 1;
+
+	for (; row_bytes < STRIPE_BYTES && row < row_count; ++row) {
+		memmove(writer->matrix + row * row_bytes, writer->matrix + row * STRIPE_BYTES, row_bytes);
+	}
+	int failed = write_all(writer->fd, writer->matrix, row_count * row_bytes);
+	memset(writer->matrix, 0, row_count * STRIPE_BYTES);
+	return failed;
+}
+
+
+/* Starts a new index at path.  Nothing replaces path until ngram_index_commit(). */
+struct ngram_index_writer *ngram_index_create(const char *path, uint64_t block_size, unsigned bucket_bits) {
+	struct ngram_index_writer *writer = xzalloc(sizeof(*writer));
+	writer->path = xstrdup(path);
+	writer->tmp_path = xmalloc(strlen(path) + 5);
+	strcpy(writer->tmp_path, path);
+	strcat(writer->tmp_path, ".tmp");
+
+	memcpy(writer->header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	writer->header.byte_order = BYTE_ORDER_MARK;
+	writer->header.gram_len = GRAM_LEN;
+	writer->header.bucket_bits = bucket_bits;
+	writer->header.stripe_blocks = STRIPE_BLOCKS;
+	writer->header.block_size = block_size;
+	writer->bitmap_bytes = ((size_t) 1 << bucket_bits) / 8;
+
+	writer->fd = open(writer->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (writer->fd < 0 || write_all(writer->fd, &writer->header, sizeof(writer->header))) {
+		error(0, errno, "%s", writer->tmp_path);
+		ngram_index_abort(writer);
+		return NULL;
+	}
+	writer->matrix = xmalloc(writer->bitmap_bytes * 8 * STRIPE_BYTES);
+	writer->file_bitmap = xmalloc(writer->bitmap_bytes);
+	return writer;
+}
+
+
+/* Indexes one regular file.  Returns RESULT_ERROR if the file cannot be read or the index cannot be written. */
+int ngram_index_add_file(struct ngram_index_writer *writer, const char *path) {
+	const uint64_t block_size = writer->header.block_size;
+	const unsigned bucket_bits = writer->header.bucket_bits;
+	const size_t row_count = writer->bitmap_bytes * 8;
+	struct stat s;
+	int result = RESULT_ERROR;
+
+	char *canonical = realpath(path, NULL);
+	int fd = open(path, O_RDONLY | O_BINARY);
+	if (canonical == NULL || fd < 0 || fstat(fd, &s)) {
+		error(0, errno, "%s", path);
+		goto CLEANUP;
+	}
+
+	struct file_header file;
+	uint32_t path_len = strlen(canonical);
+	file.size = s.st_size;
+	file.mtime_sec = s.st_mtim.tv_sec;
+	file.mtime_nsec = s.st_mtim.tv_nsec;
+	file.block_count = (file.size + block_size - 1) / block_size;
+	const uint64_t stripe_count = (file.block_count + STRIPE_BLOCKS - 1) / STRIPE_BLOCKS;
+
+	off_t bitmap_offset = lseek(writer->fd, 0, SEEK_END);
+	if (bitmap_offset == (off_t) -1
+			|| write_all(writer->fd, &path_len, sizeof(path_len))
+			|| write_all(writer->fd, canonical, path_len)
+			|| write_all(writer->fd, &file, sizeof(file))) {
+		goto WRITE_ERROR;
+	}
+	bitmap_offset += sizeof(path_len) + path_len + sizeof(file);
+	memset(writer->file_bitmap, 0, writer->bitmap_bytes);
+	if (write_all(writer->fd, writer->file_bitmap, writer->bitmap_bytes))
+		goto WRITE_ERROR;
+
+	unsigned char *buf = xmalloc(BUILD_BUFSIZE);
+	uint64_t pos = 0;           /* file position of the next byte read */
+	uint64_t stripe = 0;
+	uint32_t gram = 0;
+	uint32_t last_bucket = UINT32_MAX;
+	uint64_t last_block = UINT64_MAX;
+
+	memset(writer->matrix, 0, row_count * STRIPE_BYTES);
+	while (pos < file.size) {
+		ssize_t r = read(fd, buf, MIN(BUILD_BUFSIZE, file.size - pos));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			error(0, errno, "%s", path);
+			free(buf);
+			goto CLEANUP;
+		} else if (r == 0) {
+			break;  /* file shrank; the stale mtime will disable the entry */
+		}
+
+		ssize_t i = 0;
+		for (; i < r; ++i, ++pos) {
+			gram = (gram << 8) | buf[i];
+			if (pos < GRAM_LEN - 1)
+				continue;
+
+			uint64_t block = (pos - (GRAM_LEN - 1)) / block_size;
+			uint32_t bucket = gram_bucket(gram, bucket_bits);
+			if (bucket == last_bucket && block == last_block)
+				continue;
+			last_bucket = bucket;
+			last_block = block;
+
+			while (block >= (stripe + 1) * STRIPE_BLOCKS) {
+				if (write_stripe(writer, file.block_count, stripe)) {
+					free(buf);
+					goto WRITE_ERROR;
+				}
+				++stripe;
+			}
+
+			size_t local = block - stripe * STRIPE_BLOCKS;
+			writer->matrix[bucket * STRIPE_BYTES + local / 8] |= 1 << (local % 8);
+			writer->file_bitmap[bucket / 8] |= 1 << (bucket % 8);
+		}
+	}
+	free(buf);
+
+	for (; stripe < stripe_count; ++stripe) {
+		if (write_stripe(writer, file.block_count, stripe))
+			goto WRITE_ERROR;
+	}
+	if (pwrite(writer->fd, writer->file_bitmap, writer->bitmap_bytes, bitmap_offset) != (ssize_t) writer->bitmap_bytes)
+		goto WRITE_ERROR;
+
+	++writer->header.file_count;
+	result = RESULT_NO_MATCH;
+	goto CLEANUP;
+
+WRITE_ERROR:
+	error(0, errno, "%s", writer->tmp_path);
+CLEANUP:
+	if (fd >= 0)
+		close(fd);
+	free(canonical);
+	return result;
+}
+
+
+/* Finishes the index and atomically moves it into place */
+int ngram_index_commit(struct ngram_index_writer *writer) {
+	int result = 0;
+	if (pwrite(writer->fd, &writer->header, sizeof(writer->header), 0) != sizeof(writer->header)
+			|| fsync(writer->fd) || close(writer->fd)) {
+		error(0, errno, "%s", writer->tmp_path);
+		result = -1;
+	} else if (rename(writer->tmp_path, writer->path)) {
+		error(0, errno, "cannot rename %s to %s", writer->tmp_path, writer->path);
+		result = -1;
+	}
+	writer->fd = -1;
+
+	ngram_index_abort(writer);
+	return result;
+}
+
+
+/* Discards an unfinished index */
+void ngram_index_abort(struct ngram_index_writer *writer) {
+	if (writer->fd >= 0) {
+		close(writer->fd);
+		unlink(writer->tmp_path);
+	}
+	free(writer->matrix);
+	free(writer->file_bitmap);
+	free(writer->tmp_path);
+	free(writer->path);
+	free(writer);
+}
+
+
+static int compare_entries(const void *a, const void *b) {
+	return strcmp(((const struct ngram_index_entry *) a)->path, ((const struct ngram_index_entry *) b)->path);
+}
+
+
+/* Loads the file table of an index.  Returns NULL (after printing why) if it cannot be used. */
+struct ngram_index *ngram_index_open(const char *path) {
+	struct ngram_index *index = xzalloc(sizeof(*index));
+	struct stat s;
+
+	index->fd = open(path, O_RDONLY | O_BINARY);
+	if (index->fd < 0 || fstat(index->fd, &s)) {
+		error(0, errno, "%s", path);
+		goto FAIL;
+	}
+	if (pread_all(index->fd, &index->header, sizeof(index->header), 0)
+			|| memcmp(index->header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC))
+			|| index->header.byte_order != BYTE_ORDER_MARK
+			|| index->header.gram_len != GRAM_LEN
+			|| index->header.stripe_blocks != STRIPE_BLOCKS
+			|| index->header.bucket_bits < 3 || index->header.bucket_bits > 30
+			|| index->header.block_size == 0) {
+		error(0, 0, "%s: not a bgrep index, or written by an incompatible version", path);
+		goto FAIL;
+	}
+	index->bitmap_bytes = ((size_t) 1 << index->header.bucket_bits) / 8;
+
+	off_t offset = sizeof(index->header);
+	index->entries = xnmalloc(index->header.file_count ? index->header.file_count : 1, sizeof(*index->entries));
+	for (; index->count < index->header.file_count; ++index->count) {
+		struct ngram_index_entry *entry = &index->entries[index->count];
+		uint32_t path_len;
+
+		if (pread_all(index->fd, &path_len, sizeof(path_len), offset) || path_len > PATH_MAX)
+			goto CORRUPT;
+		offset += sizeof(path_len);
+		entry->path = xmalloc(path_len + 1);
+		if (pread_all(index->fd, entry->path, path_len, offset)) {
+			free(entry->path);
+			goto CORRUPT;
+		}
+		entry->path[path_len] = 0;
+		offset += path_len;
+		if (pread_all(index->fd, &entry->file, sizeof(entry->file), offset)) {
+			free(entry->path);
+			goto CORRUPT;
+		}
+		offset += sizeof(entry->file);
+		entry->bitmap_offset = offset;
+
+		offset += index->bitmap_bytes + stripes_size(entry->file.block_count, index->bitmap_bytes * 8);
+		if (offset > s.st_size) {
+			free(entry->path);
+			goto CORRUPT;
+		}
+	}
+
+	qsort(index->entries, index->count, sizeof(*index->entries), compare_entries);
+	return index;
+
+CORRUPT:
+	error(0, 0, "%s: index is truncated or corrupt", path);
+FAIL:
+	ngram_index_close(index);
+	return NULL;
+}
+
+
+void ngram_index_close(struct ngram_index *index) {
+	if (index == NULL)
+		return;
+	while (index->count > 0)
+		free(index->entries[--index->count].path);
+	free(index->entries);
+	if (index->fd >= 0)
+		close(index->fd);
+	free(index);
+}
+
+
+/* Is the bit for block set in the posting row of gram?  Rows are read on demand and cached. */
+static int gram_in_block(const struct ngram_index *index, const struct ngram_index_entry *entry,
+		struct query_gram *gram, uint64_t block) {
+	uint64_t stripe = block / STRIPE_BLOCKS;
+	int slot = stripe & 1;
+
+	if (gram->cached_stripe[slot] != stripe) {
+		size_t row_bytes = stripe_row_bytes(entry->file.block_count, stripe);
+		off_t offset = entry->bitmap_offset + index->bitmap_bytes
+			+ (off_t) stripe * index->bitmap_bytes * 8 * STRIPE_BYTES + (off_t) gram->bucket * row_bytes;
+		if (pread_all(index->fd, gram->cached_row[slot], row_bytes, offset)) {
+			memset(gram->cached_row[slot], 0xff, STRIPE_BYTES);  /* unreadable: assume present */
+		}
+		gram->cached_stripe[slot] = stripe;
+	}
+
+	size_t local = block % STRIPE_BLOCKS;
+	return (gram->cached_row[slot][local / 8] >> (local % 8)) & 1;
+}
+
+
+/*
+ * Works out which parts of the file open on fd (and named path) can hold a
+ * match.  Returns -1 if the index cannot help (file not indexed or changed,
+ * or no 4-byte literal in the pattern); otherwise returns 0 and sets *ranges
+ * to the byte ranges to search, in order.  A match can only start inside a
+ * returned range, and lies entirely within it.
+ */
+int ngram_index_candidates(const struct ngram_index *index, const char *path, int fd,
+		const struct byte_pattern *pattern, off_t skip_to,
+		struct search_range **ranges, size_t *range_count) {
+	const uint64_t block_size = index->header.block_size;
+	struct query_gram grams[MAX_QUERY_GRAMS];
+	size_t gram_count = 0;
+	struct stat s;
+
+	*ranges = NULL;
+	*range_count = 0;
+	/* Variable gaps move the grams after them, and the end of a match */
+	if (pattern->gap_count > 0)
+		return -1;
+
+	char *canonical = realpath(path, NULL);
+	if (canonical == NULL)
+		return -1;
+	struct ngram_index_entry key;
+	key.path = canonical;
+	const struct ngram_index_entry *entry = bsearch(&key, index->entries, index->count,
+			sizeof(*index->entries), compare_entries);
+	free(canonical);
+
+	if (entry == NULL || fstat(fd, &s)
+			|| (uint64_t) s.st_size != entry->file.size
+			|| s.st_mtim.tv_sec != entry->file.mtime_sec
+			|| s.st_mtim.tv_nsec != entry->file.mtime_nsec) {
+		return -1;
+	}
+
+	size_t i = 0;
+	for (; i + GRAM_LEN <= pattern->len && gram_count < MAX_QUERY_GRAMS; ++i) {
+		uint32_t gram = 0;
+		size_t j = 0;
+		for (; j < GRAM_LEN && pattern->mask[i + j] == 0xff; ++j)
+			gram = (gram << 8) | pattern->value[i + j];
+		if (j == GRAM_LEN) {
+			grams[gram_count].offset = i;
+			grams[gram_count].bucket = gram_bucket(gram, index->header.bucket_bits);
+			++gram_count;
+		}
+	}
+	if (gram_count == 0)
+		return -1;
+
+	/* Whole-file pruning first */
+	unsigned char *file_bitmap = xmalloc(index->bitmap_bytes);
+	int present = !pread_all(index->fd, file_bitmap, index->bitmap_bytes, entry->bitmap_offset);
+	for (i = 0; present && i < gram_count; ++i) {
+		present = (file_bitmap[grams[i].bucket / 8] >> (grams[i].bucket % 8)) & 1;
+	}
+	free(file_bitmap);
+	if (!present || entry->file.size < pattern->len)
+		return 0;
+
+	for (i = 0; i < gram_count; ++i) {
+		grams[i].cached_stripe[0] = grams[i].cached_stripe[1] = UINT64_MAX;
+		grams[i].cached_row[0] = xmalloc(STRIPE_BYTES);
+		grams[i].cached_row[1] = xmalloc(STRIPE_BYTES);
+	}
+
+	/* A match starting in block b has gram i starting in block b + i/B, or the one after it */
+	size_t range_alloc = 0;
+	uint64_t last_start_block = (entry->file.size - pattern->len) / block_size;
+	uint64_t block = skip_to / block_size;
+	for (; block <= last_start_block; ++block) {
+		size_t g = 0;
+		for (; g < gram_count; ++g) {
+			uint64_t first = block + grams[g].offset / block_size;
+			int spans_two = (grams[g].offset % block_size) != 0 && first + 1 < entry->file.block_count;
+			if (!gram_in_block(index, entry, &grams[g], first)
+					&& !(spans_two && gram_in_block(index, entry, &grams[g], first + 1)))
+				break;
+		}
+		if (g < gram_count)
+			continue;
+
+		off_t start = MAX((off_t) (block * block_size), skip_to);
+		off_t end = MIN((block + 1) * block_size + pattern->len - 1, entry->file.size);
+		if (*range_count > 0 && (*ranges)[*range_count - 1].end >= start) {
+			(*ranges)[*range_count - 1].end = end;
+		} else {
+			if (*range_count == range_alloc)
+				*ranges = x2nrealloc(*ranges, &range_alloc, sizeof(**ranges));
+			(*ranges)[*range_count].start = start;
+			(*ranges)[*range_count].end = end;
+			++*range_count;
+		}
+	}
+
+	for (i = 0; i < gram_count; ++i) {
+		free(grams[i].cached_row[0]);
+		free(grams[i].cached_row[1]);
+	}
+	return 0;
+}
@@ -0,0 +1,126 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * Pipes, sockets and terminals, read on a reader thread.
+ *
+ * Nothing that seeks applies to them, and reading and searching in turn
+ * leaves the producer waiting while bgrep searches.  So the reader is the
+ * producer of a slot_ring of large slots, filled with read(2) while the
+ * searching thread consumes the earlier ones, and a pipe's own buffer is
+ * raised to a slot with F_SETPIPE_SZ where the system allows, so the
+ * producer can get that far ahead too.  Each read is handed over as soon
+ * as it returns, so a slow producer's matches are not held back.
+ */
+
+enum { SLOT_SIZE = 1024 * 1024 };
+
+struct pipe_reader {
+	int fd;
+	struct slot_ring *ring;
+
+	/* Owned by the reader thread until the ring is stopped */
+	int error;
+	uintmax_t bytes_read;
+	uintmax_t read_calls;
+};
+
+
+/* Can fd not seek, so that it is better read by pipe_reader_start()? */
+int pipe_reader_wanted(int fd) {
+	return lseek(fd, 0, SEEK_CUR) == (off_t) -1 && errno == ESPIPE;
+}
+
+
+/* Makes a pipe's buffer as big as size, or as near as the system allows */
+static void grow_pipe(int fd, size_t size) {
+#if defined F_SETPIPE_SZ && defined F_GETPIPE_SZ
+	struct stat s;
+	if (fstat(fd, &s) || !S_ISFIFO(s.st_mode))
+		return;
+	/* Beyond /proc/sys/fs/pipe-max-size, only privileged processes may */
+	int current = fcntl(fd, F_GETPIPE_SZ);
+	for (; current > 0 && size > (size_t) current; size /= 2) {
+		if (fcntl(fd, F_SETPIPE_SZ, (int) size) >= 0)
+			break;
+	}
+#else
+	(void) fd;
+	(void) size;
+#endif
+}
+
+
+static void read_input(void *arg) {
+	struct pipe_reader *r = arg;
+	unsigned char *slot;
+	while ((slot = ring_claim(r->ring)) != NULL) {
+		ssize_t n = ring_read(r->fd, slot, ring_slot_size(r->ring));
+		++r->read_calls;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			r->error = errno;
+		if (n < 1)
+			break;
+		r->bytes_read += n;
+		ring_publish(r->ring, n);
+	}
+}
+
+
+/*
+ * Starts reading fd from its current position, read_size bytes at a time
+ * or more.  Returns NULL after printing why on failure.
+ */
+struct pipe_reader *pipe_reader_start(struct output_context *out, int fd, size_t read_size) {
+	struct pipe_reader *r = xzalloc(sizeof(*r));
+	r->fd = fd;
+	r->ring = ring_new(MAX(read_size, SLOT_SIZE));
+	grow_pipe(fd, ring_slot_size(r->ring));
+
+	int err = ring_start(r->ring, read_input, r);
+	if (err) {
+		print_error(out, err, "cannot start reader thread");
+		ring_stop(r->ring);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+
+/* The data read, for ring_next() and ring_release() */
+struct slot_ring *pipe_reader_ring(struct pipe_reader *r) {
+	return r->ring;
+}
+
+
+/*
+ * Stops the reader and frees it, adding its reads to out's statistics.  A
+ * read error is only reported if the search got as far as it.  Returns
+ * RESULT_ERROR after reporting one, RESULT_NO_MATCH otherwise.
+ */
+int pipe_reader_finish(struct pipe_reader *r, struct output_context *out) {
+	int drained = ring_stop(r->ring);
+
+	int result = RESULT_NO_MATCH;
+	if (drained && r->error) {
+		print_error(out, r->error, "%s", out->filename);
+		result = RESULT_ERROR;
+	}
+	out->stats.bytes_read += r->bytes_read;
+	out->stats.read_calls += r->read_calls;
+	free(r);
+	return result;
+}
@@ -1,84 +1,123 @@
 #include "config.h"
 
 #include <errno.h>
-#include <error.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+/* gnulib dependencies */
+#include "progname.h"
+
 #include "bgrep.h"
 
 #undef HEX_DIGIT
 #define HEX_DIGIT(n) (hexx[(n)&0xf])
 
-enum { INITIAL_BUFSIZE = 2048, XXD_MAX_COUNT = 16 };
+enum { INITIAL_BUFSIZE = 2048 };
 static const char hexx[] = "0123456789abcdef";
 
-/* State parameters while processing a single file */
-static const char *filename;
-static off_t last_offset = 0;
-static unsigned long match_count = 0;
-static unsigned int xxd_count = 0;
-static char human_text[17];
+static void print_xxd(struct output_context *ctx, const char *match, size_t len, off_t file_offset);
+static inline void endline_xxd(struct output_context *ctx);
+
+
+/* Resets the per-file state in ctx.  Output goes to ctx->out, which the caller sets up. */
+void begin_match(struct output_context *ctx, const char *fname) {
+	ctx->filename = fname;
+	ctx->last_offset = 0;
+	ctx->match_count = 0;
+	ctx->xxd_count = 0;
+	memset(ctx->human_text, 0, sizeof(ctx->human_text));
+}
+
+
+/* With --stats, the time spent printing is added to ctx->stats.output_ns.  Modes
+ * that print nothing per match are not timed, to keep the clock off the hot path. */
+static inline int output_timed(const struct output_context *ctx) {
+	return ctx->config->stats && ctx->config->print_mode <= OFFSETS;
+}
+
 
-static void print_xxd(const char *match, size_t len, off_t file_offset);
-static inline void endline_xxd();
+static inline uint64_t output_timer(const struct output_context *ctx) {
+	return output_timed(ctx) ? stats_clock() : 0;
+}
 
 
-void begin_match(const char *fname) {
-	filename = fname;
-	last_offset = 0;
-	match_count = 0;
-	xxd_count = 0;
-	memset(human_text, 0, sizeof(human_text));
+static inline void output_timer_stop(struct output_context *ctx, uint64_t start) {
+	if (output_timed(ctx)) {
+		ctx->stats.output_ns += stats_clock() - start;
+	}
+}
+
+
+void print_before(struct output_context *ctx, const char *buf, size_t len, off_t file_offset) {
+	if (ctx->config->print_mode == XXD_DUMP) {
+		uint64_t start = output_timer(ctx);
+		print_xxd(ctx, buf, len, file_offset);
+		output_timer_stop(ctx, start);
+	}
 }
 
 
-void print_before(const char *buf, size_t len, off_t file_offset) {
-	if (params.print_mode == XXD_DUMP) {
-		print_xxd(buf, len, file_offset);
+void print_after(struct output_context *ctx, const char *buf, size_t len, off_t file_offset) {
+	if (ctx->config->print_mode == XXD_DUMP) {
+		uint64_t start = output_timer(ctx);
+		print_xxd(ctx, buf, len, file_offset);
+		output_timer_stop(ctx, start);
 	}
 }
 
 
-void print_match(const char *match, size_t len, off_t file_offset) {
-	switch (params.print_mode) {
+void print_match(struct output_context *ctx, const char *match, size_t len, off_t file_offset) {
+	uint64_t start = output_timer(ctx);
+	switch (ctx->config->print_mode) {
 		case QUIET:
 		case COUNT_MATCHES:
 		case LIST_FILENAMES:
 			/* Do nothing now.  Results print in flush_match(). */
 			break;
 		case OFFSETS:
-			if (params.print_filenames) {
-				printf("%s:%08jx\n", filename, (intmax_t) file_offset);
+			if (ctx->config->segments != NULL) {
+				/*
+				 * With --concat, the offset in the whole, then where in which FILE.
+				 * -H adds no name before the first: no one FILE's would be right.
+				 */
+				off_t local;
+				const char *segment = concat_locate(ctx->config->segments, file_offset, &local);
+				fprintf(ctx->out, "%08jx %s:%08jx", (intmax_t) file_offset, segment, (intmax_t) local);
+			} else if (ctx->config->print_filenames) {
+				fprintf(ctx->out, "%s:%08jx", ctx->filename, (intmax_t) file_offset);
 			} else {
-				printf("%08jx\n", (intmax_t) file_offset);
+				fprintf(ctx->out, "%08jx", (intmax_t) file_offset);
 			}
+			putc('\n', ctx->out);
 			break;
 
 		case XXD_DUMP:
 		default:
-			print_xxd(match, len, file_offset);
+			print_xxd(ctx, match, len, file_offset);
 			break;
 	}
 
-	++match_count;
+	++ctx->match_count;
+	output_timer_stop(ctx, start);
 }
 
 
-void flush_match() {
-	switch (params.print_mode) {
+void flush_match(struct output_context *ctx) {
+	uint64_t start = output_timer(ctx);
+	switch (ctx->config->print_mode) {
 		case COUNT_MATCHES:
-			if (params.print_filenames) {
-				printf("%s:%ld\n", filename, match_count);
+			if (ctx->config->print_filenames) {
+				fprintf(ctx->out, "%s:%ld\n", ctx->filename, ctx->match_count);
 			} else {
-				printf("%ld\n", match_count);
+				fprintf(ctx->out, "%ld\n", ctx->match_count);
 			}
 			break;
 
 		case LIST_FILENAMES:
-			if (match_count > 0) {
-				printf("%s\n", filename);
+			if (ctx->match_count > 0) {
+				fprintf(ctx->out, "%s\n", ctx->filename);
 			}
 			break;
 
@@ -88,105 +127,119 @@ void flush_match() {
 
 		case XXD_DUMP:
 		default:
-			if (xxd_count != 0) {
-				endline_xxd();
+			if (ctx->xxd_count != 0) {
+				endline_xxd(ctx);
 			}
 			break;
 	}
+	output_timer_stop(ctx, start);
 }
 
 
-/* Not intended for use on file descriptors that cannot seek backward (e.g. pipes or stdin). */
-void print_after_fd(int fd, off_t file_offset)
-{
-	if (params.print_mode != XXD_DUMP || params.bytes_after == 0) {
-		return;
-	}
+/* Reports an error for this search, formatted like error(3), on ctx->err */
+void print_error(struct output_context *ctx, int errnum, const char *format, ...) {
+	va_list args;
 
-        off_t save_pos = lseek(fd, (off_t)0, SEEK_CUR);
+	fflush(ctx->out);
+	fprintf(ctx->err, "%s: ", program_name);
+	va_start(args, format);
+	vfprintf(ctx->err, format, args);
+	va_end(args);
+	if (errnum) {
+		fprintf(ctx->err, ": %s", strerror(errnum));
+	}
+	putc('\n', ctx->err);
+	fflush(ctx->err);
+}
 
-        if (save_pos == (off_t)-1)
-        {
-                perror("File descriptor does not support lseek. Will not show context-after-match: ");
-                return; /* this one is not fatal */
-        }
 
-        char buf[INITIAL_BUFSIZE];
-        size_t bytes_to_read = params.bytes_after;
+/* Not intended for use on file descriptors that cannot seek (e.g. pipes or stdin). */
+void print_after_fd(struct output_context *ctx, int fd, off_t file_offset)
+{
+	if (ctx->config->print_mode != XXD_DUMP || ctx->config->bytes_after == 0) {
+		return;
+	}
 
-        for (;bytes_to_read;)
-        {
-                size_t read_chunk = bytes_to_read > sizeof(buf) ? sizeof(buf) : bytes_to_read;
-                ssize_t bytes_read = read(fd, buf, read_chunk);
+	char buf[INITIAL_BUFSIZE];
+	uintmax_t bytes_to_read = ctx->config->bytes_after;
+	uint64_t start = output_timer(ctx);
 
-                if (bytes_to_read < 0)
-                {
-                        error(RESULT_ERROR, errno, "Error reading context-after-match");
-                }
+	while (bytes_to_read > 0)
+	{
+		size_t read_chunk = MIN(bytes_to_read, sizeof(buf));
+		ssize_t bytes_read = pread(fd, buf, read_chunk, file_offset);
 
-		print_xxd(buf, bytes_read, file_offset);
+		if (bytes_read < 0)
+		{
+			if (errno == ESPIPE) {
+				print_error(ctx, errno, "File descriptor does not support lseek. Will not show context-after-match");
+			} else {
+				print_error(ctx, errno, "Error reading context-after-match");
+			}
+			break; /* neither is fatal */
+		} else if (bytes_read == 0) {
+			break;
+		}
 
-		file_offset += read_chunk;
-                bytes_to_read -= read_chunk;
-        }
+		print_xxd(ctx, buf, bytes_read, file_offset);
 
-        if (lseek(fd, save_pos, SEEK_SET) == (off_t)-1)
-        {
-                error(RESULT_ERROR, errno, "Could not restore the original file offset after printing context-after-match");
-        }
+		file_offset += bytes_read;
+		bytes_to_read -= bytes_read;
+	}
+	output_timer_stop(ctx, start);
 }
 
 
-static void print_xxd(const char *match, size_t len, off_t file_offset) {
+static void print_xxd(struct output_context *ctx, const char *match, size_t len, off_t file_offset) {
 	const char *endp = match+len;
 
-	if (file_offset < last_offset) {
+	if (file_offset < ctx->last_offset) {
 		/* Avoid double-printing */
-		off_t skip = MIN(len, last_offset-file_offset);
+		off_t skip = MIN(len, ctx->last_offset-file_offset);
 		match += skip;
 		file_offset += skip;
 	}
 
-	if (file_offset > last_offset && xxd_count > 0) {
-		endline_xxd();
+	if (file_offset > ctx->last_offset && ctx->xxd_count > 0) {
+		endline_xxd(ctx);
 	}
 
 	while (match < endp) {
-		if (xxd_count == 0) {
-			if (params.print_filenames) {
-				printf("%s:%07jx:", filename, (intmax_t) file_offset);
+		if (ctx->xxd_count == 0) {
+			/* With --concat, lines can span segments: offsets are the whole's, without a FILE name */
+			if (ctx->config->print_filenames && ctx->config->segments == NULL) {
+				fprintf(ctx->out, "%s:%07jx:", ctx->filename, (intmax_t) file_offset);
 			} else {
-				printf("%07jx:", (intmax_t) file_offset);
+				fprintf(ctx->out, "%07jx:", (intmax_t) file_offset);
 			}
 		}
 
-		if ((xxd_count&1) == 0) {
-			putchar(' ');
+		if ((ctx->xxd_count&1) == 0) {
+			putc(' ', ctx->out);
 		}
 
-		putchar(HEX_DIGIT(*match >> 4));
-		putchar(HEX_DIGIT(*match));
-		human_text[xxd_count] = (*match > 31 && *match < 127) ? *match : '.';
+		putc(HEX_DIGIT(*match >> 4), ctx->out);
+		putc(HEX_DIGIT(*match), ctx->out);
+		ctx->human_text[ctx->xxd_count] = (*match > 31 && *match < 127) ? *match : '.';
 
-		++xxd_count;
+		++ctx->xxd_count;
 		++match;
 		++file_offset;
 
-		if (xxd_count == XXD_MAX_COUNT) {
-			endline_xxd();
+		if (ctx->xxd_count == XXD_MAX_COUNT) {
+			endline_xxd(ctx);
 		}
 	}
 
-	last_offset = MAX(file_offset, last_offset);
+	ctx->last_offset = MAX(file_offset, ctx->last_offset);
 
 }
 
 
-static inline void endline_xxd() {
-	int space_count = (XXD_MAX_COUNT-xxd_count)* 5 / 2;
-	printf("%.*s  %s\n", space_count, "                                        ", human_text);
+static inline void endline_xxd(struct output_context *ctx) {
+	int space_count = (XXD_MAX_COUNT-ctx->xxd_count)* 5 / 2;
+	fprintf(ctx->out, "%.*s  %s\n", space_count, "                                        ", ctx->human_text);
 
-	memset(human_text, 0, sizeof(human_text));
-	xxd_count = 0;
+	memset(ctx->human_text, 0, sizeof(ctx->human_text));
+	ctx->xxd_count = 0;
 }
-
@@ -0,0 +1,141 @@
+#include "config.h"
+
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* gnulib dependencies */
+#include "progname.h"
+
+#include "bgrep.h"
+
+/*
+ * --progress: a reporter thread prints how much has been read, how fast and
+ * when it should be done, once a second on stderr.  On a terminal the line
+ * is rewritten in place; otherwise a line is printed every
+ * PROGRESS_LOG_SECONDS.
+ *
+ * The total grows as files are started, so with -r the ETA only covers the
+ * files seen so far.  Searches add to the counters once per read.
+ */
+
+enum { PROGRESS_LOG_SECONDS = 10 };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t reporter;
+static int closing;
+static int started;
+static uintmax_t bytes_done;
+static uintmax_t bytes_total;    /* of the files whose size is known */
+static int total_unknown;        /* some input had no size */
+static uint64_t start_ns;
+
+static void *reporter_main(void *arg);
+
+
+/* Formats n like 1.5G into buf */
+static const char *format_size(char *buf, size_t buf_size, double n) {
+	static const char units[] = "BKMGTPE";
+	const char *unit = units;
+	while (n >= 1024 && unit[1]) {
+		n /= 1024;
+		++unit;
+	}
+	snprintf(buf, buf_size, (*unit == 'B') ? "%.0f%c" : "%.1f%c", n, *unit);
+	return buf;
+}
+
+
+void progress_start(void) {
+	start_ns = stats_clock();
+	int err = pthread_create(&reporter, NULL, reporter_main, NULL);
+	if (err) {
+		error(0, err, "cannot start progress thread");
+		return;
+	}
+	started = 1;
+}
+
+
+/* Counts a new input of size bytes (-1 if unknown) */
+void progress_begin(off_t size) {
+	pthread_mutex_lock(&lock);
+	if (size < 0) {
+		total_unknown = 1;
+	} else {
+		bytes_total += size;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/* Counts n bytes as searched */
+void progress_add(uintmax_t n) {
+	pthread_mutex_lock(&lock);
+	bytes_done += n;
+	pthread_mutex_unlock(&lock);
+}
+
+
+/* Prints the current figures.  Called with the lock held. */
+static void report(int last) {
+	char done[16], total[16], rate[16];
+	double seconds = (stats_clock() - start_ns) / 1e9;
+	double per_second = (seconds > 0) ? bytes_done / seconds : 0;
+	int tty = isatty(STDERR_FILENO);
+
+	fprintf(stderr, "%s: %s", program_name, format_size(done, sizeof(done), bytes_done));
+	if (!total_unknown && bytes_total > 0) {
+		fprintf(stderr, " of %s (%.1f%%)", format_size(total, sizeof(total), bytes_total),
+				100.0 * MIN(bytes_done, bytes_total) / bytes_total);
+	}
+	fprintf(stderr, ", %s/s", format_size(rate, sizeof(rate), per_second));
+	if (!last && !total_unknown && per_second > 0 && bytes_total > bytes_done) {
+		unsigned long eta = (bytes_total - bytes_done) / per_second;
+		fprintf(stderr, ", ETA %lu:%02lu:%02lu", eta / 3600, eta / 60 % 60, eta % 60);
+	}
+	/* Blank out what is left of a longer line */
+	fputs(tty ? "        \r" : "\n", stderr);
+	if (tty && last)
+		putc('\n', stderr);
+}
+
+
+static void *reporter_main(void *arg) {
+	(void) arg;
+	unsigned seconds = 0;
+	int tty = isatty(STDERR_FILENO);
+
+	pthread_mutex_lock(&lock);
+	while (!closing) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 1;
+		while (!closing && pthread_cond_timedwait(&wake, &lock, &deadline) != ETIMEDOUT)
+			continue;
+		++seconds;
+		if (!closing && (tty || seconds % PROGRESS_LOG_SECONDS == 0))
+			report(0);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+
+/* Stops the reporter and prints the final figures */
+void progress_finish(void) {
+	if (!started)
+		return;
+	pthread_mutex_lock(&lock);
+	closing = 1;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+	pthread_join(reporter, NULL);
+
+	report(1);
+}
@@ -0,0 +1,281 @@
+#include "config.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * Result cache for bgrep --cache=DIR.
+ *
+ * Every combination of pattern and result-affecting options (-s, -F, -z) gets
+ * its own log in DIR, named after their hash.  A log is a sequence of
+ * records, each holding a file's identity (device, inode, size, mtime and
+ * ctime) and the offsets of its matches.  Records are only ever appended,
+ * each with a single write under an exclusive flock(), and carry a
+ * checksum, so concurrent bgreps can share a log and a torn record left by
+ * a crash is skipped.  The last record for a file wins, except that a record
+ * with only a count never displaces one with the offsets for the same,
+ * unchanged file: that one still serves every output mode.
+ *
+ * The log is read once, when the cache is opened; lookups never touch it.
+ *
+ *   record:  magic:u32 length:u32 dev:u64 ino:u64 size:u64 mtime_ns:i64 ctime_ns:i64
+ *            match_count:u64 offset_count:u64 offsets[offset_count]:u64 checksum:u64
+ */
+
+static const uint32_t RECORD_MAGIC = 0x43524742;   /* "BGRC" */
+static const uint64_t RECORD_SEED = 0x62677265702d7231ULL;
+
+struct record_header {
+	uint32_t magic;
+	uint32_t length;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	uint64_t match_count;
+	uint64_t offset_count;
+};
+
+struct cache_slot {
+	struct record_header header;
+	const unsigned char *offsets;
+};
+
+struct result_cache {
+	char *path;
+	int fd;
+	int write_failed;
+	pthread_mutex_t lock;
+	unsigned char *log;
+	size_t slot_mask;
+	struct cache_slot *slots;   /* open addressing on (dev, ino); header.magic == 0 marks a free slot */
+};
+
+
+static inline size_t slot_index(uint64_t dev, uint64_t ino, size_t mask) {
+	uint64_t key[2] = { dev, ino };
+	return hash_bytes(key, sizeof(key), 0) & mask;
+}
+
+
+/* The slot for (dev, ino): the one in use for it, or the free one where it would go */
+static struct cache_slot *find_slot(const struct result_cache *cache, uint64_t dev, uint64_t ino) {
+	size_t i = slot_index(dev, ino, cache->slot_mask);
+	while (cache->slots[i].header.magic != 0
+			&& (cache->slots[i].header.dev != dev || cache->slots[i].header.ino != ino)) {
+		i = (i + 1) & cache->slot_mask;
+	}
+	return &cache->slots[i];
+}
+
+
+/* Would header, in place of slot's record, keep only the count of the offsets slot has for the same file version? */
+static int loses_offsets(const struct cache_slot *slot, const struct record_header *header) {
+	const struct record_header *old = &slot->header;
+	return old->magic != 0 && old->size == header->size && old->mtime_ns == header->mtime_ns
+		&& old->ctime_ns == header->ctime_ns && old->offset_count == old->match_count
+		&& header->offset_count != header->match_count;
+}
+
+
+static void insert_slot(struct result_cache *cache, const struct record_header *header, const unsigned char *offsets) {
+	struct cache_slot *slot = find_slot(cache, header->dev, header->ino);
+	if (loses_offsets(slot, header))
+		return;
+	slot->header = *header;
+	slot->offsets = offsets;
+}
+
+
+/* Is there a whole, intact record at the start of p? */
+static int valid_record(const unsigned char *p, size_t avail, struct record_header *header) {
+	uint64_t checksum;
+
+	if (avail < sizeof(*header) + sizeof(checksum))
+		return 0;
+	memcpy(header, p, sizeof(*header));
+	if (header->magic != RECORD_MAGIC
+			|| header->length > avail
+			|| header->offset_count > MAX_CACHED_OFFSETS
+			|| header->length != sizeof(*header) + (header->offset_count + 1) * sizeof(uint64_t))
+		return 0;
+	memcpy(&checksum, p + header->length - sizeof(checksum), sizeof(checksum));
+	return checksum == hash_bytes(p, header->length - sizeof(checksum), RECORD_SEED);
+}
+
+
+/* Reads the whole log and indexes its records */
+static int load_log(struct result_cache *cache) {
+	struct stat s;
+	if (flock(cache->fd, LOCK_SH) || fstat(cache->fd, &s))
+		return -1;
+
+	size_t size = s.st_size;
+	size_t done = 0;
+	cache->log = xmalloc(size + 1);
+	while (done < size) {
+		ssize_t r = pread(cache->fd, cache->log + done, size - done, done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1)
+			break;
+		done += r;
+	}
+	flock(cache->fd, LOCK_UN);
+	if (done < size)
+		return -1;
+
+	/* Each record takes at least this much, which bounds the number of slots */
+	size_t max_records = size / (sizeof(struct record_header) + sizeof(uint64_t));
+	size_t slot_count = 16;
+	while (slot_count < 2 * max_records)
+		slot_count *= 2;
+	cache->slot_mask = slot_count - 1;
+	cache->slots = xcalloc(slot_count, sizeof(*cache->slots));
+
+	struct record_header header;
+	size_t pos = 0;
+	while (pos < size) {
+		if (valid_record(cache->log + pos, size - pos, &header)) {
+			insert_slot(cache, &header, cache->log + pos + sizeof(header));
+			pos += header.length;
+		} else {
+			++pos;  /* torn or foreign bytes: look for the next record */
+		}
+	}
+	return 0;
+}
+
+
+/* Opens (creating if needed) the cache in dir for config's pattern and options.  Returns NULL after printing why on failure. */
+struct result_cache *result_cache_open(const char *dir, const struct bgrep_config *config) {
+	uint64_t key = search_key(config);
+
+	if (mkdir(dir, 0777) && errno != EEXIST) {
+		error(0, errno, "%s", dir);
+		return NULL;
+	}
+
+	struct result_cache *cache = xzalloc(sizeof(*cache));
+	cache->path = xmalloc(strlen(dir) + 22);
+	sprintf(cache->path, "%s/%016jx.log", dir, (uintmax_t) key);
+	pthread_mutex_init(&cache->lock, NULL);
+
+	cache->fd = open(cache->path, O_RDWR | O_APPEND | O_CREAT | O_BINARY, 0666);
+	if (cache->fd < 0 || load_log(cache)) {
+		error(0, errno, "%s", cache->path);
+		result_cache_close(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+
+void result_cache_close(struct result_cache *cache) {
+	if (cache == NULL)
+		return;
+	if (cache->fd >= 0)
+		close(cache->fd);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->slots);
+	free(cache->log);
+	free(cache->path);
+	free(cache);
+}
+
+
+/* Finds the results recorded for the file described by s, if it has not changed since.  Returns 0 on a hit. */
+int result_cache_lookup(const struct result_cache *cache, const struct stat *s, struct cached_result *result) {
+	const struct cache_slot *slot = find_slot(cache, s->st_dev, s->st_ino);
+	if (slot->header.magic == 0
+			|| slot->header.size != (uint64_t) s->st_size
+			|| slot->header.mtime_ns != timespec_ns(s->st_mtim)
+			|| slot->header.ctime_ns != timespec_ns(s->st_ctim))
+		return -1;
+
+	result->match_count = slot->header.match_count;
+	result->offset_count = slot->header.offset_count;
+	result->offsets = slot->offsets;
+	return 0;
+}
+
+
+/* Offset i of a cached result.  The log is not aligned, so read it a byte at a time. */
+uint64_t cached_offset(const struct cached_result *result, size_t i) {
+	uint64_t offset;
+	memcpy(&offset, result->offsets + i * sizeof(offset), sizeof(offset));
+	return offset;
+}
+
+
+/*
+ * Appends the matches found in the file described by s.  Pass fewer offsets
+ * than match_count to keep only the count.  Write errors are reported once
+ * and otherwise ignored: the cache is only an optimization.
+ */
+void result_cache_store(struct result_cache *cache, const struct stat *s,
+		uintmax_t match_count, const uintmax_t *offsets, size_t offset_count) {
+	struct record_header header;
+	uint64_t checksum;
+
+	if (offset_count != match_count || offset_count > MAX_CACHED_OFFSETS)
+		offset_count = 0;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = RECORD_MAGIC;
+	header.length = sizeof(header) + (offset_count + 1) * sizeof(uint64_t);
+	header.dev = s->st_dev;
+	header.ino = s->st_ino;
+	header.size = s->st_size;
+	header.mtime_ns = timespec_ns(s->st_mtim);
+	header.ctime_ns = timespec_ns(s->st_ctim);
+	header.match_count = match_count;
+	header.offset_count = offset_count;
+	if (loses_offsets(find_slot(cache, header.dev, header.ino), &header))
+		return;
+
+	unsigned char *record = xmalloc(header.length);
+	memcpy(record, &header, sizeof(header));
+	size_t i = 0;
+	for (; i < offset_count; ++i) {
+		uint64_t offset = offsets[i];
+		memcpy(record + sizeof(header) + i * sizeof(offset), &offset, sizeof(offset));
+	}
+	checksum = hash_bytes(record, header.length - sizeof(checksum), RECORD_SEED);
+	memcpy(record + header.length - sizeof(checksum), &checksum, sizeof(checksum));
+
+	pthread_mutex_lock(&cache->lock);
+	if (!cache->write_failed) {
+		ssize_t w;
+		if (flock(cache->fd, LOCK_EX)) {
+			w = -1;
+		} else {
+			do {
+				w = write(cache->fd, record, header.length);
+			} while (w < 0 && errno == EINTR);
+			flock(cache->fd, LOCK_UN);
+		}
+		if (w != (ssize_t) header.length) {
+			/* A short write leaves a torn record, which readers skip */
+			error(0, (w < 0) ? errno : ENOSPC, "cannot update %s", cache->path);
+			cache->write_failed = 1;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	free(record);
+}
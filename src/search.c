@@ -0,0 +1,990 @@
+// Copyright 2009 Felix Domke <tmbinc@elitedvb.net>. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice, this list of
+//       conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright notice, this list
+//       of conditions and the following disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are those of the
+// authors and should not be interpreted as representing official policies, either expressed
+// or implied, of the copyright holder.
+//
+
+#include "config.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+enum { INITIAL_BUFSIZE = 2048, READ_BUFSIZE = 64 * 1024 };
+static const char *STD_IN_FILENAME = "-";
+/* What -c -H, -l and --stats call the input of --concat: no one segment's name covers it */
+static const char CONCAT_NAME[] = "concat";
+
+
+off_t skip(struct output_context *out, int fd, off_t current, off_t n) {
+	off_t result = lseek(fd, n, SEEK_CUR);
+	if (result == (off_t)-1) {
+		if (n < 0)
+		{
+			print_error(out, errno, "cannot lseek backward");
+			return -1;
+		}
+		/* Skip forward the hard way. */
+		unsigned char buf[INITIAL_BUFSIZE];
+		result = current;
+		while (n > 0) {
+			ssize_t r = read(fd, buf, MIN(n, sizeof(buf)));
+			if (r < 1)
+			{
+				if (r != 0) print_error(out, errno, "%s", out->filename);
+				return result;
+			}
+			n -= r;
+			result += r;
+		}
+	}
+
+	return result;
+}
+
+
+struct search_state {
+	struct output_context *out;
+	int fd;
+	uintmax_t *offsets;      /* with --cache or --dedup-content, the offsets of the first MAX_CACHED_OFFSETS matches */
+	size_t offset_count;
+	size_t offset_alloc;
+	int carve;               /* --carve, from a file that can seek */
+	size_t read_size;
+	struct direct_reader *direct;          /* --direct or --drop-cache, from a file or block device */
+	struct checkpoint_entry *checkpoint;   /* --checkpoint, when output is written as it is found */
+	unsigned long checkpointed_matches;
+	int count_only;          /* -c, -l and -q: the stream counts, and nothing is reported per match */
+	struct content_hash *content;   /* --dedup-content: the hash of what was read from the start of the file */
+
+	/* With -z and --tee, after-context is printed from the data as it arrives */
+	int stream_after;
+	const unsigned char *chunk;   /* the data being fed, which starts at chunk_offset */
+	uintmax_t chunk_offset;
+	size_t chunk_len;
+	uintmax_t after_from;         /* the after-context not printed yet */
+	uintmax_t after_to;
+};
+
+
+/* Prints the part of the pending after-context that is in the current chunk */
+static void print_pending_after(struct search_state *state) {
+	uintmax_t from = MAX(state->after_from, state->chunk_offset);
+	uintmax_t to = MIN(state->after_to, state->chunk_offset + state->chunk_len);
+	if (from < to) {
+		print_after(state->out, (const char *) state->chunk + (from - state->chunk_offset), to - from, from);
+		state->after_from = to;
+	}
+}
+
+
+/* Has the search stopped, with all of its after-context printed? */
+static inline int search_done(const struct search_state *state, int stopped) {
+	return stopped && state->after_from >= state->after_to;
+}
+
+
+static int print_one_match(const struct bgrep_match *match, void *arg) {
+	struct search_state *state = arg;
+	const uintmax_t end = match->offset + match->len;
+
+	/* With --resume, these were reported last time */
+	if (match->offset < (uintmax_t) state->out->resume_from)
+		return 0;
+
+	print_before(state->out, (const char *) match->before, match->before_len, match->offset - match->before_len);
+	print_match(state->out, (const char *) match->data, match->len, match->offset);
+	if (state->stream_after) {
+		state->after_from = MAX(state->after_from, end);
+		if (state->out->config->print_mode == XXD_DUMP)
+			state->after_to = MAX(state->after_to, end + state->out->config->bytes_after);
+		print_pending_after(state);
+	} else {
+		print_after_fd(state->out, state->fd, end);
+	}
+
+	if (state->carve)
+		carve_submit(state->out->filename, state->fd, match->offset, match->len);
+
+	if ((state->out->config->cache != NULL || state->content != NULL) && state->offset_count < MAX_CACHED_OFFSETS) {
+		if (state->offset_count == state->offset_alloc)
+			state->offsets = x2nrealloc(state->offsets, &state->offset_alloc, sizeof(*state->offsets));
+		state->offsets[state->offset_count++] = match->offset;
+	}
+	return state->out->config->first_only;
+}
+
+
+/* Feeds len bytes to stream, keeping the match count up to date when the stream only counts */
+static int feed(struct search_state *state, struct bgrep_stream *stream, const unsigned char *data, size_t len) {
+	int stop = bgrep_stream_feed(stream, data, len);
+	if (state->count_only)
+		state->out->match_count = bgrep_stream_matches(stream);
+	return stop;
+}
+
+
+/* Nothing is printed per match, so there is no need to find them one by one.
+ * A resumed search still has to leave out the matches it already counted, and
+ * --cache records the offsets, so that the entry serves every output mode. */
+static void start_counting(struct output_context *out, struct search_state *state, struct bgrep_stream *stream) {
+	const struct bgrep_config *config = out->config;
+	if (config->print_mode >= COUNT_MATCHES && config->carve_dir == NULL && config->cache == NULL
+			&& out->resume_from == 0 && out->match_count == 0) {
+		state->count_only = 1;
+		bgrep_stream_count_only(stream, config->first_only);
+	}
+}
+
+
+/* Decides the matches that start too near the end for the stream to have been sure of them: only variable
+ * gaps leave any.  Their after-context can only come from the file, as the last chunk may be gone. */
+static void finish_stream(struct search_state *state, struct bgrep_stream *stream) {
+	state->chunk_len = 0;
+	bgrep_stream_finish(stream);
+	if (state->count_only)
+		state->out->match_count = bgrep_stream_matches(stream);
+}
+
+
+/* Are a and b the same, unchanged file? */
+static int same_file(const struct stat *a, const struct stat *b) {
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+		&& a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+		&& a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+
+/* Records in the checkpoint that every match that can end by position has been reported */
+static void record_progress(struct search_state *state, off_t position) {
+	struct output_context *out = state->out;
+	if (out->match_count != state->checkpointed_matches) {
+		/* A match counts as reported once it has been written */
+		fflush(out->out);
+		state->checkpointed_matches = out->match_count;
+	}
+	checkpoint_progress(out->config->checkpoint, state->checkpoint,
+			position - (off_t) (byte_pattern_max_len(out->config->pattern) - 1), out->match_count);
+}
+
+
+/* Feeds stream from fd until EOF, end (if not -1) or a stop request.  Returns RESULT_ERROR on a read error. */
+static int feed_stream(struct output_context *out, struct search_state *state, struct bgrep_stream *stream, int fd,
+		unsigned char *buf, off_t position, off_t end) {
+	const int timed = out->config->stats != 0;
+	struct search_stats *stats = &out->stats;
+
+	while (end < 0 || position < end) {
+		size_t want = (end < 0) ? state->read_size : MIN(state->read_size, (uintmax_t) (end - position));
+		const unsigned char *data = buf;
+		uint64_t start = timed ? stats_clock() : 0;
+		ssize_t r = (state->direct != NULL) ? direct_read(state->direct, fd, &data, want, position)
+			: read(fd, buf, want);
+		++stats->read_calls;
+		if (timed) {
+			uint64_t now = stats_clock();
+			stats->io_ns += now - start;
+			start = now;
+		}
+		if (r < 1) {
+			if (r < 0) {
+				print_error(out, errno, "%s", out->filename);
+				return RESULT_ERROR;
+			}
+			break;
+		}
+		stats->bytes_read += r;
+		/* Only a read on from the start extends the hash; dedup_store() reads the rest */
+		if (state->content != NULL && state->content->len == (uint64_t) position)
+			content_hash_update(state->content, data, r);
+		position += r;
+		if (out->config->progress)
+			progress_add(r);
+
+		/* Matches print from inside the feed; keep their time out of the matching time */
+		uint64_t output_ns = stats->output_ns;
+		int stop = feed(state, stream, data, r);
+		if (timed)
+			stats->match_ns += stats_clock() - start - (stats->output_ns - output_ns);
+		if (stop)
+			break;
+		if (state->checkpoint != NULL)
+			record_progress(state, position);
+	}
+	return RESULT_NO_MATCH;
+}
+
+
+/* Searches the len bytes at data, which start at position in the input, leaving out any before --skip.
+ * Returns nonzero once the search should stop. */
+static int scan_chunk(struct output_context *out, struct search_state *state, struct bgrep_stream *stream,
+		const unsigned char *data, size_t len, uintmax_t position) {
+	const uintmax_t skip_to = out->config->skip_to;
+	const int timed = out->config->stats != 0;
+	struct search_stats *stats = &out->stats;
+	uint64_t start = timed ? stats_clock() : 0;
+	uint64_t output_ns = stats->output_ns;
+
+	size_t drop = (position < skip_to) ? MIN(len, skip_to - position) : 0;
+	state->chunk = data + drop;
+	state->chunk_offset = position + drop;
+	state->chunk_len = len - drop;
+	print_pending_after(state);
+	int stop = feed(state, stream, state->chunk, state->chunk_len);
+	if (timed)
+		stats->match_ns += stats_clock() - start - (stats->output_ns - output_ns);
+	return stop;
+}
+
+
+/* Feeds stream the decoded contents of fd, dropping the first --skip bytes of them */
+static int feed_decoder(struct output_context *out, struct search_state *state, struct bgrep_stream *stream, int fd) {
+	const int timed = out->config->stats != 0;
+	struct decoder *decoder = decoder_start(out, fd);
+	if (decoder == NULL)
+		return RESULT_ERROR;
+
+	struct slot_ring *ring = decoder_ring(decoder);
+	uintmax_t position = 0;
+	bgrep_stream_reset(stream, out->config->skip_to);
+	state->stream_after = 1;
+	for (;;) {
+		/* Time spent waiting for the decoder counts as I/O */
+		size_t len;
+		uint64_t start = timed ? stats_clock() : 0;
+		const unsigned char *data = ring_next(ring, &len);
+		if (timed)
+			out->stats.io_ns += stats_clock() - start;
+		if (data == NULL)
+			break;
+
+		int stop = scan_chunk(out, state, stream, data, len, position);
+		position += len;
+		ring_release(ring);
+		if (search_done(state, stop))
+			break;
+	}
+	return decoder_finish(decoder, out);
+}
+
+
+/* Feeds stream from fd, which cannot seek, through a pipe_reader, so reading overlaps with searching */
+static int feed_pipe(struct output_context *out, struct search_state *state, struct bgrep_stream *stream,
+		int fd, uintmax_t position) {
+	const int timed = out->config->stats != 0;
+	struct pipe_reader *reader = pipe_reader_start(out, fd, state->read_size);
+	if (reader == NULL)
+		return RESULT_ERROR;
+
+	struct slot_ring *ring = pipe_reader_ring(reader);
+	/* The input cannot be read again, so after-context comes from the ring */
+	state->stream_after = 1;
+	for (;;) {
+		/* Time spent waiting for the reader counts as I/O */
+		size_t len;
+		uint64_t start = timed ? stats_clock() : 0;
+		const unsigned char *data = ring_next(ring, &len);
+		if (timed)
+			out->stats.io_ns += stats_clock() - start;
+		if (data == NULL)
+			break;
+		if (out->config->progress)
+			progress_add(len);
+
+		int stop = scan_chunk(out, state, stream, data, len, position);
+		position += len;
+		ring_release(ring);
+		if (search_done(state, stop))
+			break;
+		if (state->checkpoint != NULL)
+			record_progress(state, position);
+	}
+	return pipe_reader_finish(reader, out);
+}
+
+
+#if !defined HAVE_TEE || !defined HAVE_SPLICE
+/* Without them, --tee reads, searches and writes every chunk */
+static ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+	errno = EINVAL;
+	return -1;
+}
+
+static ssize_t splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags) {
+	errno = EINVAL;
+	return -1;
+}
+#endif
+
+
+/* Writes all len bytes of buf to fd.  Returns -1 on failure. */
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t w = write(fd, buf, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w < 0)
+			return -1;
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+
+/* Reads exactly len bytes, which are known to be waiting in fd.  Returns -1 on failure. */
+static int read_all(int fd, unsigned char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t r = read(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1)
+			return -1;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+/*
+ * --tee: copies fd to standard output unchanged while searching it.  When
+ * both are pipes, tee(2) duplicates the data into standard output inside
+ * the kernel and it is only read for the search; otherwise every chunk is
+ * read, searched and written.  Once the search stops (-F, -l, -q), the
+ * rest is passed on with splice(2) if either end is a pipe.
+ */
+static int feed_tee(struct output_context *out, struct search_state *state, struct bgrep_stream *stream,
+		int fd, unsigned char *buf) {
+	const int timed = out->config->stats != 0;
+	struct search_stats *stats = &out->stats;
+	int use_tee = 1;
+	int use_splice = 1;
+	int searching = 1;
+	uintmax_t position = 0;
+
+	bgrep_stream_reset(stream, out->config->skip_to);
+	state->stream_after = 1;
+	for (;;) {
+		uint64_t start = timed ? stats_clock() : 0;
+		ssize_t r;
+		int write_failed = 0;
+		if (!searching && use_splice) {
+			r = splice(fd, NULL, STDOUT_FILENO, NULL, READ_BUFSIZE, SPLICE_F_MOVE);
+			if (r < 0 && errno == EINVAL) {
+				use_splice = 0;
+				continue;
+			}
+			write_failed = (r < 0 && errno == EPIPE);
+		} else if (use_tee) {
+			r = tee(fd, STDOUT_FILENO, READ_BUFSIZE, 0);
+			if (r < 0 && errno == EINVAL) {
+				use_tee = 0;
+				continue;
+			}
+			write_failed = (r < 0 && errno == EPIPE);
+			if (r > 0 && read_all(fd, buf, r))
+				r = -1;
+		} else {
+			r = read(fd, buf, READ_BUFSIZE);
+			if (r > 0 && write_all(STDOUT_FILENO, buf, r)) {
+				write_failed = 1;
+				r = -1;
+			}
+		}
+		++stats->read_calls;
+		if (timed)
+			stats->io_ns += stats_clock() - start;
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1) {
+			if (r < 0) {
+				if (write_failed) {
+					print_error(out, errno, "write");
+				} else {
+					print_error(out, errno, "%s", out->filename);
+				}
+				return RESULT_ERROR;
+			}
+			break;
+		}
+		stats->bytes_read += r;
+		if (searching && search_done(state, scan_chunk(out, state, stream, buf, r, position)))
+			searching = 0;
+		position += r;
+	}
+	return RESULT_NO_MATCH;
+}
+
+
+/* --follow: feeds stream from fd, and at the end of a regular file waits for it to grow.
+ * The stream carries the undecided tail across appends, so no match is lost or repeated. */
+static int feed_follow(struct output_context *out, struct search_state *state, struct bgrep_stream *stream,
+		int fd, unsigned char *buf, off_t position) {
+	const int timed = out->config->stats != 0;
+	struct search_stats *stats = &out->stats;
+	struct follow *follow = follow_open(fd);
+	int result = RESULT_NO_MATCH;
+
+	/* Context after a match near the end has not been written yet */
+	state->stream_after = 1;
+	for (;;) {
+		uint64_t start = timed ? stats_clock() : 0;
+		ssize_t r = read(fd, buf, READ_BUFSIZE);
+		++stats->read_calls;
+		if (timed)
+			stats->io_ns += stats_clock() - start;
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			print_error(out, errno, "%s", out->filename);
+			result = RESULT_ERROR;
+			break;
+		}
+
+		if (r == 0) {
+			/* Caught up: show what was found before waiting */
+			fflush(out->out);
+			enum follow_event event = (follow == NULL) ? FOLLOW_STOP : follow_wait(follow, fd, position);
+			if (event == FOLLOW_STOP)
+				break;
+			if (event == FOLLOW_TRUNCATED) {
+				print_error(out, 0, "%s: file truncated", out->filename);
+				position = lseek(fd, 0, SEEK_SET);
+				if (position == (off_t) -1) {
+					print_error(out, errno, "%s", out->filename);
+					result = RESULT_ERROR;
+					break;
+				}
+				bgrep_stream_reset(stream, out->config->skip_to);
+				state->after_from = state->after_to = 0;
+			}
+			continue;
+		}
+
+		stats->bytes_read += r;
+		if (search_done(state, scan_chunk(out, state, stream, buf, r, position)))
+			break;
+		position += r;
+	}
+	follow_close(follow);
+	return result;
+}
+
+
+/* With -z, does fd have to go through the decoder?  Pipes cannot be peeked at, so they always do. */
+static int needs_decoder(int fd) {
+	unsigned char magic[4];
+	off_t position = lseek(fd, 0, SEEK_CUR);
+	if (position == (off_t) -1)
+		return 1;
+	ssize_t r = pread(fd, magic, sizeof(magic), position);
+	return r > 0 && compression_type(magic, r) != COMPRESSION_NONE;
+}
+
+
+int searchfile(struct output_context *out, const char *filename, int fd) {
+	const struct bgrep_config *config = out->config;
+	int result = RESULT_NO_MATCH;
+	struct search_state state = { out, fd, NULL, 0, 0 };
+	struct bgrep_stream *stream = bgrep_stream_new(config->pattern, config->bytes_before, print_one_match, &state);
+	state.read_size = (config->io_size > 0) ? config->io_size : READ_BUFSIZE;
+	unsigned char *buf = xmalloc(MAX(state.read_size, READ_BUFSIZE));
+	off_t size = config->progress ? input_size(fd) : -1;
+	struct search_range *ranges = NULL;
+	size_t range_count = 0;
+	off_t file_offset = 0;
+	int carve_failed = 0;
+	struct stat before;
+	struct content_hash content;
+
+	/* Only regular files can be cached: their identity says whether they changed.
+	 * A resumed search has not seen every match, so it cannot be. */
+	int regular = fd != 0 && out->resume_from == 0 && !fstat(fd, &before) && S_ISREG(before.st_mode);
+	int cacheable = config->cache != NULL && regular;
+	if (config->dedup != NULL && regular) {
+		content_hash_init(&content);
+		state.content = &content;
+	}
+
+	/* Resume far enough back to have the context for the first new match */
+	uintmax_t skip_to = config->skip_to;
+	if (out->resume_from > 0)
+		skip_to = MAX(skip_to, out->resume_from - MIN(config->bytes_before, (uintmax_t) out->resume_from));
+
+	begin_match(out, filename);
+	if (config->progress)
+		progress_begin(size);
+	if (out->checkpoint != NULL) {
+		out->match_count = out->resumed_matches;
+		/* With --jobs, output is only written when the file is done */
+		if (config->jobs <= 1) {
+			state.checkpoint = out->checkpoint;
+			state.checkpointed_matches = out->match_count;
+		}
+	}
+
+	start_counting(out, &state, stream);
+
+	if (config->carve_dir != NULL) {
+		/* Regions are copied from the file later, by offset */
+		state.carve = lseek(fd, 0, SEEK_CUR) != (off_t) -1;
+		if (!state.carve) {
+			print_error(out, 0, "%s: cannot carve from input that cannot seek", filename);
+			carve_failed = 1;
+		}
+	}
+
+	if (config->tee) {
+		result = feed_tee(out, &state, stream, fd, buf);
+		goto DONE;
+	}
+
+	if (config->decompress && needs_decoder(fd)) {
+		/* Offsets are in the decoded data, so neither --index nor seeking applies */
+		result = feed_decoder(out, &state, stream, fd);
+		goto DONE;
+	}
+
+	if ((config->direct || config->drop_cache) && fd != 0)
+		state.direct = direct_open(config, fd);
+
+	if (config->index != NULL && fd != 0
+			&& ngram_index_candidates(config->index, filename, fd, config->pattern, skip_to,
+				&ranges, &range_count) == 0) {
+		if (range_count == 0)
+			++out->stats.files_pruned;
+		/* Only the candidate ranges can match.  Bytes before a range cannot start a
+		 * match, so extending a range backwards for context is always safe. */
+		off_t stream_end = -1;
+		size_t i = 0;
+		for (; i < range_count && result != RESULT_ERROR; ++i) {
+			off_t start = MAX(ranges[i].start - (off_t) MIN(config->bytes_before, (uintmax_t) ranges[i].start),
+					(off_t) skip_to);
+			if (start <= stream_end) {
+				/* Close enough to the last range to keep going without losing context */
+				start = stream_end;
+			} else {
+				if (lseek(fd, start, SEEK_SET) == (off_t) -1) {
+					print_error(out, errno, "%s", filename);
+					result = RESULT_ERROR;
+					break;
+				}
+				bgrep_stream_reset(stream, start);
+			}
+			result = feed_stream(out, &state, stream, fd, buf, start, ranges[i].end);
+			stream_end = ranges[i].end;
+			if (config->first_only && out->match_count > 0)
+				break;
+		}
+		goto DONE;
+	}
+
+	if (skip_to > 0) {
+		file_offset = skip(out, fd, file_offset, skip_to);
+		if (file_offset != (off_t) skip_to)
+		{
+			print_error(out, 0, "Failed to skip ahead to offset 0x%jx", (intmax_t) file_offset);
+			result = RESULT_ERROR;
+			goto CLEANUP;
+		}
+	}
+	bgrep_stream_reset(stream, file_offset);
+	if (config->follow) {
+		result = feed_follow(out, &state, stream, fd, buf, file_offset);
+	} else if (pipe_reader_wanted(fd)) {
+		result = feed_pipe(out, &state, stream, fd, file_offset);
+	} else {
+		result = feed_stream(out, &state, stream, fd, buf, file_offset, -1);
+	}
+
+DONE:
+	if (result != RESULT_ERROR)
+		finish_stream(&state, stream);
+	if (config->stats) {
+		off_t now = input_size(fd);
+		out->stats.matcher = *bgrep_stream_counters(stream);
+		if (fd != 0 && now >= 0) {
+			out->stats.bytes_skipped = MAX(now - (off_t) out->stats.bytes_read, 0);
+		} else {
+			out->stats.bytes_skipped = file_offset;
+		}
+	}
+	/* Count what --skip, --index or an early stop left unread as done */
+	if (config->progress && size > (off_t) out->stats.bytes_read)
+		progress_add(size - out->stats.bytes_read);
+	if ((cacheable || state.content != NULL) && result != RESULT_ERROR) {
+		struct stat after;
+		if (!fstat(fd, &after) && same_file(&before, &after)) {
+			if (cacheable)
+				result_cache_store(config->cache, &after, out->match_count, state.offsets, state.offset_count);
+			if (state.content != NULL)
+				dedup_store(config->dedup, out, fd, &after, state.content, out->match_count,
+						state.offsets, state.offset_count);
+		}
+	}
+	if (out->match_count > 0 && result != RESULT_ERROR)
+		result = RESULT_MATCH;
+	if (carve_failed)
+		result = RESULT_ERROR;
+	flush_match(out);
+CLEANUP:
+	direct_close(state.direct);
+	bgrep_stream_free(stream);
+	free(state.offsets);
+	free(ranges);
+	free(buf);
+	return result;
+}
+
+
+/*
+ * --concat: searches the segments as one input, in order, through a
+ * single stream, so matches can span them and offsets are counted from
+ * the start of the first.  After-context can run on into the next
+ * segment, so it comes from the data as it arrives.
+ */
+int search_concat(struct output_context *out) {
+	const struct bgrep_config *config = out->config;
+	const struct concat *segments = config->segments;
+	int result = RESULT_NO_MATCH;
+	struct search_state state = { out, -1, NULL, 0, 0 };
+	struct bgrep_stream *stream = bgrep_stream_new(config->pattern, config->bytes_before, print_one_match, &state);
+	state.read_size = (config->io_size > 0) ? config->io_size : READ_BUFSIZE;
+	state.stream_after = 1;
+	unsigned char *buf = xmalloc(MAX(state.read_size, READ_BUFSIZE));
+	const int timed = config->stats != 0;
+	struct search_stats *stats = &out->stats;
+	int stopped = 0;
+	int fd;
+	off_t start, end;
+
+	stats_begin_file(out);
+	begin_match(out, CONCAT_NAME);
+	stats->files_opened = concat_count(segments);
+	if (config->progress)
+		progress_begin(concat_size(segments));
+	start_counting(out, &state, stream);
+	bgrep_stream_reset(stream, config->skip_to);
+
+	int i = 0;
+	for (; i < concat_count(segments) && !stopped && result != RESULT_ERROR; ++i) {
+		const char *name = concat_segment(segments, i, &fd, &start, &end);
+		if ((uintmax_t) end <= config->skip_to)
+			continue;
+		off_t position = MAX(start, (off_t) config->skip_to) - start;
+		if (lseek(fd, position, SEEK_SET) == (off_t) -1) {
+			print_error(out, errno, "%s", name);
+			result = RESULT_ERROR;
+			break;
+		}
+		state.fd = fd;
+		if (config->direct || config->drop_cache)
+			state.direct = direct_open(config, fd);
+
+		/* Each segment is read up to the size it had when opened, so offsets stay where they were */
+		while (start + position < end) {
+			size_t want = MIN(state.read_size, (uintmax_t) (end - start - position));
+			const unsigned char *data = buf;
+			uint64_t begin = timed ? stats_clock() : 0;
+			ssize_t r = (state.direct != NULL) ? direct_read(state.direct, fd, &data, want, position)
+				: read(fd, buf, want);
+			++stats->read_calls;
+			if (timed)
+				stats->io_ns += stats_clock() - begin;
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 1) {
+				if (r < 0) {
+					print_error(out, errno, "%s", name);
+				} else {
+					print_error(out, 0, "%s: file shrank while being searched", name);
+				}
+				result = RESULT_ERROR;
+				break;
+			}
+			stats->bytes_read += r;
+			if (config->progress)
+				progress_add(r);
+
+			stopped = search_done(&state, scan_chunk(out, &state, stream, data, r, start + position));
+			position += r;
+			if (stopped)
+				break;
+		}
+		direct_close(state.direct);
+		state.direct = NULL;
+	}
+
+	if (result != RESULT_ERROR)
+		finish_stream(&state, stream);
+	if (config->stats) {
+		stats->matcher = *bgrep_stream_counters(stream);
+		stats->bytes_skipped = MAX(concat_size(segments) - (off_t) stats->bytes_read, 0);
+	}
+	if (config->progress && concat_size(segments) > (off_t) stats->bytes_read)
+		progress_add(concat_size(segments) - stats->bytes_read);
+	if (out->match_count > 0 && result != RESULT_ERROR)
+		result = RESULT_MATCH;
+	flush_match(out);
+	if (config->stats)
+		stats_end_file(out, out->filename);
+
+	bgrep_stream_free(stream);
+	free(state.offsets);
+	free(buf);
+	return result;
+}
+
+
+/* Prints the results --cache or --dedup-content recorded for path, described by s.
+ * Returns -1, having printed nothing, if the file has to be searched after all. */
+static int replay_cached(struct output_context *out, const char *path, const struct stat *s,
+		const struct cached_result *cached) {
+	const struct bgrep_config *config = out->config;
+	const size_t len = config->pattern->len;
+	int fd = -1;
+
+	if ((config->print_mode == XXD_DUMP || config->print_mode == OFFSETS) && cached->offset_count != cached->match_count)
+		return -1;
+	/* With variable gaps, how long each match was is not recorded */
+	if (config->print_mode == XXD_DUMP && config->pattern->gap_count > 0 && cached->match_count > 0)
+		return -1;
+	/* Carving reads the file anyway */
+	if (config->carve_dir != NULL && cached->match_count > 0)
+		return -1;
+
+	if (config->print_mode == XXD_DUMP && cached->match_count > 0) {
+		/* Printing the matched bytes means reading them, but only them */
+		struct stat now;
+		fd = openat(config->dir_fd, path, O_RDONLY | O_BINARY);
+		if (fd < 0 || fstat(fd, &now) || !same_file(s, &now) || (config->decompress && needs_decoder(fd))) {
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		++out->stats.files_opened;
+	}
+	++out->stats.files_pruned;
+	/* --dedup-content may have read some of it to tell it apart */
+	out->stats.bytes_skipped = MAX(s->st_size - (off_t) out->stats.bytes_read, 0);
+
+	int result = RESULT_NO_MATCH;
+	unsigned char *buf = NULL;
+	begin_match(out, path);
+	size_t i = 0;
+	for (; i < cached->offset_count; ++i) {
+		off_t offset = cached_offset(cached, i);
+		if (fd < 0) {
+			print_match(out, NULL, len, offset);
+			continue;
+		}
+
+		/* The stream never keeps history from before the skip */
+		size_t before_len = MIN(config->bytes_before, (uintmax_t) (offset - config->skip_to));
+		buf = xrealloc(buf, before_len + len);
+		if (pread(fd, buf, before_len + len, offset - before_len) != (ssize_t) (before_len + len)) {
+			print_error(out, errno, "%s", path);
+			result = RESULT_ERROR;
+			break;
+		}
+		++out->stats.read_calls;
+		out->stats.bytes_read += before_len + len;
+		print_before(out, (const char *) buf, before_len, offset - before_len);
+		print_match(out, (const char *) buf + before_len, len, offset);
+		print_after_fd(out, fd, offset + len);
+	}
+	if (cached->offset_count == 0)
+		out->match_count = cached->match_count;
+
+	if (out->match_count > 0 && result != RESULT_ERROR)
+		result = RESULT_MATCH;
+	flush_match(out);
+	free(buf);
+	if (fd >= 0)
+		close(fd);
+	return result;
+}
+
+
+/* Records in the checkpoint that the file out searched is done, once its results are written.
+ * With --jobs they are written later, so jobs.c records it instead. */
+static void finish_checkpoint(struct output_context *out, int result) {
+	if (out->checkpoint != NULL && result != RESULT_ERROR && out->config->jobs <= 1) {
+		fflush(out->out);
+		checkpoint_done(out->config->checkpoint, out->checkpoint, out->match_count);
+	}
+}
+
+
+static int search_one(struct output_context *out, const char *path) {
+	const struct bgrep_config *config = out->config;
+	out->checkpoint = NULL;
+	out->resume_from = 0;
+	if (!strcmp(path, STD_IN_FILENAME)) {
+		++out->stats.files_opened;
+		return searchfile(out, "stdin", 0);
+	}
+
+	int result;
+	int fd = -1;
+	struct stat s;
+	int known = (config->cache != NULL || config->checkpoint != NULL) && !fstatat(config->dir_fd, path, &s, 0);
+	int regular = known && S_ISREG(s.st_mode);
+	int checkpointed = regular;
+
+	if (known && config->checkpoint != NULL && !regular) {
+		/* Block devices are recorded with their size, which only an open descriptor gives */
+		off_t size = -1;
+		if (S_ISBLK(s.st_mode) && (fd = openat(config->dir_fd, path, O_RDONLY | O_BINARY)) >= 0)
+			size = input_size(fd);
+		if (size >= 0) {
+			s.st_size = size;
+			checkpointed = 1;
+		} else if (fd >= 0 || !S_ISBLK(s.st_mode)) {
+			print_error(out, 0, "%s: not a file or block device of known size, so not checkpointed", path);
+		}
+	}
+
+	if (checkpointed && config->checkpoint != NULL) {
+		uintmax_t matches;
+		out->checkpoint = checkpoint_begin(config->checkpoint, path, &s, &out->resume_from, &matches);
+		if (out->checkpoint == NULL) {
+			/* Searched, and its results printed, before the search was resumed */
+			if (fd >= 0)
+				close(fd);
+			return (matches > 0) ? RESULT_MATCH : RESULT_NO_MATCH;
+		}
+		out->resumed_matches = matches;
+	}
+
+	if (regular && config->cache != NULL && out->resume_from == 0) {
+		/* Unchanged files are answered from the cache, usually without opening them */
+		struct cached_result cached;
+		if (!result_cache_lookup(config->cache, &s, &cached)
+				&& (result = replay_cached(out, path, &s, &cached)) >= 0) {
+			finish_checkpoint(out, result);
+			return result;
+		}
+	}
+
+	if (fd < 0)
+		fd = openat(config->dir_fd, path, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		print_error(out, errno, "%s", path);
+		result = RESULT_ERROR;
+	} else {
+		++out->stats.files_opened;
+		/* A file whose contents were searched already gets the same results */
+		struct cached_result cached;
+		result = -1;
+		if (config->dedup != NULL && out->resume_from == 0 && !fstat(fd, &s) && S_ISREG(s.st_mode)
+				&& !dedup_lookup(config->dedup, out, fd, &s, &cached))
+			result = replay_cached(out, path, &s, &cached);
+		if (result < 0)
+			result = searchfile(out, path, fd);
+		close(fd);
+	}
+	finish_checkpoint(out, result);
+	return result;
+}
+
+
+/* Searches a single non-directory path (or "-" for stdin), writing results to out.
+ * Relative paths are resolved against out->config->dir_fd. */
+int search_path(struct output_context *out, const char *path) {
+	stats_begin_file(out);
+	int result = search_one(out, path);
+	if (out->config->stats) {
+		stats_end_file(out, strcmp(path, STD_IN_FILENAME) ? path : "stdin");
+	}
+	return result;
+}
+
+
+/* Searches path, descending into directories with -r.  With --jobs, files are
+ * queued for the worker pool and RESULT_NO_MATCH is returned in their place;
+ * jobs_finish() reports their combined result. */
+int recurse(struct output_context *out, const char *path) {
+	const struct bgrep_config *config = out->config;
+	int result = RESULT_NO_MATCH;
+	struct stat s;
+	if (strcmp(path, STD_IN_FILENAME) && fstatat(config->dir_fd, path, &s, 0)) {
+		print_error(out, errno, "%s", path);
+		return RESULT_ERROR;
+	}
+
+	if (!strcmp(path, STD_IN_FILENAME) || !S_ISDIR(s.st_mode))
+	{
+		if (config->jobs > 1) {
+			jobs_submit(path);
+		} else {
+			result = search_path(out, path);
+		}
+		return result;
+	}
+
+	if (config->recurse == 0) {
+		print_error(out, 0, "%s: Is a directory", path);
+		return RESULT_ERROR;
+
+	} else {
+		int dir_fd = openat(config->dir_fd, path, O_RDONLY | O_DIRECTORY);
+		DIR *dir = (dir_fd < 0) ? NULL : fdopendir(dir_fd);
+		if (!dir)
+		{
+			print_error(out, errno, "%s", path);
+			if (dir_fd >= 0) close(dir_fd);
+			return RESULT_ERROR;
+		}
+
+		struct dirent *d;
+		while ((d = readdir(dir)))
+		{
+			if (!(strcmp(d->d_name, ".") && strcmp(d->d_name, "..")))
+				continue;
+			char newpath[strlen(path) + strlen(d->d_name) + 2];
+			strcpy(newpath, path);
+			strcat(newpath, "/");
+			strcat(newpath, d->d_name);
+			int tmpresult = recurse(out, newpath);
+			if (result == RESULT_NO_MATCH || tmpresult == RESULT_ERROR)
+				result = tmpresult;
+		}
+
+		closedir(dir);
+	}
+	return result;
+}
@@ -0,0 +1,171 @@
+#include "config.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * A ring of slots filled by a producer thread and consumed in order by the
+ * searching thread, so producing the next slot overlaps with searching the
+ * last one.  The decoder (-z) and the pipe reader each supply only the
+ * producer: it claims a slot with ring_claim(), fills it and hands it over
+ * with ring_publish(), until ring_claim() says the search has stopped.
+ *
+ * The producer runs with cancellation disabled except while it waits in
+ * ring_read(), so a search that stops early never waits on a pipe and the
+ * thread is never cancelled holding the lock.  Everything the producer
+ * allocates should hang off its own state, to be freed after ring_stop().
+ */
+
+enum { RING_SLOTS = 4 };
+
+struct slot_ring {
+	size_t slot_size;
+	void (*produce)(void *arg);
+	void *arg;
+	pthread_t thread;
+	int thread_started;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;     /* a slot was filled, or the producer is done */
+	pthread_cond_t emptied;    /* a slot was released, or the search stopped */
+	unsigned char *slots[RING_SLOTS];
+	size_t slot_len[RING_SLOTS];
+	unsigned long head;        /* next slot to search */
+	unsigned long tail;        /* next slot to fill */
+	int done;
+	int cancelled;
+	int drained;               /* the search saw the end of the data */
+};
+
+
+struct slot_ring *ring_new(size_t slot_size) {
+	struct slot_ring *r = xzalloc(sizeof(*r));
+	r->slot_size = slot_size;
+	int i = 0;
+	for (; i < RING_SLOTS; ++i)
+		r->slots[i] = xmalloc(slot_size);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->filled, NULL);
+	pthread_cond_init(&r->emptied, NULL);
+	return r;
+}
+
+
+static void *ring_main(void *arg) {
+	struct slot_ring *r = arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	r->produce(r->arg);
+
+	pthread_mutex_lock(&r->lock);
+	r->done = 1;
+	pthread_cond_signal(&r->filled);
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+
+/* Runs produce(arg) on a thread of its own.  Returns an errno value if the thread cannot be started. */
+int ring_start(struct slot_ring *r, void (*produce)(void *arg), void *arg) {
+	r->produce = produce;
+	r->arg = arg;
+	int err = pthread_create(&r->thread, NULL, ring_main, r);
+	r->thread_started = (err == 0);
+	return err;
+}
+
+
+/* For the producer: waits for a free slot of ring_slot_size() bytes.  Returns NULL once the search has stopped. */
+unsigned char *ring_claim(struct slot_ring *r) {
+	unsigned char *slot = NULL;
+	pthread_mutex_lock(&r->lock);
+	while (r->tail - r->head >= RING_SLOTS && !r->cancelled)
+		pthread_cond_wait(&r->emptied, &r->lock);
+	if (!r->cancelled)
+		slot = r->slots[r->tail % RING_SLOTS];
+	pthread_mutex_unlock(&r->lock);
+	return slot;
+}
+
+
+/* For the producer: hands the claimed slot, holding len bytes, to the search */
+void ring_publish(struct slot_ring *r, size_t len) {
+	if (len == 0)
+		return;
+	pthread_mutex_lock(&r->lock);
+	r->slot_len[r->tail % RING_SLOTS] = len;
+	++r->tail;
+	pthread_cond_signal(&r->filled);
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+/* For the producer: read(2), during which ring_stop() may cancel it */
+ssize_t ring_read(int fd, void *buf, size_t len) {
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	ssize_t r = read(fd, buf, len);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	return r;
+}
+
+
+size_t ring_slot_size(const struct slot_ring *r) {
+	return r->slot_size;
+}
+
+
+/* Waits for the next slot.  Returns NULL at the end.  Call ring_release() when done with it. */
+const unsigned char *ring_next(struct slot_ring *r, size_t *len) {
+	const unsigned char *data = NULL;
+	pthread_mutex_lock(&r->lock);
+	while (r->head == r->tail && !r->done)
+		pthread_cond_wait(&r->filled, &r->lock);
+	if (r->head != r->tail) {
+		data = r->slots[r->head % RING_SLOTS];
+		*len = r->slot_len[r->head % RING_SLOTS];
+	} else {
+		r->drained = 1;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return data;
+}
+
+
+/* Returns the slot from the last ring_next() to the producer */
+void ring_release(struct slot_ring *r) {
+	pthread_mutex_lock(&r->lock);
+	++r->head;
+	pthread_cond_signal(&r->emptied);
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+/*
+ * Stops the producer, if it was started, and frees r.  Returns nonzero if
+ * the search got to the end of the data, so that whatever stopped the
+ * producer is worth reporting.
+ */
+int ring_stop(struct slot_ring *r) {
+	pthread_mutex_lock(&r->lock);
+	r->cancelled = 1;
+	pthread_cond_signal(&r->emptied);
+	pthread_mutex_unlock(&r->lock);
+	if (r->thread_started) {
+		pthread_cancel(r->thread);
+		pthread_join(r->thread, NULL);
+	}
+
+	int drained = r->drained;
+	pthread_cond_destroy(&r->emptied);
+	pthread_cond_destroy(&r->filled);
+	pthread_mutex_destroy(&r->lock);
+	int i = 0;
+	for (; i < RING_SLOTS; ++i)
+		free(r->slots[i]);
+	free(r);
+	return drained;
+}
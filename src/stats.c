@@ -0,0 +1,144 @@
+#include "config.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+/* gnulib dependencies */
+#include "progname.h"
+
+#include "bgrep.h"
+
+/*
+ * --stats: per-file counters live in each output_context, so the hot path
+ * never takes a lock.  They are folded into the totals once per file.
+ */
+
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct search_stats totals;
+
+
+/* A cheap monotonic clock, in nanoseconds */
+uint64_t stats_clock(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+void stats_begin_file(struct output_context *ctx) {
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+
+static void add_stats(struct search_stats *sum, const struct search_stats *s) {
+	sum->files_opened += s->files_opened;
+	sum->files_pruned += s->files_pruned;
+	sum->bytes_read += s->bytes_read;
+	sum->bytes_skipped += s->bytes_skipped;
+	sum->read_calls += s->read_calls;
+	sum->matcher.candidates += s->matcher.candidates;
+	sum->matcher.verifications += s->matcher.verifications;
+	sum->matches += s->matches;
+	sum->io_ns += s->io_ns;
+	sum->match_ns += s->match_ns;
+	sum->output_ns += s->output_ns;
+}
+
+
+static void print_json_string(FILE *f, const char *s) {
+	putc('"', f);
+	for (; *s; ++s) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			fprintf(f, "\\%c", c);
+		} else if (c < 0x20 || c == 0x7f) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			putc(c, f);
+		}
+	}
+	putc('"', f);
+}
+
+
+/* Writes s as one line to stderr.  The line is built first so concurrent workers cannot interleave. */
+static void print_stats(const struct bgrep_config *config, const char *filename, const struct search_stats *s,
+		uint64_t wall_ns, const struct rusage *usage) {
+	char *line = NULL;
+	size_t line_len = 0;
+	FILE *f = open_memstream(&line, &line_len);
+	if (f == NULL)
+		return;
+
+	uintmax_t average_read = s->read_calls ? s->bytes_read / s->read_calls : 0;
+	if (config->stats & STATS_JSON) {
+		fputs("{", f);
+		if (filename != NULL) {
+			fputs("\"file\":", f);
+			print_json_string(f, filename);
+			fputs(",", f);
+		}
+		fprintf(f, "\"files_opened\":%ju,\"files_pruned\":%ju,\"bytes_read\":%ju,\"bytes_skipped\":%ju,"
+				"\"read_calls\":%ju,\"average_read\":%ju,\"candidates\":%ju,\"verifications\":%ju,\"matches\":%ju,"
+				"\"io_seconds\":%.6f,\"match_seconds\":%.6f,\"output_seconds\":%.6f",
+				s->files_opened, s->files_pruned, s->bytes_read, s->bytes_skipped,
+				s->read_calls, average_read, s->matcher.candidates, s->matcher.verifications, s->matches,
+				s->io_ns / 1e9, s->match_ns / 1e9, s->output_ns / 1e9);
+		if (usage != NULL) {
+			fprintf(f, ",\"wall_seconds\":%.6f,\"user_cpu_seconds\":%.6f,\"system_cpu_seconds\":%.6f",
+					wall_ns / 1e9,
+					usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+					usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6);
+		}
+		fputs("}\n", f);
+	} else {
+		fprintf(f, "%s: stats: %s: %ju opened, %ju pruned; %ju bytes read in %ju reads (%ju bytes/read), %ju skipped; "
+				"%ju candidates, %ju verifications, %ju matches; %.3fs I/O, %.3fs matching, %.3fs output",
+				program_name, filename ? filename : "total",
+				s->files_opened, s->files_pruned, s->bytes_read, s->read_calls, average_read, s->bytes_skipped,
+				s->matcher.candidates, s->matcher.verifications, s->matches,
+				s->io_ns / 1e9, s->match_ns / 1e9, s->output_ns / 1e9);
+		if (usage != NULL) {
+			fprintf(f, "; %.3fs wall, %.3fs user CPU, %.3fs system CPU",
+					wall_ns / 1e9,
+					usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+					usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6);
+		}
+		fputs("\n", f);
+	}
+	fclose(f);
+
+	fputs(line, stderr);
+	free(line);
+}
+
+
+/* Folds ctx's counters for filename into the totals, printing them first with --stats=files */
+void stats_end_file(struct output_context *ctx, const char *filename) {
+	ctx->stats.matches = ctx->match_count;
+	if (ctx->config->stats & STATS_FILES) {
+		print_stats(ctx->config, filename, &ctx->stats, 0, NULL);
+	}
+
+	pthread_mutex_lock(&totals_lock);
+	add_stats(&totals, &ctx->stats);
+	pthread_mutex_unlock(&totals_lock);
+}
+
+
+/* Prints the totals.  I/O, matching and output times are summed over files, so with --jobs they can exceed wall_ns. */
+void stats_report(const struct bgrep_config *config, uint64_t wall_ns) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		memset(&usage, 0, sizeof(usage));
+	}
+
+	pthread_mutex_lock(&totals_lock);
+	print_stats(config, NULL, &totals, wall_ns, &usage);
+	pthread_mutex_unlock(&totals_lock);
+}
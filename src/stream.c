@@ -0,0 +1,412 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * Push-based matcher.  Callers feed arbitrary chunks; the stream keeps the
+ * trailing len-1 bytes (plus 'history' bytes of before-context) so matches
+ * that straddle chunk boundaries are found exactly once.
+ *
+ * With variable gaps, a start is only decided once the longest match from
+ * it could have been seen, so the tail kept is that long, and
+ * bgrep_stream_finish() decides the starts the end of the data leaves.
+ *
+ * Literal patterns of LONG_PATTERN bytes or more are found with block
+ * fingerprints instead (see fingerprint.c), so neither the buffer nor the
+ * work per byte grows with the pattern: each candidate the fingerprints
+ * turn up is compared with the pattern as the data arrives, and reported
+ * once all of it has.
+ *
+ * After bgrep_stream_count_only(), matches are only counted.  Patterns of
+ * up to COUNT_MAX_LEN bytes are then counted straight from the fed data,
+ * a vector at a time (see count.c), keeping nothing but the last byte.
+ */
+
+/* From about a chunk on, shifting the kept tail costs more than fingerprinting */
+enum { STREAM_CHUNK = 64 * 1024, LONG_PATTERN = STREAM_CHUNK };
+
+/* When only the first match matters, counting looks at this much at a time */
+enum { COUNT_SLICE = 4096 };
+
+/* A possible match of a long pattern, checked up to the end of the data fed so far */
+struct candidate {
+	struct candidate *next;
+	uintmax_t offset;
+	size_t before_len;
+	unsigned char before[];
+};
+
+struct bgrep_stream {
+	struct bgrep_matcher matcher;
+	bgrep_match_fn on_match;
+	void *arg;
+	size_t history;
+	unsigned char *buf;
+	size_t size;
+	size_t used;
+	size_t scan;           /* index in buf of the next undecided match start */
+	uintmax_t buf_offset;  /* absolute offset of buf[0] */
+	int stopped;
+	struct bgrep_counters counters;
+	uintmax_t matches;
+	int count_only;        /* count matches instead of reporting them */
+	int stop_at_first;
+
+	/* Long literal patterns only */
+	struct fingerprint *fingerprint;
+	uintmax_t base;                   /* where the stream was reset: blocks are counted from here */
+	size_t *hits;
+	struct candidate *candidates;     /* in offset order */
+	struct candidate **candidates_end;
+};
+
+
+/* Creates a stream that reports matches of pattern to on_match.  The pattern must outlive the stream. */
+struct bgrep_stream *bgrep_stream_new(const struct byte_pattern *pattern, size_t history,
+		bgrep_match_fn on_match, void *arg) {
+	struct bgrep_stream *stream = xzalloc(sizeof(*stream));
+	bgrep_matcher_init(&stream->matcher, pattern);
+	stream->matcher.counters = &stream->counters;
+	stream->on_match = on_match;
+	stream->arg = arg;
+	stream->history = history;
+	stream->fingerprint = fingerprint_new(pattern, LONG_PATTERN);
+	if (stream->fingerprint != NULL) {
+		const size_t block = fingerprint_block(stream->fingerprint);
+		stream->hits = xnmalloc(block, sizeof(*stream->hits));
+		stream->size = history + 2 * block + STREAM_CHUNK;
+	} else {
+		/* The kept tail is moved once per refill, so a refill takes in at least as much as is moved */
+		stream->size = history + stream->matcher.max_len + MAX(STREAM_CHUNK, stream->matcher.max_len);
+	}
+	stream->buf = xmalloc(stream->size);
+	stream->candidates_end = &stream->candidates;
+	return stream;
+}
+
+
+static void free_candidates(struct bgrep_stream *stream) {
+	while (stream->candidates != NULL) {
+		struct candidate *c = stream->candidates;
+		stream->candidates = c->next;
+		free(c);
+	}
+	stream->candidates_end = &stream->candidates;
+}
+
+
+/* Discards all buffered data.  The next byte fed is at absolute position offset. */
+void bgrep_stream_reset(struct bgrep_stream *stream, uintmax_t offset) {
+	stream->used = 0;
+	stream->scan = 0;
+	stream->buf_offset = offset;
+	stream->stopped = 0;
+	stream->base = offset;
+	free_candidates(stream);
+}
+
+
+/* Absolute offset of the next byte to be fed */
+uintmax_t bgrep_stream_offset(const struct bgrep_stream *stream) {
+	return stream->buf_offset + stream->used;
+}
+
+
+/* Prefilter and verification work done since the stream was created */
+const struct bgrep_counters *bgrep_stream_counters(const struct bgrep_stream *stream) {
+	return &stream->counters;
+}
+
+
+/*
+ * Makes the stream count matches instead of reporting them, so on_match is
+ * never called.  With stop_at_first, it stops at the first one, as if a
+ * callback had asked to.  Call it before feeding anything.
+ */
+void bgrep_stream_count_only(struct bgrep_stream *stream, int stop_at_first) {
+	stream->count_only = 1;
+	stream->stop_at_first = stop_at_first;
+}
+
+
+/* Matches found since the stream was created */
+uintmax_t bgrep_stream_matches(const struct bgrep_stream *stream) {
+	return stream->matches;
+}
+
+
+/* Hands m to the callback, or only counts it.  Returns nonzero if the search should stop. */
+static int report(struct bgrep_stream *stream, const struct bgrep_match *m) {
+	++stream->matches;
+	if (stream->count_only ? stream->stop_at_first : stream->on_match(m, stream->arg)) {
+		stream->stopped = 1;
+		return 1;
+	}
+	return 0;
+}
+
+
+/* Reports a complete candidate.  Returns nonzero if the search should stop. */
+static int report_candidate(struct bgrep_stream *stream, const struct candidate *c) {
+	struct bgrep_match m;
+	m.offset = c->offset;
+	m.data = stream->matcher.pattern->value;   /* the same bytes: the pattern is literal */
+	m.len = stream->matcher.pattern->len;
+	m.before = c->before;
+	m.before_len = c->before_len;
+	return report(stream, &m);
+}
+
+
+/* Checks every candidate against the n bytes at data, which start at position, reporting those that are now complete */
+static int extend_candidates(struct bgrep_stream *stream, const unsigned char *data, size_t n, uintmax_t position) {
+	const struct byte_pattern *pattern = stream->matcher.pattern;
+	struct candidate **link = &stream->candidates;
+
+	while (*link != NULL) {
+		struct candidate *c = *link;
+		size_t done = position - c->offset;
+		size_t compare = MIN(n, pattern->len - done);
+		int matched = !memcmp(pattern->value + done, data, compare);
+		if (matched && done + compare < pattern->len) {
+			link = &c->next;
+			continue;
+		}
+
+		*link = c->next;
+		if (*link == NULL)
+			stream->candidates_end = link;
+		int stop = matched && report_candidate(stream, c);
+		free(c);
+		if (stop)
+			return 1;
+	}
+	return 0;
+}
+
+
+/* Looks up the block that ends at the end of the buffer, which is at position, and starts checking any candidates it gives */
+static int check_block(struct bgrep_stream *stream, uintmax_t position) {
+	const struct byte_pattern *pattern = stream->matcher.pattern;
+	const size_t block = fingerprint_block(stream->fingerprint);
+	const unsigned char *end = stream->buf + stream->used;
+	size_t count = fingerprint_lookup(stream->fingerprint, fingerprint_hash(stream->fingerprint, end - block),
+			stream->hits);
+	stream->counters.candidates += count;
+	stream->counters.verifications += count;
+
+	/* Largest j first, so candidates are made in offset order */
+	size_t i = 0;
+	for (; i < count; ++i) {
+		uintmax_t start = position - block - stream->hits[i];
+		if (start < stream->base)
+			continue;
+		size_t seen = position - start;
+		if (memcmp(end - seen, pattern->value, seen))
+			continue;
+
+		size_t before_len = MIN(stream->history, start - stream->buf_offset);
+		struct candidate *c = xmalloc(sizeof(*c) + before_len);
+		c->next = NULL;
+		c->offset = start;
+		c->before_len = before_len;
+		memcpy(c->before, end - seen - before_len, before_len);
+		if (seen == pattern->len) {
+			int stop = report_candidate(stream, c);
+			free(c);
+			if (stop)
+				return 1;
+		} else {
+			*stream->candidates_end = c;
+			stream->candidates_end = &c->next;
+		}
+	}
+	return 0;
+}
+
+
+/* bgrep_stream_feed() for long literal patterns: the data goes through a block at a time */
+static int feed_long(struct bgrep_stream *stream, const unsigned char *in, size_t len) {
+	const size_t block = fingerprint_block(stream->fingerprint);
+	const size_t keep = stream->history + 2 * block;
+
+	while (len > 0 && !stream->stopped) {
+		uintmax_t position = stream->buf_offset + stream->used;
+		size_t n = MIN(len, block - (position - stream->base) % block);
+		if (extend_candidates(stream, in, n, position))
+			return 1;
+
+		/* Keep enough to check a new candidate and give it its context */
+		if (stream->used + n > stream->size) {
+			size_t drop = stream->used - keep;
+			memmove(stream->buf, stream->buf + drop, keep);
+			stream->used = keep;
+			stream->buf_offset += drop;
+		}
+		memcpy(stream->buf + stream->used, in, n);
+		stream->used += n;
+		in += n;
+		len -= n;
+		position += n;
+
+		if ((position - stream->base) % block == 0 && check_block(stream, position))
+			return 1;
+	}
+	return stream->stopped;
+}
+
+
+/* bgrep_stream_feed() when counting short patterns: the data is counted where it is */
+static int feed_count(struct bgrep_stream *stream, const unsigned char *in, size_t len) {
+	const struct byte_pattern *pattern = stream->matcher.pattern;
+	const size_t carry = pattern->len - 1;
+
+	while (len > 0 && !stream->stopped) {
+		size_t n = stream->stop_at_first ? MIN(len, COUNT_SLICE) : len;
+		uintmax_t found = 0;
+		if (stream->used > 0) {
+			/* The match that starts on the byte kept from last time */
+			unsigned char pair[COUNT_MAX_LEN] = { stream->buf[0], in[0] };
+			found = count_matches(pattern, pair, sizeof(pair));
+		}
+		found += count_matches(pattern, in, n);
+		stream->counters.candidates += found;
+		stream->counters.verifications += found;
+
+		stream->buf_offset += stream->used + n - carry;
+		stream->used = carry;
+		if (carry > 0)
+			stream->buf[0] = in[n - 1];
+		in += n;
+		len -= n;
+
+		if (found > 0 && stream->stop_at_first) {
+			++stream->matches;
+			stream->stopped = 1;
+		} else {
+			stream->matches += found;
+		}
+	}
+	return stream->stopped;
+}
+
+
+/* Reports the matches that start before buf[starts_end], from the data up to buf[used] */
+static int scan_buffer(struct bgrep_stream *stream, size_t starts_end) {
+	while (stream->scan < starts_end) {
+		size_t match_len;
+		const unsigned char *match = bgrep_matcher_find_in(&stream->matcher, stream->buf + stream->scan,
+				starts_end - stream->scan, stream->used - stream->scan, &match_len);
+		if (match == NULL) {
+			stream->scan = starts_end;
+			break;
+		}
+
+		struct bgrep_match m;
+		size_t pos = match - stream->buf;
+		m.offset = stream->buf_offset + pos;
+		m.data = match;
+		m.len = match_len;
+		m.before_len = MIN(pos, stream->history);
+		m.before = match - m.before_len;
+		stream->scan = pos + 1;
+
+		if (report(stream, &m))
+			return 1;
+	}
+	return 0;
+}
+
+
+/* Scans len more bytes.  Returns nonzero once the search should stop. */
+int bgrep_stream_feed(struct bgrep_stream *stream, const void *data, size_t len) {
+	const unsigned char *in = data;
+	const size_t max_len = stream->matcher.max_len;
+
+	if (stream->fingerprint != NULL)
+		return feed_long(stream, in, len);
+	if (stream->count_only && count_supported(stream->matcher.pattern))
+		return feed_count(stream, in, len);
+
+	while (len > 0 && !stream->stopped) {
+		if (stream->used == stream->size) {
+			/* Full: keep the undecided tail plus the before-context it may need */
+			size_t keep_from = stream->scan - MIN(stream->scan, stream->history);
+			memmove(stream->buf, stream->buf + keep_from, stream->used - keep_from);
+			stream->used -= keep_from;
+			stream->scan -= keep_from;
+			stream->buf_offset += keep_from;
+		}
+
+		size_t n = MIN(len, stream->size - stream->used);
+		memcpy(stream->buf + stream->used, in, n);
+		stream->used += n;
+		in += n;
+		len -= n;
+
+		if (stream->used >= max_len && scan_buffer(stream, stream->used - max_len + 1))
+			return 1;
+	}
+
+	return stream->stopped;
+}
+
+
+/*
+ * Reports the matches that the end of the data completes: with variable
+ * gaps, those that start too near the end to have been decided yet.  Call
+ * it once everything has been fed.  Returns nonzero if the search should
+ * stop.
+ */
+int bgrep_stream_finish(struct bgrep_stream *stream) {
+	const size_t plen = stream->matcher.pattern->len;
+	if (stream->stopped || stream->matcher.max_len == plen || stream->used < plen)
+		return stream->stopped;
+	return scan_buffer(stream, stream->used - plen + 1);
+}
+
+
+void bgrep_stream_free(struct bgrep_stream *stream) {
+	if (stream != NULL) {
+		free_candidates(stream);
+		fingerprint_free(stream->fingerprint);
+		free(stream->hits);
+		free(stream->buf);
+		free(stream);
+	}
+}
+
+
+/* Reports every match in a single in-memory buffer.  Returns nonzero if a callback stopped the search. */
+int bgrep_search_buffer(const struct byte_pattern *pattern, const void *data, size_t len,
+		bgrep_match_fn on_match, void *arg) {
+	struct bgrep_matcher matcher;
+	const unsigned char *start = data;
+	const unsigned char *p = start;
+
+	bgrep_matcher_init(&matcher, pattern);
+	while (p + pattern->len <= start + len) {
+		size_t match_len;
+		const unsigned char *match = bgrep_matcher_find_in(&matcher, p, start + len - p - pattern->len + 1,
+				start + len - p, &match_len);
+		if (match == NULL)
+			break;
+
+		struct bgrep_match m;
+		m.offset = match - start;
+		m.data = match;
+		m.len = match_len;
+		m.before = start;
+		m.before_len = match - start;
+		if (on_match(&m, arg))
+			return 1;
+		p = match + 1;
+	}
+	return 0;
+}
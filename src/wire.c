@@ -0,0 +1,130 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* gnulib dependencies */
+#include "xalloc.h"
+
+#include "bgrep.h"
+
+/*
+ * Framing shared by bgrep --daemon and bgrepd.  Every message is a one-byte
+ * type, a four-byte big-endian payload length and the payload itself.
+ */
+
+enum { WIRE_HEADER_LEN = 5 };
+
+struct wire_cookie {
+	int fd;
+	char type;
+};
+
+
+static int write_all(int fd, const void *data, size_t len) {
+	const char *p = data;
+	while (len > 0) {
+		ssize_t w = send(fd, p, len, MSG_NOSIGNAL);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+
+static int read_all(int fd, void *data, size_t len) {
+	char *p = data;
+	while (len > 0) {
+		ssize_t r = read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+int wire_write_frame(int fd, char type, const void *data, size_t len) {
+	unsigned char header[WIRE_HEADER_LEN] = {
+		type, (len >> 24) & 0xff, (len >> 16) & 0xff, (len >> 8) & 0xff, len & 0xff
+	};
+
+	if (len > WIRE_MAX_FRAME) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (write_all(fd, header, sizeof(header)))
+		return -1;
+	return write_all(fd, data, len);
+}
+
+
+/* Returns the next frame's payload (NUL-terminated for convenience), or NULL on EOF or error */
+char *wire_read_frame(int fd, char *type, size_t *len) {
+	unsigned char header[WIRE_HEADER_LEN];
+
+	if (read_all(fd, header, sizeof(header)))
+		return NULL;
+
+	*type = header[0];
+	*len = ((size_t) header[1] << 24) | (header[2] << 16) | (header[3] << 8) | header[4];
+	if (*len > WIRE_MAX_FRAME) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	char *payload = xmalloc(*len + 1);
+	if (read_all(fd, payload, *len)) {
+		free(payload);
+		return NULL;
+	}
+	payload[*len] = 0;
+	return payload;
+}
+
+
+static ssize_t wire_cookie_write(void *c, const char *buf, size_t size) {
+	struct wire_cookie *cookie = c;
+	size_t done = 0;
+
+	while (done < size) {
+		size_t n = MIN(size - done, WIRE_MAX_FRAME);
+		if (wire_write_frame(cookie->fd, cookie->type, buf + done, n))
+			return done ? (ssize_t) done : -1;
+		done += n;
+	}
+	return done;
+}
+
+
+static int wire_cookie_close(void *c) {
+	free(c);
+	return 0;
+}
+
+
+/* Opens a stdio stream whose writes are sent to fd as frames of the given type */
+FILE *wire_open_stream(int fd, char type) {
+	static const cookie_io_functions_t funcs = { NULL, wire_cookie_write, NULL, wire_cookie_close };
+	struct wire_cookie *cookie = xmalloc(sizeof(*cookie));
+	cookie->fd = fd;
+	cookie->type = type;
+
+	FILE *stream = fopencookie(cookie, "w", funcs);
+	if (stream == NULL) {
+		free(cookie);
+	}
+	return stream;
+}
@@ -1,6 +1,8 @@
 #!/bin/bash
 
 BGREP=../src/bgrep
+BGREPD=../src/bgrepd
+BGREP_INDEX=../src/bgrep-index
 XXD=${XXD:-xxd}
 
 function XXDFUN() {
@@ -220,6 +222,462 @@ function test_bytes_around() {
 	fi
 }
 
+function test_jobs_order() {
+	# Parallel searches must print results in the same order as a serial search
+	mkdir -p jobs_tst
+	for i in $(seq 0 19) ; do
+		(dd if=/dev/urandom bs=1 count=$((i * 37)) status=none | tr -d 'f' ; echo "1234foo89abfoof0123") > jobs_tst/f$(printf "%02d" ${i}).bin
+	done
+
+	expected="$(${BGREP} -C 2 -H \"foo\" jobs_tst/*.bin)"
+	actual="$(${BGREP} -j 4 -C 2 -H \"foo\" jobs_tst/*.bin)"
+	unordered="$(${BGREP} -j 4 --unordered -c -H \"foo\" jobs_tst/*.bin | sort)"
+	rm -r jobs_tst
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+
+	expected="$(for i in $(seq 0 19) ; do printf "jobs_tst/f%02d.bin:2\n" ${i} ; done)"
+	if [[ "${expected}" != "${unordered}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED (--unordered)."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${unordered}"
+		return 1
+	fi
+}
+
+function test_daemon() {
+	# A search routed through bgrepd must print exactly what a local search prints, and only its user may connect
+	(dd if=/dev/urandom count=2 status=none | tr -d 'f' ; echo "1234foo89abfoof0123" ) > tst.bin
+	socket="bgrepd_tst.$$"
+
+	expected="$(${BGREP} -H -C 3 \"foo\" tst.bin missing.bin 2>&1 ; echo "rc=$?")"
+	expected="${expected} $(${BGREP} '"foo"??{9,1}"bar"' tst.bin 2>&1 ; echo "rc=$?")"
+	${BGREPD} "${socket}" &
+	local daemon_pid=$!
+	for i in $(seq 50) ; do [[ -S "${socket}" ]] && break ; sleep 0.1 ; done
+	mode="$(stat -c %a "${socket}")"
+	actual="$(${BGREP} --daemon="${socket}" -H -C 3 \"foo\" tst.bin missing.bin 2>&1 ; echo "rc=$?")"
+	# A pattern that does not parse is explained, not just refused
+	actual="${actual} $(${BGREP} --daemon="${socket}" '"foo"??{9,1}"bar"' tst.bin 2>&1 ; echo "rc=$?")"
+	kill ${daemon_pid}
+	wait ${daemon_pid} 2>/dev/null
+
+	# With no daemon listening, bgrep quietly searches locally
+	fallback="$(${BGREP} --daemon="${socket}" -H -C 3 \"foo\" tst.bin missing.bin 2>&1 ; echo "rc=$?")"
+	fallback="${fallback} $(${BGREP} --daemon="${socket}" '"foo"??{9,1}"bar"' tst.bin 2>&1 ; echo "rc=$?")"
+
+	# A file that is not a socket is never replaced
+	echo "keep" > tst.txt
+	${BGREPD} tst.txt 2>/dev/null
+	kept="$? $(cat tst.txt)"
+	rm -f tst.bin tst.txt "${socket}"
+
+	expected="${expected//..\/src\/bgrep:/}"
+	actual="${actual//..\/src\/bgrepd:/}"
+	fallback="${fallback//..\/src\/bgrep:/}"
+	if [[ "${expected}" != "${actual}" || "${expected}" != "${fallback}" || "${mode}" != 600 || "${kept}" != "2 keep" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}\nsocket mode 600, 2 keep"
+		echo -e "+++ Actual +++\n${actual}\nsocket mode ${mode}, ${kept}"
+		echo -e "+++ Fallback +++\n${fallback}"
+		return 1
+	fi
+}
+
+function test_index() {
+	# An indexed search must print exactly what a full search prints, even for files changed since indexing
+	mkdir -p index_tst
+	for i in $(seq 0 9) ; do
+		(dd if=/dev/urandom bs=1k count=$((i * 9)) status=none | tr -d 'f' ; echo "1234foo89abfoof0123" ; dd if=/dev/urandom bs=1k count=7 status=none | tr -d 'f') > index_tst/f${i}.bin
+	done
+	dd if=/dev/urandom bs=1k count=20 status=none | tr -d 'f' > index_tst/nomatch.bin
+	${BGREP_INDEX} -b 1k -k 10 index_tst.idx index_tst || { echo "${FUNCNAME[0]}: bgrep-index failed." ; rm -rf index_tst index_tst.idx ; return 1 ; }
+	echo "4foo" >> index_tst/nomatch.bin
+
+	expected="$(${BGREP} -r -H -b -C 3 \"4foo\" index_tst | sort ; ${BGREP} -r -c -H \"o\"??\"8\" index_tst | sort)"
+	actual="$(${BGREP} --index=index_tst.idx -r -H -b -C 3 \"4foo\" index_tst | sort ; ${BGREP} --index=index_tst.idx -r -c -H \"o\"??\"8\" index_tst | sort)"
+	rm -rf index_tst index_tst.idx
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_cache() {
+	# Results replayed from --cache must match a fresh search, and a changed file must be searched again
+	mkdir -p cache_tst
+	for i in $(seq 0 4) ; do
+		(dd if=/dev/urandom bs=1 count=$((i * 300)) status=none | tr -d 'f' ; echo "1234foo89abfoof0123") > cache_tst/f${i}.bin
+	done
+
+	expected="$(for opts in -Hb -Hc "-H -C 3" "-H -s 10" ; do ${BGREP} -r ${opts} \"foo\" cache_tst | sort ; done)"
+	first="$(for opts in -Hb -Hc "-H -C 3" "-H -s 10" ; do ${BGREP} --cache=cache_tst.d -r ${opts} \"foo\" cache_tst | sort ; done)"
+	second="$(for opts in -Hb -Hc "-H -C 3" "-H -s 10" ; do ${BGREP} --cache=cache_tst.d -r ${opts} \"foo\" cache_tst | sort ; done)"
+
+	echo "foo" >> cache_tst/f2.bin
+	changed_expected="$(${BGREP} -r -Hc \"foo\" cache_tst | sort)"
+	changed="$(${BGREP} --cache=cache_tst.d -r -Hc \"foo\" cache_tst | sort)"
+
+	# A record written by a concurrent -c after a full one must still serve -b
+	rm -rf cache_tst.d
+	${BGREP} --cache=cache_tst.d -c \"foo\" cache_tst/f0.bin > /dev/null
+	log="$(echo cache_tst.d/*.log)"
+	cp "${log}" count_only.log
+	rm -f "${log}"
+	${BGREP} --cache=cache_tst.d -b \"foo\" cache_tst/f0.bin > /dev/null
+	cat count_only.log >> "${log}"
+	${BGREP} --cache=cache_tst.d --stats=json -b \"foo\" cache_tst/f0.bin > /dev/null 2> stats.txt
+	stats="$(tail -n 1 stats.txt)"
+
+	# What -c records serves -b too
+	rm -rf cache_tst.d
+	${BGREP} --cache=cache_tst.d -c \"foo\" cache_tst/f0.bin > /dev/null
+	${BGREP} --cache=cache_tst.d --stats=json -b \"foo\" cache_tst/f0.bin > /dev/null 2> stats.txt
+	stats="${stats} $(tail -n 1 stats.txt)"
+	rm -rf cache_tst cache_tst.d count_only.log stats.txt
+
+	if [[ "${expected}" != "${first}" || "${expected}" != "${second}" || "${changed_expected}" != "${changed}" \
+			|| "${stats}" != *"\"files_pruned\":1,"*"\"files_pruned\":1,"* ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}\n${changed_expected}\nfiles_pruned 1, twice"
+		echo -e "+++ Actual +++\n${second}\n${changed}\n${stats}"
+		return 1
+	fi
+}
+
+function test_stats() {
+	# --stats must count what was actually read and matched, without changing the results
+	(dd if=/dev/urandom bs=1 count=1000 status=none | tr -d 'f' ; echo "1234foo89abfoof0123") > tst.bin
+	size=$(stat -c %s tst.bin)
+
+	expected="$(${BGREP} -b \"foo\" tst.bin)"
+	actual="$(${BGREP} --stats=json -b \"foo\" tst.bin 2>stats.txt)"
+	stats="$(tail -n 1 stats.txt)"
+	rm -f tst.bin stats.txt
+
+	if [[ "${expected}" != "${actual}" || "${stats}" != *"\"bytes_read\":${size},"* \
+			|| "${stats}" != *"\"files_opened\":1,"* || "${stats}" != *"\"matches\":2,"* ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}\nbytes_read ${size}, 1 file opened, 2 matches"
+		echo -e "+++ Actual +++\n${actual}\n${stats}"
+		return 1
+	fi
+}
+
+function test_decompress() {
+	# -z must print exactly what a search of the decompressed data prints, after-context included
+	(dd if=/dev/urandom bs=1k count=300 status=none | tr -d 'f' ; echo "1234foo89abfoof0123") > tst.bin
+	gzip -c tst.bin > tst.bin.gz
+	cat tst.bin.gz tst.bin.gz > tst2.bin.gz
+	cat tst.bin tst.bin > tst2.bin
+
+	expected="$(${BGREP} -A 5 \"foo\" tst.bin ; ${BGREP} -b \"foo\" tst2.bin ; ${BGREP} -c \"foo\" tst.bin)"
+	actual="$(${BGREP} -z -A 5 \"foo\" tst.bin.gz ; ${BGREP} -z -b \"foo\" tst2.bin.gz ; ${BGREP} -z -c \"foo\" < tst.bin)"
+	if command -v zstd > /dev/null && zstd -q -c tst.bin > tst.bin.zst \
+			&& ! ${BGREP} -z -q \"foo\" tst.bin.zst 2>&1 | grep -q "not compiled in" ; then
+		expected="${expected}$(${BGREP} -C 4 \"foo\" tst.bin)"
+		actual="${actual}$(cat tst.bin.zst | ${BGREP} -z -C 4 \"foo\")"
+	fi
+	rm -f tst.bin tst2.bin tst.bin.gz tst2.bin.gz tst.bin.zst
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_tee() {
+	# --tee must pass the data through untouched and report what a normal search prints
+	(dd if=/dev/urandom bs=1k count=300 status=none | tr -d 'f' ; echo "1234foo89abfoof0123" ; dd if=/dev/urandom bs=1k count=100 status=none) > tst.bin
+
+	expected="$(${BGREP} -b -A 3 \"foo\" tst.bin)"
+	cat tst.bin | ${BGREP} --tee=tee_report.txt -b -A 3 \"foo\" | cat > tee_out.bin
+	actual="$(cat tee_report.txt)"
+	${BGREP} --tee -q \"foo\" < tst.bin > tee_out2.bin
+	cmp -s tst.bin tee_out.bin && cmp -s tst.bin tee_out2.bin
+	copied=$?
+	rm -f tst.bin tee_out.bin tee_out2.bin tee_report.txt
+
+	if [[ "${expected}" != "${actual}" || ${copied} -ne 0 ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		[[ ${copied} -ne 0 ]] && echo "The data was not passed through unchanged."
+		return 1
+	fi
+}
+
+function test_carve() {
+	# --carve must write exactly the bytes around each match, and --carve-until must stop after the end pattern
+	(dd if=/dev/urandom bs=1k count=50 status=none | tr -d 'f' ; echo -n "1234foo89abfoof0123") > tst.bin
+
+	offsets=($(${BGREP} -b \"foo\" tst.bin))
+	${BGREP} --carve=carve_tst --carve-before=2 --carve-after=3 -c \"foo\" tst.bin > /dev/null
+	${BGREP} --carve=carve_tst2 --carve-until=\"01\" -c \"foo\" tst.bin > /dev/null
+	expected="34foo89a abfoof01 foo89abfoof01 foof01"
+	actual="$(cd carve_tst && cat tst.bin@${offsets[0]} ; echo -n " " ; cat tst.bin@${offsets[1]})"
+	actual="${actual} $(cd carve_tst2 && cat tst.bin@${offsets[0]} ; echo -n " " ; cat tst.bin@${offsets[1]})"
+	rm -rf tst.bin carve_tst carve_tst2
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_follow() {
+	# --follow must find matches appended later, including one split across two appends, exactly once
+	echo -n "1234fo" > tst.bin
+	${BGREP} --follow -b \"foo\" tst.bin > follow_out.txt &
+	local follow_pid=$!
+	sleep 0.3 ; echo -n "o89ab" >> tst.bin
+	sleep 0.3 ; echo -n "foof0123" >> tst.bin
+	sleep 0.3 ; kill -INT ${follow_pid}
+	wait ${follow_pid}
+	rc=$?
+
+	expected="$(${BGREP} -b \"foo\" tst.bin ; echo "rc=0")"
+	actual="$(cat follow_out.txt ; echo "rc=${rc}")"
+	rm -f tst.bin follow_out.txt
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_checkpoint() {
+	# --resume must report only the matches after the recorded offset, skip finished files and keep counts whole
+	echo -n "1234foo89abfoof0123" > tst.bin
+	echo -n "foo" > tst2.bin
+	${BGREP} --checkpoint=tst.ckpt -c \"foo\" tst.bin tst2.bin > /dev/null
+	# Pretend the search of tst.bin was interrupted after its first match
+	sed -i -e 's/^1 [0-9]* 2 \(.* tst.bin\)$/0 8 1 \1/' tst.ckpt
+
+	expected="$(echo 0000000b ; echo "tst.bin:2" ; echo "rc=2")"
+	actual="$(${BGREP} --checkpoint=tst.ckpt --resume -b \"foo\" tst.bin tst2.bin)"
+	sed -i -e 's/^1 [0-9]* 2 \(.* tst.bin\)$/0 8 1 \1/' tst.ckpt
+	actual="${actual}
+$(${BGREP} --checkpoint=tst.ckpt --resume -H -c \"foo\" tst.bin tst2.bin)"
+	${BGREP} --checkpoint=tst.ckpt --resume -c \"bar\" tst.bin 2> /dev/null
+	actual="${actual}
+rc=$?"
+	# A file rewritten in place at the same size is searched again from the start
+	expected="${expected}
+00000000"
+	${BGREP} --checkpoint=tst.ckpt -c \"foo\" tst.bin > /dev/null
+	sed -i -e 's/^1 [0-9]* 2 \(.* tst.bin\)$/0 8 1 \1/' tst.ckpt
+	echo -n "foo4567890abcdef012" > tst.bin
+	touch -m -d @1000000000 tst.bin
+	actual="${actual}
+$(${BGREP} --checkpoint=tst.ckpt --resume -b \"foo\" tst.bin)"
+	# Inputs that cannot be resumed are still searched, with a warning
+	expected="${expected}
+not checkpointed
+1"
+	mkfifo tst.fifo
+	(echo -n "foo" > tst.fifo &)
+	actual="${actual}
+$(${BGREP} --checkpoint=tst.ckpt -c \"foo\" tst.fifo 2>&1 | sed -e 's/.*\(not checkpointed\)$/\1/')"
+	rm -f tst.bin tst2.bin tst.ckpt tst.fifo
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_direct() {
+	# --direct and --drop-cache must find exactly what buffered reads find, whatever the read size and skip
+	(dd if=/dev/urandom bs=1k count=300 status=none | tr -d 'f' ; echo -n "1234foo89abfoof0123") > tst.bin
+
+	expected="$(${BGREP} -C 5 -s 3 \"foo\" tst.bin ; ${BGREP} -b \"foo\" tst.bin)"
+	expected="${expected}
+${expected}
+${expected}
+progress"
+	actual="$(${BGREP} --direct -C 5 -s 3 \"foo\" tst.bin ; ${BGREP} --direct --io-size=1000 -b \"foo\" tst.bin)"
+	actual="${actual}
+$(${BGREP} --drop-cache --io-size=4097 -C 5 -s 3 \"foo\" tst.bin ; ${BGREP} --drop-cache -b \"foo\" tst.bin)"
+	actual="${actual}
+$(${BGREP} --direct --progress -C 5 -s 3 \"foo\" tst.bin 2> progress.txt ; ${BGREP} --progress -b \"foo\" tst.bin 2>> progress.txt)"
+	grep -q " of .* (100\.0%)" progress.txt && actual="${actual}
+progress"
+	rm -f tst.bin progress.txt
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_pattern_file() {
+	# A pattern file must match like the same bytes given in hex, and a mask file like ?? and hex masks
+	echo -n "1234foo89abfoof0123" > tst.bin
+	echo -n "foo" > pattern.bin
+	echo -ne "fXo" > masked.bin
+	echo -ne "\xff\x00\xff" > mask.bin
+
+	# Long patterns take the fingerprint path; one straddles a pipe's reads
+	dd if=/dev/urandom of=long.bin bs=1k count=100 status=none
+	(dd if=/dev/urandom bs=1k count=50 status=none ; cat long.bin ; dd if=/dev/urandom bs=1 count=1000 status=none ;
+		cat long.bin long.bin) > tst2.bin
+
+	expected="$(${BGREP} -b 666f6f tst.bin ; ${BGREP} -b 66??6f tst.bin)"
+	expected="${expected}
+$(printf "%08x %08x %08x %08x" 0 153600 257000 359400)
+3"
+	actual="$(${BGREP} -b --pattern-file=pattern.bin tst.bin ; ${BGREP} -b --pattern-file=masked.bin --mask-file=mask.bin tst.bin)"
+	actual="${actual}
+$(cat long.bin tst2.bin | ${BGREP} -b --pattern-file=long.bin | tr '\n' ' ' | sed 's/ $//')
+$(cat tst2.bin | ${BGREP} -c --pattern-file=long.bin)"
+	rm -f tst.bin tst2.bin pattern.bin masked.bin mask.bin long.bin
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_count_short() {
+	# One- and two-byte patterns are counted a vector at a time; the counts must match -b,
+	# overlapping matches and ones that straddle a pipe's reads included
+	(head -c 100000 /dev/zero ; echo -n "1234foo89abfoof0123" ; head -c 70001 /dev/zero) > tst.bin
+
+	expected=""
+	actual=""
+	for pattern in 00 0000 \"o\" 6f?? ????; do
+		expected="${expected} $(${BGREP} -b ${pattern} tst.bin | wc -l)"
+		actual="${actual} $(cat tst.bin | ${BGREP} -c ${pattern})"
+	done
+	expected="${expected} 1 tst.bin 0 1"
+	actual="${actual} $(${BGREP} -cF 0000 tst.bin) $(${BGREP} -l \"3\" tst.bin) $(${BGREP} -q \"3\" tst.bin ; echo $?)"
+	actual="${actual} $(${BGREP} -q \"x\" tst.bin ; echo $?)"
+	rm -f tst.bin
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_variable_gap() {
+	# Gaps are as short as they can be; matches ending at the last byte of a pipe must still be found
+	(echo -n "HDRabcTRL..HDRTRL..HDRxxxxxxxxxxxxTRL" ; head -c 70000 /dev/zero ; echo -n "HDR1234TRL") > tst.bin
+
+	expected="$(printf "%08x\n%08x\n%08x" 0 11 70037)
+0000000: 4844 5261 6263 5452 4c                   HDRabcTRL
+4 2"
+	actual="$(cat tst.bin | ${BGREP} -b '"HDR"??{0,8}"TRL"')
+$(${BGREP} -F '"HDR"??{0,8}"TRL"' tst.bin)
+$(cat tst.bin | ${BGREP} -c '"HDR"??{0,16}"TRL"') $(${BGREP} -c '"HDR"??{3,8}"TRL"' tst.bin)"
+	rm -f tst.bin
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_pipe_after() {
+	# Pipes are read on a thread of their own; after-context must come from what was read,
+	# even when it arrives in a later read than the match
+	echo -n "1234foo89abfoof0123" > tst.bin
+
+	expected="$(${BGREP} -A 3 \"foo\" tst.bin ; ${BGREP} -b -A 3 \"foo\" tst.bin)"
+	actual="$(cat tst.bin | ${BGREP} -A 3 \"foo\" 2>&1 ; (echo -n "1234foo8" ; sleep 0.2 ; echo -n "9abfoof0123") | ${BGREP} -b -A 3 \"foo\")"
+	rm -f tst.bin
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_concat() {
+	# Segments are searched as one input: matches span them, and -b also gives the segment and offset within it.
+	# -H adds no name: the first segment's would be wrong for the others.  -c -H and -l call the whole "concat".
+	echo -n "1234fo" > tst.001
+	echo -n "o89abfo" > tst.002
+	echo -n "" > tst.003
+	echo -n "of0123" > tst.004
+
+	expected="00000004 tst.001:00000004
+0000000b tst.002:00000005
+00000004 tst.001:00000004
+0000000b tst.002:00000005
+$(cat tst.00? | ${BGREP} -A 3 -B 2 \"foo\")
+$(cat tst.00? | ${BGREP} \"foo\")
+concat:2
+concat
+4 2"
+	actual="$(${BGREP} --concat -b \"foo\" tst.00?)
+$(${BGREP} --concat -H -b \"foo\" tst.00?)
+$(${BGREP} --concat -A 3 -B 2 \"foo\" tst.00?)
+$(${BGREP} --concat -H \"foo\" tst.00?)
+$(${BGREP} --concat -c -H \"foo\" tst.00?)
+$(${BGREP} --concat -l \"foo\" tst.00?)
+$(${BGREP} --concat -c \"o\" tst.00?) $(${BGREP} --concat \"foo\" tst.001 - 2>/dev/null ; echo $?)"
+	rm -f tst.00?
+
+	if [[ "${expected}" != "${actual}" ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}"
+		echo -e "+++ Actual +++\n${actual}"
+		return 1
+	fi
+}
+
+function test_dedup_content() {
+	# Copies get the results of the first, under their own names; a same-size file that differs is searched
+	mkdir -p dedup_tst
+	(dd if=/dev/urandom bs=1 count=60000 status=none | tr -d 'fZ' ; echo "1234foo89abfoof0123") > dedup_tst/big0.bin
+	cp dedup_tst/big0.bin dedup_tst/big1.bin
+	cp dedup_tst/big0.bin dedup_tst/big2.bin
+	echo -n "Z" | dd of=dedup_tst/big2.bin bs=1 seek=30000 conv=notrunc status=none
+	echo "1234foo89abfoof0123" > dedup_tst/small0.bin
+	cp dedup_tst/small0.bin dedup_tst/small1.bin
+
+	expected="$(for opts in -Hb -Hc "-H -C 3" "-H -s 10" ; do ${BGREP} -r ${opts} \"foo\" dedup_tst | sort ; done)"
+	actual="$(for opts in -Hb -Hc "-H -C 3" "-H -s 10" ; do ${BGREP} --dedup-content -r ${opts} \"foo\" dedup_tst | sort ; done)"
+	${BGREP} --dedup-content --stats=json -r -b \"foo\" dedup_tst >/dev/null 2>stats.txt
+	stats="$(tail -n 1 stats.txt)"
+	rm -rf dedup_tst stats.txt
+
+	if [[ "${expected}" != "${actual}" || "${stats}" != *"\"files_pruned\":2,"* ]] ; then
+		echo "${FUNCNAME[0]}: Test FAILED."
+		echo -e "--- Expected ---\n${expected}\n2 files pruned"
+		echo -e "+++ Actual +++\n${actual}\n${stats}"
+		return 1
+	fi
+}
+
 failcount=0
 
 test_xxd_output || failcount=$((failcount+1))
@@ -235,6 +693,23 @@ test_dd_skip || failcount=$((failcount+1))
 test_bytes_before || failcount=$((failcount+1))
 test_bytes_after || failcount=$((failcount+1))
 test_bytes_around || failcount=$((failcount+1))
+test_jobs_order || failcount=$((failcount+1))
+test_daemon || failcount=$((failcount+1))
+test_index || failcount=$((failcount+1))
+test_cache || failcount=$((failcount+1))
+test_stats || failcount=$((failcount+1))
+test_decompress || failcount=$((failcount+1))
+test_tee || failcount=$((failcount+1))
+test_carve || failcount=$((failcount+1))
+test_follow || failcount=$((failcount+1))
+test_checkpoint || failcount=$((failcount+1))
+test_direct || failcount=$((failcount+1))
+test_pattern_file || failcount=$((failcount+1))
+test_count_short || failcount=$((failcount+1))
+test_variable_gap || failcount=$((failcount+1))
+test_pipe_after || failcount=$((failcount+1))
+test_concat || failcount=$((failcount+1))
+test_dedup_content || failcount=$((failcount+1))
 
 if [[ ${failcount} -eq 0 ]] ; then
 	echo ALL TESTS PASSED.
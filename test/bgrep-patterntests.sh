@@ -67,6 +67,12 @@ bad_patterns=(
 	'1234(5678)(1234(5678)'
 	'1234(5678)"1234(5678)'
 	'1234(5678)"12\"34(5678)'
+	'11??{0,3}'
+	'??{0,3}11'
+	'11??{3,1}22'
+	'11??{2}22'
+	'(11??{0,2}22)*2'
+	'11??{0,2}*2'
 )
 
 declare -A good_patterns=(
@@ -84,6 +90,7 @@ declare -A good_patterns=(
 	['12*3 44']="12121244ffffffff"
 	['((12 ??)*2)*2']="1200120012001200ff00ff00ff00ff00"
 	['"header"??*10"trailer"']="68656164657200000000000000000000747261696c6572ffffffffffff00000000000000000000ffffffffffffff"
+	['11??{2,5}22']="11000022ff0000ff"
 	['"a"*k']=$(printf "61%.0s" {1..1024} ; printf "ff%.0s" {1..1024})
 	['(("foo"*3 ??)*1k ff "bar") * 2']=$(
 		printf "666f6f666f6f666f6f00%.0s" {1..1024} ; echo -n "ff626172";
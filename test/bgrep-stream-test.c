@@ -0,0 +1,262 @@
+#include "config.h"
+
+#include <error.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* gnulib dependencies */
+#include "minmax.h"
+#include "progname.h"
+#include "xalloc.h"
+
+#include "libbgrep.h"
+
+/*
+ * bgrep-stream-test: part of "make check".
+ *
+ * Feeds one generated buffer through bgrep_stream_feed() in chunks of many
+ * sizes, from single bytes to the whole buffer, and checks that every match
+ * is reported exactly once, in order, at its absolute offset, just as
+ * bgrep_search_buffer() and the naive byte_pattern_match() loop find them.
+ * Patterns are planted across the stream's chunk boundaries, and one of them
+ * is long enough for the block fingerprints.
+ */
+
+enum { BUF_LEN = 6 * 64 * 1024 + 1234, HISTORY = 16, LONG_LEN = 70000 };
+static const uintmax_t BIG_BASE = 0x100000007ULL;
+
+struct pattern_case {
+	const char *text;
+	size_t plants[8];   /* offsets to plant it at; 0 ends the list */
+	struct byte_pattern *pattern;
+};
+
+static struct pattern_case patterns[] = {
+	{ "\"MZ\"",                   { 1, 4095, 65535, BUF_LEN - 2 }, NULL },
+	{ "\"aaa\"",                  { 300, 301, 302, 303, 100000, 100001 }, NULL },   /* overlapping matches */
+	{ "50??4b????03",             { 17, 131069 }, NULL },
+	{ "\"HDR\"??{0,8}\"TRL\"",    { 9, 196605 }, NULL },                          /* no naive reference */
+	{ "\"GAP\"??{0,100000}\"END\"", { 50, 65530, 250000 }, NULL },                 /* longer than a chunk */
+	{ NULL,                       { 197000, 267500 }, NULL },                     /* LONG_LEN letters, from long_literal() */
+};
+
+static const size_t chunk_sizes[] = { 1, 2, 3, 7, 64, 4093, 65535, 65537, BUF_LEN };
+
+/* What one run found */
+struct match_list {
+	uintmax_t *offsets;
+	size_t count;
+	size_t alloc;
+	const unsigned char *buf;   /* the data searched */
+	uintmax_t base;             /* absolute offset of buf[0] */
+	size_t history;             /* before-context to expect */
+	int failed;
+};
+
+static int failures;
+
+
+/* xorshift64*, so the buffer is the same on every run */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+
+/* A quoted string of LONG_LEN letters */
+static char *long_literal(void) {
+	char *text = xmalloc(LONG_LEN + 3);
+	size_t i = 1;
+	text[0] = '"';
+	for (; i <= LONG_LEN; ++i) {
+		text[i] = 'a' + next_random() % 26;
+	}
+	text[i++] = '"';
+	text[i] = 0;
+	return text;
+}
+
+
+/* Writes pattern into buf at every planned offset that leaves room for it, wildcards filled in at random */
+static void plant(unsigned char *buf, const struct pattern_case *pc) {
+	const struct byte_pattern *pattern = pc->pattern;
+	size_t n = 0;
+	for (; n < sizeof(pc->plants) / sizeof(*pc->plants) && pc->plants[n] != 0; ++n) {
+		if (pc->plants[n] + pattern->len > BUF_LEN)
+			continue;
+		unsigned char *dest = buf + pc->plants[n];
+		size_t i = 0;
+		for (; i < pattern->len; ++i) {
+			dest[i] = pattern->value[i] | (next_random() & ~pattern->mask[i]);
+		}
+	}
+}
+
+
+static void add_offset(struct match_list *list, uintmax_t offset) {
+	if (list->count == list->alloc) {
+		list->offsets = x2nrealloc(list->offsets, &list->alloc, sizeof(*list->offsets));
+	}
+	list->offsets[list->count++] = offset;
+}
+
+
+/* Records a match after checking that its data and before-context are the buffer's */
+static int on_match(const struct bgrep_match *match, void *arg) {
+	struct match_list *list = arg;
+	size_t at = match->offset - list->base;
+
+	if (match->offset < list->base || at + match->len > BUF_LEN
+			|| memcmp(match->data, list->buf + at, match->len)) {
+		error(0, 0, "match at %ju: wrong data", match->offset);
+		list->failed = 1;
+	} else if (match->before_len != MIN(list->history, at)
+			|| memcmp(match->before, list->buf + at - match->before_len, match->before_len)) {
+		error(0, 0, "match at %ju: wrong before-context", match->offset);
+		list->failed = 1;
+	}
+	add_offset(list, match->offset);
+	return 0;
+}
+
+
+/* The reference: byte_pattern_match() tried from every position in turn */
+static void search_naive(const struct byte_pattern *pattern, const unsigned char *buf, struct match_list *list) {
+	const unsigned char *p = buf;
+	const unsigned char *match;
+	while ((match = byte_pattern_match(pattern, p, buf + BUF_LEN - p)) != NULL) {
+		add_offset(list, match - buf);
+		p = match + 1;
+	}
+}
+
+
+static void search_stream(const struct byte_pattern *pattern, const unsigned char *buf, size_t chunk,
+		struct match_list *list) {
+	struct bgrep_stream *stream = bgrep_stream_new(pattern, list->history, on_match, list);
+	bgrep_stream_reset(stream, list->base);
+	size_t pos = 0;
+	for (; pos < BUF_LEN; pos += chunk) {
+		bgrep_stream_feed(stream, buf + pos, MIN(chunk, BUF_LEN - pos));
+	}
+	bgrep_stream_finish(stream);
+	if (bgrep_stream_offset(stream) != list->base + BUF_LEN) {
+		error(0, 0, "stream offset %ju after %d bytes from %ju", bgrep_stream_offset(stream), BUF_LEN, list->base);
+		list->failed = 1;
+	}
+	bgrep_stream_free(stream);
+}
+
+
+static uintmax_t count_stream(const struct byte_pattern *pattern, const unsigned char *buf, size_t chunk) {
+	struct bgrep_stream *stream = bgrep_stream_new(pattern, 0, on_match, NULL);
+	bgrep_stream_reset(stream, 0);
+	bgrep_stream_count_only(stream, 0);
+	size_t pos = 0;
+	for (; pos < BUF_LEN; pos += chunk) {
+		bgrep_stream_feed(stream, buf + pos, MIN(chunk, BUF_LEN - pos));
+	}
+	bgrep_stream_finish(stream);
+	uintmax_t matches = bgrep_stream_matches(stream);
+	bgrep_stream_free(stream);
+	return matches;
+}
+
+
+/* Compares got, with its offsets less base, to expected */
+static void check(const char *what, const char *pattern_text, const struct match_list *expected,
+		const struct match_list *got) {
+	size_t i = 0;
+	int differ = got->failed || got->count != expected->count;
+	for (; !differ && i < got->count; ++i) {
+		differ = (got->offsets[i] - got->base != expected->offsets[i]);
+	}
+	if (differ) {
+		error(0, 0, "%.40s: %s: %zu matches, expected %zu", pattern_text, what, got->count, expected->count);
+		++failures;
+	}
+}
+
+
+int main(int argc, char **argv) {
+	(void) argc;
+	set_program_name(*argv);
+
+	unsigned char *buf = xmalloc(BUF_LEN);
+	size_t i = 0;
+	for (; i < BUF_LEN; ++i) {
+		buf[i] = next_random();
+	}
+
+	char *generated = long_literal();
+	size_t p = 0;
+	for (; p < sizeof(patterns) / sizeof(*patterns); ++p) {
+		if (patterns[p].text == NULL)
+			patterns[p].text = generated;
+		patterns[p].pattern = byte_pattern_from_string(patterns[p].text);
+		if (patterns[p].pattern == NULL) {
+			error(EXIT_FAILURE, 0, "cannot parse test pattern %.40s", patterns[p].text);
+		}
+		plant(buf, &patterns[p]);
+	}
+
+	for (p = 0; p < sizeof(patterns) / sizeof(*patterns); ++p) {
+		const struct pattern_case *pc = &patterns[p];
+		struct match_list expected = { NULL, 0, 0, buf, 0, SIZE_MAX, 0 };
+		bgrep_search_buffer(pc->pattern, buf, BUF_LEN, on_match, &expected);
+		if (expected.failed || expected.count == 0) {
+			error(0, 0, "%.40s: bgrep_search_buffer found %zu matches", pc->text, expected.count);
+			++failures;
+		}
+
+		if (pc->pattern->gap_count == 0) {
+			struct match_list naive = { NULL, 0, 0, buf, 0, 0, 0 };
+			search_naive(pc->pattern, buf, &naive);
+			check("bgrep_search_buffer", pc->text, &naive, &expected);
+			free(naive.offsets);
+		}
+
+		size_t c = 0;
+		for (; c < sizeof(chunk_sizes) / sizeof(*chunk_sizes); ++c) {
+			char what[64];
+			struct match_list got = { NULL, 0, 0, buf, 0, HISTORY, 0 };
+			snprintf(what, sizeof(what), "%zu-byte feeds", chunk_sizes[c]);
+			search_stream(pc->pattern, buf, chunk_sizes[c], &got);
+			check(what, pc->text, &expected, &got);
+
+			got.count = 0;
+			got.failed = 0;
+			got.base = BIG_BASE;
+			snprintf(what, sizeof(what), "%zu-byte feeds from %ju", chunk_sizes[c], BIG_BASE);
+			search_stream(pc->pattern, buf, chunk_sizes[c], &got);
+			check(what, pc->text, &expected, &got);
+			free(got.offsets);
+
+			if (pc->pattern->gap_count == 0) {
+				uintmax_t count = count_stream(pc->pattern, buf, chunk_sizes[c]);
+				if (count != expected.count) {
+					error(0, 0, "%.40s: counted %ju matches in %zu-byte feeds, expected %zu",
+							pc->text, count, chunk_sizes[c], expected.count);
+					++failures;
+				}
+			}
+		}
+		free(expected.offsets);
+	}
+
+	for (p = 0; p < sizeof(patterns) / sizeof(*patterns); ++p) {
+		byte_pattern_free(patterns[p].pattern);
+	}
+	free(generated);
+	free(buf);
+	if (failures) {
+		printf("%d stream checks failed\n", failures);
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}